@@ -0,0 +1,11 @@
+#version 120
+
+uniform sampler2D u_texture;
+uniform sampler2D u_palette;
+varying vec2 v_texcoord;
+
+void main() {
+    float index = texture2D(u_texture, v_texcoord).r;
+    gl_FragColor = texture2D(
+        u_palette, vec2(index * (255.0 / 256.0) + (0.5 / 256.0), 0.5));
+}
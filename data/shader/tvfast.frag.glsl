@@ -0,0 +1,31 @@
+#version 120
+
+// Cheaper TV effect.  The pattern and vignette come from a lookup
+// texture covering the screen (rgb = pattern, a = vignette), and the
+// noise and banding come from one small tiled texture (rgb = noise,
+// a = banding).  The texture is read twice, so the noise and banding
+// move independently, as in the full shader.
+
+uniform sampler2D u_picture;
+uniform sampler2D u_pattern;
+uniform sampler2D u_noise;
+uniform vec4 u_noiseoffset;
+uniform vec2 u_texscale;
+uniform vec4 u_color;
+varying vec2 v_texcoord;
+
+void main() {
+    vec4 picture = texture2D(
+        u_picture, v_texcoord * u_texscale);
+    vec4 lut = texture2D(
+        u_pattern, v_texcoord * vec2(0.003125, 0.005555556));
+    vec4 grain = texture2D(
+        u_noise, (v_texcoord + u_noiseoffset.xy) * vec2(0.015625, 0.0078125));
+    float banding = texture2D(
+        u_noise, (v_texcoord + u_noiseoffset.wz) *
+        vec2(0.015625, 0.0078125)).a;
+
+    gl_FragColor =
+        (picture * (1.0 - u_color.a * lut.a) + u_color * lut.a) *
+        vec4(lut.rgb, 1.0) * banding + vec4(grain.rgb, 0.0);
+}
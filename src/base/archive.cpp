@@ -0,0 +1,494 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include "archive.hpp"
+#include "defs.hpp"
+#include "file.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#if defined _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+namespace archive {
+
+// The archive starts with a header and an index sorted by path, and
+// each file's data starts on a 64-byte boundary, so it can be used in
+// place once the archive is mapped.
+//
+// Header:
+//   0: magic, "OPAK"
+//   4: version
+//   8: number of entries
+//   12: reserved
+//
+// Index entry:
+//   0: path offset
+//   4: path length
+//   8: data offset
+//   12: number of bytes stored
+//   16: number of bytes after decompression
+//   20: flags
+
+const char DEFAULT_PATH[] = "data.pak";
+
+namespace {
+
+/// Archive file magic, "OPAK".
+const unsigned MAGIC = 0x4b41504fu;
+/// Archive file version.
+const unsigned VERSION = 1;
+/// Size of the archive header.
+const std::size_t HEADER = 16;
+/// Size of each index entry.
+const std::size_t ENTRY = 24;
+/// Alignment of file data.
+const std::size_t ALIGN = 64;
+/// Entry flag for LZ4 compressed data.
+const unsigned FLAG_LZ4 = 1;
+
+/// The mapped archive.
+struct mapping {
+    const unsigned char *ptr;
+    std::size_t size;
+    unsigned count;
+#if defined _WIN32
+    HANDLE file;
+    HANDLE map;
+#endif
+};
+
+mapping cur;
+
+}
+
+static unsigned read_u32(const unsigned char *p)
+{
+    return (unsigned)p[0] | ((unsigned)p[1] << 8) |
+        ((unsigned)p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static void write_u32(unsigned char *p, unsigned x)
+{
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+/// Map a file into memory.  Returns false if it cannot be opened.
+static bool map_file(mapping &m, const std::string &path)
+{
+#if defined _WIN32
+    m.file = CreateFileA(
+        path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m.file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m.file, &size) || size.QuadPart == 0) {
+        CloseHandle(m.file);
+        return false;
+    }
+    m.map = CreateFileMappingA(
+        m.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m.map) {
+        CloseHandle(m.file);
+        return false;
+    }
+    void *ptr = MapViewOfFile(m.map, FILE_MAP_READ, 0, 0, 0);
+    if (!ptr) {
+        CloseHandle(m.map);
+        CloseHandle(m.file);
+        return false;
+    }
+    m.ptr = static_cast<const unsigned char *>(ptr);
+    m.size = (std::size_t)size.QuadPart;
+    return true;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED)
+        return false;
+    m.ptr = static_cast<const unsigned char *>(ptr);
+    m.size = st.st_size;
+    return true;
+#endif
+}
+
+static void unmap_file(mapping &m)
+{
+    if (!m.ptr)
+        return;
+#if defined _WIN32
+    UnmapViewOfFile(m.ptr);
+    CloseHandle(m.map);
+    CloseHandle(m.file);
+#else
+    munmap(const_cast<unsigned char *>(m.ptr), m.size);
+#endif
+    m.ptr = nullptr;
+    m.size = 0;
+    m.count = 0;
+}
+
+/// Compare an entry's path with a path.
+static int compare_path(const unsigned char *e,
+                        const char *path, std::size_t len)
+{
+    const char *name =
+        reinterpret_cast<const char *>(cur.ptr + read_u32(e));
+    std::size_t namelen = read_u32(e + 4);
+    int r = std::memcmp(name, path, std::min(namelen, len));
+    if (r)
+        return r;
+    return namelen < len ? -1 : namelen > len ? +1 : 0;
+}
+
+/// Check that the index is in bounds and sorted.
+static bool check_index(const mapping &m)
+{
+    if (m.size < HEADER || read_u32(m.ptr) != MAGIC ||
+        read_u32(m.ptr + 4) != VERSION)
+        return false;
+    std::size_t count = read_u32(m.ptr + 8);
+    if (count > (m.size - HEADER) / ENTRY)
+        return false;
+    const unsigned char *prev = nullptr;
+    for (std::size_t i = 0; i < count; i++) {
+        const unsigned char *e = m.ptr + HEADER + ENTRY * i;
+        std::size_t name = read_u32(e), namelen = read_u32(e + 4);
+        std::size_t off = read_u32(e + 8), stored = read_u32(e + 12);
+        if (name > m.size || namelen > m.size - name ||
+            off > m.size || stored > m.size - off)
+            return false;
+        if (!(read_u32(e + 20) & FLAG_LZ4) && stored != read_u32(e + 16))
+            return false;
+        if (prev) {
+            const char *pname = reinterpret_cast<const char *>(
+                m.ptr + read_u32(prev));
+            std::size_t plen = read_u32(prev + 4);
+            int r = std::memcmp(pname, m.ptr + name,
+                                std::min(plen, namelen));
+            if (r > 0 || (r == 0 && plen >= namelen))
+                return false;
+        }
+        prev = e;
+    }
+    return true;
+}
+
+bool open(const std::string &path)
+{
+    close();
+    mapping m;
+    if (!map_file(m, path))
+        return false;
+    if (!check_index(m)) {
+        std::fprintf(stderr, "Invalid archive: %s\n", path.c_str());
+        unmap_file(m);
+        return false;
+    }
+    m.count = read_u32(m.ptr + 8);
+    cur = m;
+    std::fprintf(stderr, "Using %u files from %s\n",
+                 cur.count, path.c_str());
+    return true;
+}
+
+void close()
+{
+    unmap_file(cur);
+}
+
+bool find(const std::string &path, entry *e)
+{
+    if (!cur.ptr)
+        return false;
+    std::size_t lo = 0, hi = cur.count;
+    while (lo < hi) {
+        std::size_t mid = lo + (hi - lo) / 2;
+        const unsigned char *p = cur.ptr + HEADER + ENTRY * mid;
+        int r = compare_path(p, path.data(), path.size());
+        if (r < 0) {
+            lo = mid + 1;
+        } else if (r > 0) {
+            hi = mid;
+        } else {
+            e->data = cur.ptr + read_u32(p + 8);
+            e->stored = read_u32(p + 12);
+            e->size = read_u32(p + 16);
+            e->compressed = (read_u32(p + 20) & FLAG_LZ4) != 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+// ======================================================================
+// LZ4 block format.
+
+namespace {
+
+/// Smallest match.
+const std::size_t MINMATCH = 4;
+/// Matches must start this far from the end of the block.
+const std::size_t MFLIMIT = 12;
+/// The block ends with this many literals.
+const std::size_t LASTLITERALS = 5;
+const int HASH_BITS = 14;
+
+}
+
+/// Read an LZ4 length continuation.  Returns false on overrun.
+static bool read_length(const unsigned char *&ip, const unsigned char *end,
+                        std::size_t &len)
+{
+    unsigned char b;
+    do {
+        if (ip == end)
+            return false;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+bool decompress(const entry &e, void *dest)
+{
+    if (!e.compressed) {
+        std::memcpy(dest, e.data, e.size);
+        return true;
+    }
+    const unsigned char *ip = e.data, *iend = ip + e.stored;
+    unsigned char *op = static_cast<unsigned char *>(dest);
+    unsigned char *ostart = op, *oend = op + e.size;
+    while (ip != iend) {
+        unsigned token = *ip++;
+        std::size_t len = token >> 4;
+        if (len == 15 && !read_length(ip, iend, len))
+            return false;
+        if (len > (std::size_t)(iend - ip) ||
+            len > (std::size_t)(oend - op))
+            return false;
+        std::memcpy(op, ip, len);
+        ip += len;
+        op += len;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return false;
+        std::size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (std::size_t)(op - ostart))
+            return false;
+        len = token & 15;
+        if (len == 15 && !read_length(ip, iend, len))
+            return false;
+        len += MINMATCH;
+        if (len > (std::size_t)(oend - op))
+            return false;
+        // Matches may overlap their own output.
+        const unsigned char *mp = op - offset;
+        for (std::size_t i = 0; i < len; i++)
+            op[i] = mp[i];
+        op += len;
+    }
+    return op == oend;
+}
+
+static void write_length(std::vector<unsigned char> &out, std::size_t len)
+{
+    for (; len >= 255; len -= 255)
+        out.push_back(255);
+    out.push_back(len);
+}
+
+/// Write a sequence of literals, followed by a match unless this is
+/// the last sequence.
+static void write_sequence(std::vector<unsigned char> &out,
+                           const unsigned char *lit, std::size_t litlen,
+                           std::size_t offset, std::size_t matchlen)
+{
+    std::size_t mlen = matchlen ? matchlen - MINMATCH : 0;
+    out.push_back((std::min<std::size_t>(litlen, 15) << 4) |
+                  std::min<std::size_t>(mlen, 15));
+    if (litlen >= 15)
+        write_length(out, litlen - 15);
+    out.insert(out.end(), lit, lit + litlen);
+    if (!matchlen)
+        return;
+    out.push_back(offset);
+    out.push_back(offset >> 8);
+    if (mlen >= 15)
+        write_length(out, mlen - 15);
+}
+
+/// Compress a buffer with a greedy LZ4 matcher.
+static std::vector<unsigned char> compress(const unsigned char *src,
+                                           std::size_t size)
+{
+    std::vector<unsigned char> out;
+    std::vector<int> table(1 << HASH_BITS, -1);
+    std::size_t anchor = 0, pos = 0;
+    while (pos + MFLIMIT <= size) {
+        unsigned seq;
+        std::memcpy(&seq, src + pos, 4);
+        unsigned h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        int ref = table[h];
+        table[h] = (int)pos;
+        if (ref < 0 || pos - ref > 65535 ||
+            std::memcmp(src + ref, src + pos, 4)) {
+            pos++;
+            continue;
+        }
+        std::size_t len = MINMATCH, maxlen = size - LASTLITERALS - pos;
+        while (len < maxlen && src[ref + len] == src[pos + len])
+            len++;
+        write_sequence(out, src + anchor, pos - anchor, pos - ref, len);
+        pos += len;
+        anchor = pos;
+    }
+    write_sequence(out, src + anchor, size - anchor, 0, 0);
+    return out;
+}
+
+// ======================================================================
+// Building archives.
+
+/// List the files under a directory, recursively.  Paths use '/'
+/// separators.  Hidden files are skipped.
+static void list_files(const std::string &dir, std::vector<std::string> &out)
+{
+#if defined _WIN32
+    WIN32_FIND_DATAA fd;
+    HANDLE h = FindFirstFileA((dir.empty() ? "*" : dir + "/*").c_str(), &fd);
+    if (h == INVALID_HANDLE_VALUE)
+        return;
+    do {
+        if (fd.cFileName[0] == '.')
+            continue;
+        std::string path = dir.empty() ? fd.cFileName :
+            dir + '/' + fd.cFileName;
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            list_files(path, out);
+        else
+            out.push_back(std::move(path));
+    } while (FindNextFileA(h, &fd));
+    FindClose(h);
+#else
+    DIR *d = opendir(dir.empty() ? "." : dir.c_str());
+    if (!d)
+        return;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != nullptr) {
+        if (ent->d_name[0] == '.')
+            continue;
+        std::string path = dir.empty() ? ent->d_name :
+            dir + '/' + ent->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st))
+            continue;
+        if (S_ISDIR(st.st_mode))
+            list_files(path, out);
+        else if (S_ISREG(st.st_mode))
+            out.push_back(std::move(path));
+    }
+    closedir(d);
+#endif
+}
+
+/// Determine whether a string ends with a suffix.
+static bool ends_with(const std::string &s, const char *suffix)
+{
+    std::size_t n = std::strlen(suffix);
+    return s.size() >= n && !s.compare(s.size() - n, n, suffix);
+}
+
+void build(const std::string &path)
+{
+    close();
+    std::vector<std::string> names;
+    list_files(std::string(), names);
+    names.erase(std::remove(names.begin(), names.end(), path), names.end());
+    std::sort(names.begin(), names.end());
+
+    std::size_t count = names.size();
+    std::vector<unsigned char> head(HEADER + ENTRY * count);
+    write_u32(&head[0], MAGIC);
+    write_u32(&head[4], VERSION);
+    write_u32(&head[8], count);
+    for (std::size_t i = 0; i < count; i++) {
+        write_u32(&head[HEADER + ENTRY * i], head.size());
+        write_u32(&head[HEADER + ENTRY * i + 4], names[i].size());
+        head.insert(head.end(), names[i].begin(), names[i].end());
+    }
+
+    std::vector<unsigned char> body;
+    std::size_t rawsize = 0;
+    for (std::size_t i = 0; i < count; i++) {
+        data file;
+        if (!data::read(&file, names[i]))
+            core::die("Failed to build archive");
+        const unsigned char *p =
+            static_cast<const unsigned char *>(file.ptr());
+        std::size_t size = file.size();
+        rawsize += size;
+
+        // Only keep the compressed data if it saves enough to be worth
+        // decompressing, which leaves out PNG and Ogg files.  Compiled
+        // levels and the sound bank are used in place, so they are
+        // never compressed.
+        bool lz4 = false;
+        std::vector<unsigned char> packed;
+        if (!ends_with(names[i], ".lvl") &&
+            !ends_with(names[i], ".bank")) {
+            packed = compress(p, size);
+            lz4 = packed.size() < size - size / 8;
+        }
+        if (lz4) {
+            p = packed.data();
+            size = packed.size();
+        }
+
+        std::size_t off = body.size();
+        off += (ALIGN - (head.size() + off) % ALIGN) % ALIGN;
+        body.resize(off);
+        body.insert(body.end(), p, p + size);
+        unsigned char *e = &head[HEADER + ENTRY * i];
+        write_u32(e + 8, head.size() + off);
+        write_u32(e + 12, size);
+        write_u32(e + 16, file.size());
+        write_u32(e + 20, lz4 ? FLAG_LZ4 : 0);
+    }
+
+    FILE *fp = std::fopen(path.c_str(), "wb");
+    if (!fp) {
+        std::fprintf(stderr, "Could not open file: %s\n", path.c_str());
+        core::die("Failed to build archive");
+    }
+    std::size_t amt = std::fwrite(head.data(), 1, head.size(), fp);
+    amt += std::fwrite(body.data(), 1, body.size(), fp);
+    if (std::fclose(fp) || amt != head.size() + body.size())
+        core::die("Failed to build archive");
+
+    std::fprintf(stderr, "Wrote %zu files to %s, %zu bytes from %zu\n",
+                 count, path.c_str(), head.size() + body.size(), rawsize);
+}
+
+}
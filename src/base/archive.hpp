@@ -0,0 +1,43 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_ARCHIVE_HPP
+#define LD_ARCHIVE_HPP
+#include <cstddef>
+#include <string>
+namespace archive {
+
+/// Name of the archive in the data directory.
+extern const char DEFAULT_PATH[];
+
+/// A file in the archive.  The data points into the mapped archive.
+struct entry {
+    const unsigned char *data;
+    /// Number of bytes stored in the archive.
+    std::size_t stored;
+    /// Number of bytes after decompression.
+    std::size_t size;
+    /// Whether the data is LZ4 compressed.
+    bool compressed;
+};
+
+/// Map an archive into memory, so files are read from it instead of
+/// from the data directory.  Returns false if it is missing or invalid.
+bool open(const std::string &path);
+
+/// Unmap the archive.
+void close();
+
+/// Find a file in the archive.  Returns false if there is no archive
+/// or the file is not in it.
+bool find(const std::string &path, entry *e);
+
+/// Decompress an entry into a buffer of entry.size bytes.  Returns
+/// false if the data is corrupt.
+bool decompress(const entry &e, void *dest);
+
+/// Pack the files in the current directory into an archive.
+void build(const std::string &path);
+
+}
+#endif
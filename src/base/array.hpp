@@ -8,6 +8,7 @@
 #include <limits>
 #include <new>
 #include <cstdlib>
+#include <cstring>
 
 namespace array {
 
@@ -71,6 +72,10 @@ private:
     int count_;
     int alloc_;
     GLuint buffer_;
+    // Copy of the data in the buffer, for detecting changes.
+    T *shadow_;
+    int shadowcount_;
+    int shadowalloc_;
 
 public:
     explicit array();
@@ -84,43 +89,56 @@ public:
     int size() const;
     /// Determine whether the array is empty.
     bool empty() const;
+    /// Get the array elements.
+    const T *data() const;
     /// Set the number of elements in the array to zero.
     void clear();
     /// Reserve space for the given total number of elements.
     void reserve(std::size_t total);
     /// Insert the given number of elements and return a pointer to the first.
     T *insert(std::size_t count);
-    /// Upload the array to an OpenGL buffer.
-    void upload(GLenum usage);
+    /// Upload the array to an OpenGL buffer, unless it is unchanged since
+    /// the last upload.  Returns true if the contents changed.
+    bool upload(GLenum usage);
     /// Set the array as a vertex attribute.
     void set_attrib(GLint attrib);
 };
 
 template<class T>
 inline array<T>::array()
-    : data_(nullptr), count_(0), alloc_(0), buffer_(0)
+    : data_(nullptr), count_(0), alloc_(0), buffer_(0),
+      shadow_(nullptr), shadowcount_(0), shadowalloc_(0)
 {
 }
 
 template<class T>
 inline array<T>::array(array<T> &&other)
-    : data_(nullptr), count_(0), alloc_(0), buffer_(0)
+    : data_(nullptr), count_(0), alloc_(0), buffer_(0),
+      shadow_(nullptr), shadowcount_(0), shadowalloc_(0)
 {
     data_ = other.data_;
     count_ = other.count_;
     alloc_ = other.alloc_;
     buffer_ = other.buffer_;
+    shadow_ = other.shadow_;
+    shadowcount_ = other.shadowcount_;
+    shadowalloc_ = other.shadowalloc_;
     other.data_ = nullptr;
     other.count_ = 0;
     other.alloc_ = 0;
     other.buffer_ = 0;
+    other.shadow_ = nullptr;
+    other.shadowcount_ = 0;
+    other.shadowalloc_ = 0;
 }
 
 template<class T>
 inline array<T>::~array()
 {
     std::free(data_);
-    glDeleteBuffers(1, &buffer_);
+    std::free(shadow_);
+    if (buffer_ != 0)
+        glDeleteBuffers(1, &buffer_);
 }
 
 template<class T>
@@ -129,14 +147,21 @@ array<T> &array<T>::operator=(array<T> &&other)
     if (this == &other)
         return *this;
     std::free(data_);
+    std::free(shadow_);
     data_ = other.data_;
     count_ = other.count_;
     alloc_ = other.alloc_;
     buffer_ = other.buffer_;
+    shadow_ = other.shadow_;
+    shadowcount_ = other.shadowcount_;
+    shadowalloc_ = other.shadowalloc_;
     other.data_ = nullptr;
     other.count_ = 0;
     other.alloc_ = 0;
     other.buffer_ = 0;
+    other.shadow_ = nullptr;
+    other.shadowcount_ = 0;
+    other.shadowalloc_ = 0;
     return *this;
 }
 
@@ -146,6 +171,12 @@ int array<T>::size() const
     return count_;
 }
 
+template<class T>
+const T *array<T>::data() const
+{
+    return data_;
+}
+
 template<class T>
 bool array<T>::empty() const
 {
@@ -194,13 +225,30 @@ T *array<T>::insert(std::size_t count)
 }
 
 template<class T>
-void array<T>::upload(GLenum usage)
+bool array<T>::upload(GLenum usage)
 {
+    if (buffer_ != 0 && count_ == shadowcount_ &&
+        (count_ == 0 ||
+         !std::memcmp(data_, shadow_, sizeof(T) * count_)))
+        return false;
+    if (shadowalloc_ < count_) {
+        T *newshadow = static_cast<T *>(
+            std::realloc(shadow_, sizeof(T) * alloc_));
+        if (!newshadow)
+            throw std::bad_alloc();
+        shadow_ = newshadow;
+        shadowalloc_ = alloc_;
+    }
+    if (count_ > 0)
+        std::memcpy(shadow_, data_, sizeof(T) * count_);
+    shadowcount_ = count_;
+
     if (buffer_ == 0)
         glGenBuffers(1, &buffer_);
     glBindBuffer(GL_ARRAY_BUFFER, buffer_);
     glBufferData(GL_ARRAY_BUFFER, count_ * sizeof(T), data_, usage);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return true;
 }
 
 template<class T>
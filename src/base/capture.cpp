@@ -0,0 +1,226 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include "capture.hpp"
+#include "defs.hpp"
+#include <cstring>
+#include <SDL.h>
+#include <SDL_image.h>
+namespace capture {
+
+static bool ends_with(const std::string &s, const char *suffix)
+{
+    std::size_t n = std::strlen(suffix);
+    return s.size() >= n && !s.compare(s.size() - n, n, suffix);
+}
+
+recorder::recorder(const std::string &path, int width, int height)
+    : path_(path), file_(nullptr), width_(width), height_(height),
+      sync_(false), first_(0), pending_(0), frame_count_(0),
+      dropped_gpu_(0), dropped_encoder_(0), done_(false), written_(0)
+{
+    if (ends_with(path, ".raw")) {
+        file_ = std::fopen(path.c_str(), "wb");
+        if (!file_) {
+            std::fprintf(stderr, "Could not open file: %s\n", path.c_str());
+            core::die("Failed to start capture");
+        }
+    }
+
+#if defined USE_GLEW
+    sync_ = GLEW_ARB_sync != 0;
+#endif
+    for (int i = 0; i < BUFFERS; i++) {
+        slot &s = slots_[i];
+        glGenBuffers(1, &s.buffer);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, s.buffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4,
+                     nullptr, GL_STREAM_READ);
+#if defined USE_GLEW
+        s.fence = nullptr;
+#endif
+        s.number = 0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    core::check_gl_error(HERE);
+
+    std::fprintf(stderr, "Capturing %dx%d frames to %s\n",
+                 width, height, path.c_str());
+    thread_ = std::thread(&recorder::run, this);
+}
+
+recorder::~recorder()
+{
+    while (pending_ > 0)
+        read();
+    for (int i = 0; i < BUFFERS; i++)
+        glDeleteBuffers(1, &slots_[i].buffer);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+    if (file_ && std::fclose(file_))
+        std::fprintf(stderr, "Error writing %s\n", path_.c_str());
+
+    std::fprintf(
+        stderr, "Captured %d of %d frames, dropped %d "
+        "(%d waiting for the GPU, %d waiting for the encoder)\n",
+        written_, frame_count_, dropped_gpu_ + dropped_encoder_,
+        dropped_gpu_, dropped_encoder_);
+}
+
+void recorder::capture(GLuint framebuffer)
+{
+    int number = frame_count_++;
+    while (pending_ > 0 && ready())
+        read();
+    if (pending_ == BUFFERS) {
+        // Without fences there is no way to tell whether the oldest
+        // readback is done, but it has had several frames to finish.
+        if (sync_) {
+            dropped_gpu_++;
+            return;
+        }
+        read();
+    }
+
+    slot &s = slots_[(first_ + pending_) % BUFFERS];
+    s.number = number;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    if (framebuffer == 0)
+        glReadBuffer(GL_BACK);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, s.buffer);
+    glReadPixels(0, 0, width_, height_,
+                 GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+#if defined USE_GLEW
+    if (sync_)
+        s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+#endif
+    pending_++;
+
+    core::check_gl_error(HERE);
+}
+
+bool recorder::ready() const
+{
+#if defined USE_GLEW
+    GLsync fence = slots_[first_].fence;
+    if (!fence)
+        return false;
+    GLenum r = glClientWaitSync(fence, 0, 0);
+    return r == GL_ALREADY_SIGNALED || r == GL_CONDITION_SATISFIED;
+#else
+    return false;
+#endif
+}
+
+void recorder::read()
+{
+    slot &s = slots_[first_];
+    frame f;
+    f.number = s.number;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, s.buffer);
+    const unsigned *p = static_cast<const unsigned *>(
+        glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY));
+    if (p) {
+        f.pixels.assign(p, p + width_ * height_);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+#if defined USE_GLEW
+    if (s.fence) {
+        glDeleteSync(s.fence);
+        s.fence = nullptr;
+    }
+#endif
+    first_ = (first_ + 1) % BUFFERS;
+    pending_--;
+    if (p)
+        push(std::move(f));
+    else
+        dropped_gpu_++;
+
+    core::check_gl_error(HERE);
+}
+
+void recorder::push(frame &&f)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queue_.size() >= MAX_QUEUE) {
+            dropped_encoder_++;
+            return;
+        }
+        queue_.push_back(std::move(f));
+    }
+    cond_.notify_one();
+}
+
+void recorder::run()
+{
+    while (true) {
+        frame f;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this] { return done_ || !queue_.empty(); });
+            if (queue_.empty())
+                return;
+            f = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        bool ok = write(f);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ok)
+            written_++;
+        else
+            dropped_encoder_++;
+    }
+}
+
+bool recorder::write(const frame &f)
+{
+    // OpenGL rows are bottom to top.
+    std::vector<unsigned> flipped(width_ * height_);
+    for (int y = 0; y < height_; y++) {
+        const unsigned *irow = f.pixels.data() + width_ * (height_ - 1 - y);
+        unsigned *orow = flipped.data() + width_ * y;
+        for (int x = 0; x < width_; x++)
+            orow[x] = irow[x] | 0xff000000u;
+    }
+
+    if (file_) {
+        std::vector<unsigned char> rgba(width_ * height_ * 4);
+        for (std::size_t i = 0; i < flipped.size(); i++) {
+            unsigned c = flipped[i];
+            rgba[i * 4 + 0] = c >> 16;
+            rgba[i * 4 + 1] = c >> 8;
+            rgba[i * 4 + 2] = c;
+            rgba[i * 4 + 3] = c >> 24;
+        }
+        return std::fwrite(rgba.data(), 1, rgba.size(), file_) ==
+            rgba.size();
+    }
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "/frame%06d.png", f.number);
+    std::string path = path_ + name;
+    SDL_Surface *surf = SDL_CreateRGBSurfaceFrom(
+        flipped.data(), width_, height_, 32, width_ * 4,
+        0x00ff0000u, 0x0000ff00u, 0x000000ffu, 0xff000000u);
+    if (!surf)
+        return false;
+    int r = IMG_SavePNG(surf, path.c_str());
+    SDL_FreeSurface(surf);
+    if (r) {
+        std::fprintf(stderr, "Could not write %s\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,89 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_CAPTURE_HPP
+#define LD_CAPTURE_HPP
+#include "opengl.hpp"
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+namespace capture {
+
+/// Records frames from a framebuffer to a PNG sequence or raw video.
+/// Frames are read back into a ring of pixel buffer objects and only
+/// mapped once their fences have signaled, and encoding runs on a
+/// worker thread.  Frames are dropped, and counted, rather than stall
+/// the renderer when the GPU or the encoder falls behind.
+class recorder {
+private:
+    static const int BUFFERS = 3;
+    static const std::size_t MAX_QUEUE = 8;
+
+    struct slot {
+        GLuint buffer;
+#if defined USE_GLEW
+        GLsync fence;
+#endif
+        int number;
+    };
+
+    struct frame {
+        int number;
+        std::vector<unsigned> pixels;
+    };
+
+    std::string path_;
+    /// Raw video file, or null for a PNG sequence.
+    std::FILE *file_;
+    int width_, height_;
+    /// Whether fences are available to check for finished readbacks.
+    bool sync_;
+
+    slot slots_[BUFFERS];
+    /// Index of the oldest pending readback.
+    int first_;
+    /// Number of pending readbacks.
+    int pending_;
+    /// Number of frames submitted, including dropped frames.
+    int frame_count_;
+    int dropped_gpu_;
+    int dropped_encoder_;
+
+    // Shared with the worker thread.
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<frame> queue_;
+    bool done_;
+    int written_;
+    std::thread thread_;
+
+    /// Determine whether the oldest pending readback has finished.
+    bool ready() const;
+    /// Map the oldest pending readback and queue it for encoding.
+    void read();
+    /// Queue a frame for the worker thread, or drop it if the queue is full.
+    void push(frame &&f);
+    /// Worker thread main loop.
+    void run();
+    /// Encode and write a frame.
+    bool write(const frame &f);
+
+public:
+    /// Start recording frames of the given size.  Paths ending in
+    /// ".raw" get raw RGBA video, other paths are directories for a PNG
+    /// sequence.
+    recorder(const std::string &path, int width, int height);
+    recorder(const recorder &) = delete;
+    ~recorder();
+    recorder &operator=(const recorder &) = delete;
+
+    /// Capture a frame from a framebuffer, or 0 for the back buffer.
+    void capture(GLuint framebuffer);
+};
+
+}
+#endif
@@ -38,8 +38,34 @@ void die_sdl(const char *file, int line, const char *msg);
 /// Check for SDL errors and log them.
 void check_sdl_error(const char *file, int line);
 
-/// Check for OpenGL errors and log them.
+/// Check for OpenGL errors and log them.  This does nothing if errors
+/// are reported through a KHR_debug callback, and it is compiled out in
+/// release (NDEBUG) builds.
+#if defined NDEBUG
+inline void check_gl_error(const char *, int) { }
+#else
 void check_gl_error(const char *file, int line);
+#endif
+
+/// Push a named OpenGL debug group.  Errors reported while the group is
+/// active are logged with its name and the location where it was pushed.
+void push_gl_group(const char *name, const char *file, int line);
+
+/// Pop the current OpenGL debug group.
+void pop_gl_group();
+
+/// The part of the output which shows the picture, scaled up by an
+/// integer factor and centered, with black bars around it.
+struct viewport {
+    int x, y, width, height, scale;
+};
+
+/// Get the viewport for an output of the given size, in pixels.
+viewport get_viewport(int width, int height);
+
+/// Get the size of the output in pixels.  This is the window's drawable
+/// size, or the default size when there is no window.
+void output_size(int *width, int *height);
 
 /// Pause for the given number of milliseconds.
 void delay(int msec);
@@ -1,88 +1,135 @@
 /* Copyright 2013-2014 Dietrich Epp.
    This file is part of Oubliette.  Oubliette is licensed under the terms
    of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include "archive.hpp"
 #include "defs.hpp"
 #include "file.hpp"
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <new>
+#include <SDL.h>
 
 data::data()
-    : ptr_(nullptr), size_(0)
+    : ptr_(nullptr), size_(0), alloc_(nullptr)
 {
 }
 
 data::data(data &&other)
-    : ptr_(nullptr), size_(0)
+    : ptr_(other.ptr_), size_(other.size_), alloc_(other.alloc_)
 {
-    ptr_ = other.ptr_;
-    size_ = other.size_;
     other.ptr_ = nullptr;
     other.size_ = 0;
+    other.alloc_ = nullptr;
 }
 
 data::~data()
 {
-    std::free(ptr_);
+    std::free(alloc_);
 }
 
 data &data::operator=(data &&other)
 {
     if (this == &other)
         return *this;
-    std::free(ptr_);
+    std::free(alloc_);
     ptr_ = other.ptr_;
     size_ = other.size_;
+    alloc_ = other.alloc_;
     other.ptr_ = nullptr;
     other.size_ = 0;
+    other.alloc_ = nullptr;
     return *this;
 }
 
+SDL_RWops *data::rwops() const
+{
+    SDL_RWops *rw = SDL_RWFromConstMem(ptr_, (int)size_);
+    if (!rw)
+        core::die_sdl(HERE, "Failed to read data");
+    return rw;
+}
+
 bool data::read(data *outdata, const std::string &path)
 {
+    data data;
+    archive::entry e;
+    if (archive::find(path, &e)) {
+        if (!e.compressed) {
+            data.ptr_ = e.data;
+            data.size_ = e.size;
+            *outdata = std::move(data);
+            return true;
+        }
+        data.alloc_ = std::malloc(e.size ? e.size : 1);
+        if (!data.alloc_)
+            core::die_alloc();
+        data.ptr_ = data.alloc_;
+        data.size_ = e.size;
+        if (!archive::decompress(e, data.alloc_)) {
+            std::fprintf(stderr, "Corrupt archive entry: %s\n",
+                         path.c_str());
+            return false;
+        }
+        *outdata = std::move(data);
+        return true;
+    }
+
     FILE *fp = std::fopen(path.c_str(), "rb");
     if (!fp) {
         std::fprintf(stderr, "Could not open file: %s\n", path.c_str());
         return false;
     }
-    try {
-        static const std::size_t INITSZ = 4096;
-        data data;
-        std::size_t alloc = INITSZ;
-        data.ptr_ = std::malloc(alloc);
-        if (!data.ptr_)
-            core::die_alloc();
-        std::size_t pos = 0;
-        while (1) {
-            std::size_t amt = std::fread(
-                static_cast<char *>(data.ptr_) + pos,
-                1, alloc - pos, fp);
-            if (amt == 0) {
-                if (std::feof(fp)) {
-                    data.size_ = pos;
-                    std::fclose(fp);
-                    *outdata = std::move(data);
-                    return true;
-                }
-                std::fprintf(stderr, "Could not read file: %s\n",
-                             path.c_str());
-                return false;
-            }
-            pos += amt;
-            if (pos >= alloc) {
-                alloc *= 2;
-                if (!alloc) {
-                    std::fprintf(stderr, "File too large: %s\n",
-                                 path.c_str());
-                    return false;
-                }
-                void *nptr = realloc(data.ptr_, alloc);
-                if (!nptr)
-                    core::die_alloc();
-            }
-        }
-    } catch (...) {
+    long size = -1;
+    if (!std::fseek(fp, 0, SEEK_END))
+        size = std::ftell(fp);
+    if (size < 0 || std::fseek(fp, 0, SEEK_SET)) {
+        std::fclose(fp);
+        std::fprintf(stderr, "Could not read file: %s\n", path.c_str());
+        return false;
+    }
+    data.alloc_ = std::malloc(size ? size : 1);
+    if (!data.alloc_) {
         std::fclose(fp);
-        throw;
+        core::die_alloc();
     }
+    data.ptr_ = data.alloc_;
+    data.size_ = size;
+    std::size_t amt = std::fread(data.alloc_, 1, size, fp);
+    std::fclose(fp);
+    if (amt != (std::size_t)size) {
+        std::fprintf(stderr, "Could not read file: %s\n", path.c_str());
+        return false;
+    }
+    *outdata = std::move(data);
+    return true;
+}
+
+bool data::exists(const std::string &path)
+{
+    archive::entry e;
+    if (archive::find(path, &e))
+        return true;
+    FILE *fp = std::fopen(path.c_str(), "rb");
+    if (!fp)
+        return false;
+    std::fclose(fp);
+    return true;
+}
+
+line_reader::line_reader(const data &d)
+    : ptr_(static_cast<const char *>(d.ptr())), end_(ptr_ + d.size())
+{
+}
+
+bool line_reader::next(std::string &line)
+{
+    if (ptr_ == end_)
+        return false;
+    const char *nl = static_cast<const char *>(
+        std::memchr(ptr_, '\n', end_ - ptr_));
+    const char *end = nl ? nl + 1 : end_;
+    line.assign(ptr_, end);
+    ptr_ = end;
+    return true;
 }
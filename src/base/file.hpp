@@ -7,12 +7,16 @@
 #include <cstddef>
 #include <cstdlib>
 #include <string>
+struct SDL_RWops;
 
-/// Read-only data buffer object.
+/// Read-only data buffer object.  The buffer is either owned or a view
+/// of memory which outlives it, such as the mapped archive.
 class data {
 private:
-    void *ptr_;
+    const void *ptr_;
     std::size_t size_;
+    /// The buffer, if it is owned.
+    void *alloc_;
 
 public:
     data();
@@ -26,8 +30,29 @@ public:
     const void *ptr() const { return ptr_; }
     /// Get the number of bytes in the buffer.
     std::size_t size() const { return size_; }
-    /// Read the contents of a file.  Returns false on failure.
+    /// Create an SDL_RWops which reads the buffer.  The buffer must
+    /// outlive it.
+    SDL_RWops *rwops() const;
+    /// Read the contents of a file, from the archive if it is there, or
+    /// else from the data directory.  Returns false on failure.
     static bool read(data *outdata, const std::string &path);
+    /// Determine whether a file exists in the archive or the data
+    /// directory.
+    static bool exists(const std::string &path);
+};
+
+/// Reads lines of text from a data buffer.
+class line_reader {
+private:
+    const char *ptr_;
+    const char *end_;
+
+public:
+    explicit line_reader(const data &d);
+
+    /// Get the next line, including the newline.  Returns false at the
+    /// end of the buffer.
+    bool next(std::string &line);
 };
 
 #endif
@@ -0,0 +1,85 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include "gpu_timer.hpp"
+namespace gpu {
+
+timer::timer()
+    : first_(0), pending_(0), active_(false), total_(0.0), samples_(0),
+      lifetime_total_(0.0), lifetime_samples_(0)
+{
+    for (int i = 0; i < QUERIES; i++)
+        queries_[i] = 0;
+    if (available())
+        glGenQueries(QUERIES, queries_);
+}
+
+timer::~timer()
+{
+    if (queries_[0])
+        glDeleteQueries(QUERIES, queries_);
+}
+
+bool timer::available()
+{
+#if defined USE_GLEW
+    return GLEW_ARB_timer_query != 0;
+#else
+    return false;
+#endif
+}
+
+void timer::begin()
+{
+#if defined USE_GLEW
+    if (!queries_[0] || active_ || pending_ >= QUERIES)
+        return;
+    glBeginQuery(GL_TIME_ELAPSED, queries_[(first_ + pending_) % QUERIES]);
+    active_ = true;
+#endif
+}
+
+void timer::end()
+{
+#if defined USE_GLEW
+    if (!active_)
+        return;
+    glEndQuery(GL_TIME_ELAPSED);
+    active_ = false;
+    pending_++;
+#endif
+}
+
+void timer::poll()
+{
+#if defined USE_GLEW
+    while (pending_ > 0) {
+        GLuint query = queries_[first_];
+        GLint ready = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &ready);
+        if (!ready)
+            break;
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+        total_ += (double)elapsed;
+        samples_++;
+        lifetime_total_ += (double)elapsed;
+        lifetime_samples_++;
+        first_ = (first_ + 1) % QUERIES;
+        pending_--;
+    }
+#endif
+}
+
+void timer::reset()
+{
+    total_ = 0.0;
+    samples_ = 0;
+}
+
+double timer::average_ms() const
+{
+    return samples_ > 0 ? total_ * 1e-6 / samples_ : 0.0;
+}
+
+}
@@ -0,0 +1,62 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_GPU_TIMER_HPP
+#define LD_GPU_TIMER_HPP
+#include "opengl.hpp"
+namespace gpu {
+
+/// Measures GPU time with GL_TIME_ELAPSED queries.  Several queries are
+/// kept in flight and results are only read once available, so the
+/// timer never stalls the pipeline.  Does nothing if timer queries are
+/// not supported.
+class timer {
+private:
+    static const int QUERIES = 4;
+
+    GLuint queries_[QUERIES];
+    /// Index of the oldest pending query.
+    int first_;
+    /// Number of pending queries.
+    int pending_;
+    /// Whether a query is active.
+    bool active_;
+    /// Total time of collected samples, in nanoseconds.
+    double total_;
+    /// Number of collected samples.
+    int samples_;
+    /// Time and number of all samples since the timer was created.
+    double lifetime_total_;
+    long lifetime_samples_;
+
+public:
+    timer();
+    timer(const timer &) = delete;
+    ~timer();
+    timer &operator=(const timer &) = delete;
+
+    /// Determine whether the OpenGL context supports timer queries.
+    static bool available();
+
+    /// Start timing.  Skipped if too many queries are in flight.
+    void begin();
+    /// Stop timing.
+    void end();
+    /// Collect the results of finished queries.
+    void poll();
+    /// Discard collected samples.  Lifetime totals are kept.
+    void reset();
+
+    /// Get the number of collected samples.
+    int samples() const { return samples_; }
+    /// Get the average time of the collected samples, in milliseconds.
+    double average_ms() const;
+    /// Get the number of samples since the timer was created.
+    long lifetime_samples() const { return lifetime_samples_; }
+    /// Get the total time of all samples since the timer was created,
+    /// in milliseconds.
+    double lifetime_ms() const { return lifetime_total_ * 1e-6; }
+};
+
+}
+#endif
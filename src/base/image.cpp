@@ -3,18 +3,24 @@
    of the 2-clause BSD license.  For more information, see LICENSE.txt. */
 #include "image.hpp"
 #include "defs.hpp"
+#include "file.hpp"
+#include "loader.hpp"
 #include "surface.hpp"
 #include <SDL.h>
 #include <SDL_image.h>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <map>
+#include <utility>
 namespace image {
 
 static sdl::surface load_image(const std::string &path)
 {
     sdl::surface image;
-
-    image.surfptr = IMG_Load(path.c_str());
+    data file;
+    if (data::read(&file, path))
+        image.surfptr = IMG_Load_RW(file.rwops(), 1);
     if (!image.surfptr) {
         core::check_sdl_error(HERE);
         std::fprintf(stderr, "Error: failed to load image: %s\n",
@@ -111,23 +117,144 @@ void bitmap::alloc(int w, int h)
     rowbytes = rb;
 }
 
-bitmap bitmap::load(const std::string &path)
+decoded::decoded()
+    : width(0), height(0)
+{ }
+
+/// Copy the pixels of an ARGB8888 surface.
+static decoded copy_argb(SDL_Surface *image)
 {
-    sdl::surface image = load_image(path);
+    int r = SDL_LockSurface(image);
+    if (r) core::die_sdl(HERE, "Failed to load image");
+
+    decoded d;
+    d.width = image->w;
+    d.height = image->h;
+    d.argb.resize(d.width * d.height);
+    const char *ip = static_cast<const char *>(image->pixels);
+    for (int y = 0; y < d.height; y++) {
+        const unsigned *irow =
+            reinterpret_cast<const unsigned *>(ip + image->pitch * y);
+        for (int x = 0; x < d.width; x++)
+            d.argb[y * d.width + x] = irow[x];
+    }
+    SDL_UnlockSurface(image);
+    return d;
+}
+
+decoded decoded::decode(const std::string &path, bool indexed)
+{
+    if (!indexed) {
+        sdl::surface image = load_image(path);
+        return copy_argb(image.surfptr);
+    }
+
+    sdl::surface image;
+    data file;
+    if (data::read(&file, path))
+        image.surfptr = IMG_Load_RW(file.rwops(), 1);
+    if (!image.surfptr) {
+        core::check_sdl_error(HERE);
+        std::fprintf(stderr, "Error: failed to load image: %s\n",
+                     path.c_str());
+        core::die("Failed to load image");
+    }
+
+    const SDL_Palette *pal = image->format->palette;
+    if (image->format->format != SDL_PIXELFORMAT_INDEX8 || !pal) {
+        sdl::surface converted;
+        converted.surfptr = SDL_ConvertSurfaceFormat(
+            image.surfptr, SDL_PIXELFORMAT_ARGB8888, 0);
+        if (!converted.surfptr)
+            core::die_sdl(HERE, "Failed to load image");
+        return copy_argb(converted.surfptr);
+    }
+
+    std::printf("loading %s (%dx%d, %d colors)\n",
+                path.c_str(), image->w, image->h, pal->ncolors);
+
+    decoded d;
+    int ncolors = pal->ncolors < 256 ? pal->ncolors : 256;
+    d.palette.resize(ncolors);
+    for (int i = 0; i < ncolors; i++) {
+        const SDL_Color &c = pal->colors[i];
+        d.palette[i] = ((unsigned)c.a << 24) | ((unsigned)c.r << 16) |
+            ((unsigned)c.g << 8) | (unsigned)c.b;
+    }
+    Uint32 key;
+    if (!SDL_GetColorKey(image.surfptr, &key) && (int)key < ncolors)
+        d.palette[key] = 0;
 
     int r = SDL_LockSurface(image.surfptr);
     if (r) core::die_sdl(HERE, "Failed to load image");
+    d.width = image->w;
+    d.height = image->h;
+    d.indexes.resize(d.width * d.height);
+    const unsigned char *ip =
+        static_cast<const unsigned char *>(image->pixels);
+    for (int y = 0; y < d.height; y++) {
+        std::copy(ip + image->pitch * y, ip + image->pitch * y + d.width,
+                  d.indexes.begin() + d.width * y);
+    }
+    SDL_UnlockSurface(image.surfptr);
+    return d;
+}
+
+namespace {
+
+/// Images being decoded by preload, by path and indexed flag.
+std::map<std::pair<std::string, bool>, std::future<decoded>> preloads;
+
+}
+
+void preload(const std::string &path, bool indexed)
+{
+    auto key = std::make_pair(path, indexed);
+    if (preloads.count(key))
+        return;
+    preloads[key] = loader::submit([path, indexed]() {
+        return decoded::decode(path, indexed);
+    });
+}
+
+/// Get a preloaded image, or decode it now.
+static decoded take(const std::string &path, bool indexed)
+{
+    auto it = preloads.find(std::make_pair(path, indexed));
+    if (it == preloads.end())
+        return decoded::decode(path, indexed);
+    decoded d = it->second.get();
+    preloads.erase(it);
+    return d;
+}
 
-    int iw = image->w, ih = image->h;
+bitmap bitmap::load(const std::string &path)
+{
+    return alpha(take(path, false));
+}
+
+bitmap bitmap::alpha(const decoded &image)
+{
+    int iw = image.width, ih = image.height;
     bitmap bmap;
 
     bmap.alloc(iw, ih);
-    const unsigned char *ip = static_cast<unsigned char *>(image->pixels);
     unsigned char *op = static_cast<unsigned char *>(bmap.data);
-    unsigned irb = image->pitch, orb = bmap.rowbytes;
+    unsigned orb = bmap.rowbytes;
+    if (!image.palette.empty()) {
+        unsigned char alpha[256] = { 0 };
+        for (std::size_t i = 0; i < image.palette.size(); i++)
+            alpha[i] = image.palette[i] >> 24;
+        for (int y = 0; y < ih; y++) {
+            const unsigned char *irow = image.indexes.data() + iw * y;
+            unsigned char *orow = op + orb * (ih - 1 - y);
+            for (int x = 0; x < iw; x++)
+                orow[x] = alpha[irow[x]];
+        }
+        return bmap;
+    }
     for (int y = 0; y < ih; y++) {
-        const unsigned *irow =
-            reinterpret_cast<const unsigned *>(ip + irb * y);
+        const unsigned *irow = image.argb.data() + iw * y;
         unsigned char *orow = op + orb * (ih - 1 - y);
         for (int x = 0; x < iw; x++) {
             orow[x] = irow[x] >> 24;
@@ -136,27 +263,153 @@ bitmap bitmap::load(const std::string &path)
     return bmap;
 }
 
+std::vector<unsigned> load_pixels(const std::string &path,
+                                  int *width, int *height)
+{
+    decoded image = take(path, false);
+    *width = image.width;
+    *height = image.height;
+    return std::move(image.argb);
+}
+
+/// Get the pixel format for 8-bit index textures.
+static GLenum index_format()
+{
+#if defined USE_GLEW
+    if (GLEW_ARB_texture_rg)
+        return GL_RED;
+#endif
+    return GL_LUMINANCE;
+}
+
+GLuint create_index_texture(int width, int height)
+{
+    GLenum format = index_format();
+    GLint internalformat = format == GL_RED ? GL_R8 : GL_LUMINANCE8;
+
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(
+        GL_TEXTURE_2D,
+        0,
+        internalformat,
+        width,
+        height,
+        0,
+        format,
+        GL_UNSIGNED_BYTE,
+        nullptr);
+    return tex;
+}
+
+void upload_indexes(int x, int y, int width, int height,
+                    int rowbytes, const void *pixels)
+{
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, rowbytes);
+    glTexSubImage2D(
+        GL_TEXTURE_2D,
+        0,
+        x,
+        y,
+        width,
+        height,
+        index_format(),
+        GL_UNSIGNED_BYTE,
+        pixels);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+GLuint create_palette(const unsigned *colors, int count)
+{
+    unsigned data[256];
+    for (int i = 0; i < 256; i++)
+        data[i] = i < count ? colors[i] : 0;
+
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(
+        GL_TEXTURE_2D,
+        0,
+        GL_RGBA8,
+        256,
+        1,
+        0,
+        GL_BGRA,
+        GL_UNSIGNED_INT_8_8_8_8_REV,
+        data);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return tex;
+}
+
+void set_palette_color(GLuint palette, int index, unsigned color)
+{
+    glBindTexture(GL_TEXTURE_2D, palette);
+    glTexSubImage2D(
+        GL_TEXTURE_2D,
+        0,
+        index,
+        0,
+        1,
+        1,
+        GL_BGRA,
+        GL_UNSIGNED_INT_8_8_8_8_REV,
+        &color);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
 texture::texture()
-    : tex(0),
+    : tex(0), palette(0),
       iwidth(0), iheight(0),
       twidth(0), theight(0)
 { }
 
-texture texture::load(const std::string &path)
+/// Get a texture with the dimensions of an image padded to powers of
+/// two, without creating it.
+static texture padded_texture(int width, int height)
 {
-    sdl::surface image = load_image(path);
     texture tex;
-
-    int r = SDL_LockSurface(image.surfptr);
-    if (r) core::die_sdl(HERE, "Failed to load image");
-
-    tex.iwidth = image->w;
-    tex.iheight = image->h;
+    tex.iwidth = width;
+    tex.iheight = height;
     tex.twidth = round_up_pow2(tex.iwidth);
     tex.theight = round_up_pow2(tex.iheight);
     tex.scale[0] = 1.0 / tex.twidth;
     tex.scale[1] = 1.0 / tex.theight;
+    return tex;
+}
+
+texture texture::upload(const decoded &image)
+{
+    if (!image.palette.empty())
+        return upload_indexed(image.width, image.height,
+                              image.indexes.data(), image.palette.data(),
+                              image.palette.size());
+    return upload_argb(image.width, image.height, image.argb.data());
+}
+
+texture texture::upload_indexed(int width, int height,
+                                const unsigned char *indexes,
+                                const unsigned *palette, int ncolors)
+{
+    texture tex = padded_texture(width, height);
+    tex.tex = create_index_texture(tex.twidth, tex.theight);
+    upload_indexes(0, 0, width, height, width, indexes);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    tex.palette = create_palette(palette, ncolors);
+    core::check_gl_error(HERE);
+    return tex;
+}
 
+texture texture::upload_argb(int width, int height, const unsigned *argb)
+{
+    texture tex = padded_texture(width, height);
     glGenTextures(1, &tex.tex);
     glBindTexture(GL_TEXTURE_2D, tex.tex);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -180,24 +433,73 @@ texture texture::load(const std::string &path)
         tex.iheight,
         GL_BGRA,
         GL_UNSIGNED_INT_8_8_8_8_REV,
-        image->pixels);
+        argb);
     glBindTexture(GL_TEXTURE_2D, 0);
 
-    // 0x00ff0000u, 0x0000ff00u, 0x000000ff, 0xff000000u
+    core::check_gl_error(HERE);
+    return tex;
+}
+
+texture texture::load(const std::string &path)
+{
+    return upload(take(path, false));
+}
+
+texture texture::create(int width, int height, const unsigned *pixels)
+{
+    texture tex;
+    tex.iwidth = width;
+    tex.iheight = height;
+    tex.twidth = width;
+    tex.theight = height;
+    tex.scale[0] = 1.0 / width;
+    tex.scale[1] = 1.0 / height;
+
+    glGenTextures(1, &tex.tex);
+    glBindTexture(GL_TEXTURE_2D, tex.tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(
+        GL_TEXTURE_2D,
+        0,
+        GL_RGBA8,
+        width,
+        height,
+        0,
+        GL_BGRA,
+        GL_UNSIGNED_INT_8_8_8_8_REV,
+        pixels);
+    glBindTexture(GL_TEXTURE_2D, 0);
 
     core::check_gl_error(HERE);
     return tex;
 }
 
+texture texture::load_indexed(const std::string &path)
+{
+    return upload(take(path, true));
+}
+
+void texture::destroy()
+{
+    if (tex)
+        glDeleteTextures(1, &tex);
+    if (palette)
+        glDeleteTextures(1, &palette);
+    tex = 0;
+    palette = 0;
+}
+
 texture texture::load_1d(const std::string &path)
 {
-    sdl::surface image = load_image(path);
-    texture tex;
+    return upload_1d(take(path, false));
+}
 
-    int r = SDL_LockSurface(image.surfptr);
-    if (r) core::die_sdl(HERE, "Failed to load image");
+texture texture::upload_1d(const decoded &image)
+{
+    texture tex;
 
-    tex.iwidth = image->w;
+    tex.iwidth = image.width;
     tex.iheight = 1;
     tex.twidth = round_up_pow2(tex.iwidth);
     tex.theight = 1;
@@ -224,7 +526,7 @@ texture texture::load_1d(const std::string &path)
         tex.iwidth,
         GL_BGRA,
         GL_UNSIGNED_INT_8_8_8_8_REV,
-        image->pixels);
+        image.argb.data());
     glBindTexture(GL_TEXTURE_1D, 0);
 
     core::check_gl_error(HERE);
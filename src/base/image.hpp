@@ -4,8 +4,10 @@
 #ifndef LD_IMAGE_HPP
 #define LD_IMAGE_HPP
 #include <string>
+#include <vector>
 #include "opengl.hpp"
 namespace image {
+struct decoded;
 
 struct bitmap {
     unsigned char *data;
@@ -23,10 +25,58 @@ struct bitmap {
     void alloc(int w, int h);
 
     static bitmap load(const std::string &path);
+    /// Get the alpha channel of a decoded image, starting with the
+    /// bottom row.  Indexed images use the alpha of their palette.
+    static bitmap alpha(const decoded &image);
 };
 
+/// A decoded image.  Images can be decoded on any thread, and only
+/// uploading them as textures has to happen on the GL thread.
+struct decoded {
+    int width;
+    int height;
+    /// ARGB pixels starting with the top row, unless indexed.
+    std::vector<unsigned> argb;
+    /// Palette indexes starting with the top row, if indexed.
+    std::vector<unsigned char> indexes;
+    /// ARGB palette colors, if indexed.
+    std::vector<unsigned> palette;
+
+    decoded();
+
+    /// Decode an image file.  Indexed images keep their palette indexes
+    /// if indexed is true, and all other images are decoded as ARGB.
+    static decoded decode(const std::string &path, bool indexed);
+};
+
+/// Start decoding an image on the loader threads.  The next load of
+/// the same image, with the same indexed flag, uses the result.  This
+/// is called from the main thread.
+void preload(const std::string &path, bool indexed);
+
+/// Load an image as ARGB pixels, starting with the top row.
+std::vector<unsigned> load_pixels(const std::string &path,
+                                  int *width, int *height);
+
+/// Create a texture for 8-bit palette indexes, with undefined contents.
+/// Uses GL_R8 where available, and GL_LUMINANCE8 otherwise.
+GLuint create_index_texture(int width, int height);
+
+/// Upload 8-bit palette indexes to part of the bound index texture.
+void upload_indexes(int x, int y, int width, int height,
+                    int rowbytes, const void *pixels);
+
+/// Create a 256-entry palette texture from ARGB colors.  Unused entries
+/// are transparent.
+GLuint create_palette(const unsigned *colors, int count);
+
+/// Change one ARGB color in a palette texture.
+void set_palette_color(GLuint palette, int index, unsigned color);
+
 struct texture {
     GLuint tex;
+    /// The palette texture if the pixels are 8-bit indexes, or 0.
+    GLuint palette;
     short iwidth;
     short iheight;
     short twidth;
@@ -39,9 +89,40 @@ struct texture {
     /// The image is padded so its dimensions are powers of two.
     static texture load(const std::string &path);
 
+    /// Load an indexed image as 8-bit palette indexes and a palette.
+    /// Images which are not indexed are loaded as true color.
+    static texture load_indexed(const std::string &path);
+
+    /// Upload a decoded image as a 2-dimensional texture, with a
+    /// palette if it is indexed.  The image is padded so its dimensions
+    /// are powers of two.
+    static texture upload(const decoded &image);
+
+    /// Upload palette indexes, starting with the top row, and their
+    /// palette as a padded texture.
+    static texture upload_indexed(int width, int height,
+                                  const unsigned char *indexes,
+                                  const unsigned *palette, int ncolors);
+
+    /// Upload ARGB pixels, starting with the top row, as a padded
+    /// texture.
+    static texture upload_argb(int width, int height,
+                               const unsigned *argb);
+
+    /// Delete the texture and its palette.
+    void destroy();
+
+    /// Create a 2-dimensional texture from ARGB pixels.
+    /// The dimensions are not padded.
+    static texture create(int width, int height, const unsigned *pixels);
+
     /// Load an image as a 1-dimensional texture.
     /// The image is padded so its dimensions are powers of two.
     static texture load_1d(const std::string &path);
+
+    /// Upload the first row of a decoded image as a 1-dimensional
+    /// texture.
+    static texture upload_1d(const decoded &image);
 };
 
 }
@@ -0,0 +1,70 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include "loader.hpp"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+namespace loader {
+
+namespace {
+
+struct pool {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::function<void()>> queue;
+};
+
+unsigned thread_count;
+
+// The threads are detached and the pool is never freed, since a job
+// can exit the program with core::die.
+pool *the_pool;
+
+}
+
+static void run(pool *p)
+{
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(p->mutex);
+            p->cond.wait(lock, [p] { return !p->queue.empty(); });
+            job = std::move(p->queue.front());
+            p->queue.pop_front();
+        }
+        job();
+    }
+}
+
+void set_threads(unsigned count)
+{
+    thread_count = count;
+}
+
+unsigned threads()
+{
+    if (!thread_count) {
+        thread_count = std::thread::hardware_concurrency();
+        if (thread_count < 1)
+            thread_count = 1;
+    }
+    return thread_count;
+}
+
+void post(std::function<void()> job)
+{
+    if (!the_pool) {
+        the_pool = new pool;
+        for (unsigned i = 0, n = threads(); i < n; i++)
+            std::thread(run, the_pool).detach();
+    }
+    {
+        std::lock_guard<std::mutex> lock(the_pool->mutex);
+        the_pool->queue.push_back(std::move(job));
+    }
+    the_pool->cond.notify_one();
+}
+
+}
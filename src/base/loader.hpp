@@ -0,0 +1,36 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_LOADER_HPP
+#define LD_LOADER_HPP
+#include <functional>
+#include <future>
+#include <memory>
+namespace loader {
+
+/// Set the number of loader threads, or 0 for one per core.  This
+/// must be called before the first job is posted.
+void set_threads(unsigned count);
+
+/// Get the number of loader threads.
+unsigned threads();
+
+/// Queue a job for the loader threads.  Jobs must not touch OpenGL,
+/// and are posted from the main thread.
+void post(std::function<void()> job);
+
+/// Run a function on the loader threads, and get a future for its
+/// result.
+template<class F>
+auto submit(F func) -> std::future<decltype(func())>
+{
+    typedef decltype(func()) result;
+    auto task = std::make_shared<std::packaged_task<result()>>(
+        std::move(func));
+    std::future<result> f = task->get_future();
+    post([task]() { (*task)(); });
+    return f;
+}
+
+}
+#endif
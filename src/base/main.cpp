@@ -4,18 +4,31 @@
 #include <SDL.h>
 #include <SDL_image.h>
 #include <SDL_mixer.h>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <string>
+#include <vector>
+#include "archive.hpp"
 #include "defs.hpp"
+#include "loader.hpp"
+#include "offscreen.hpp"
 #include "opengl.hpp"
 #include "rand.hpp"
+#include "shader.hpp"
+#include "startup.hpp"
+#include "game/audio.hpp"
+#include "game/bench.hpp"
+#include "game/levelfile.hpp"
 #include "game/state.hpp"
 
 #if defined _WIN32
 #include <Windows.h>
 #undef DELETE
+#define popen _popen
+#define pclose _pclose
 #else
 #include <unistd.h>
 #endif
@@ -27,6 +40,10 @@ namespace core {
 
 SDL_Window *window;
 SDL_GLContext context;
+static bool use_shader_cache = true;
+static bool fullscreen = false;
+/// Audio buffer size, in frames.  Smaller buffers have less latency.
+static int audio_buffer = 1024;
 
 NORETURN
 void die(const char *reason)
@@ -66,6 +83,18 @@ void die_sdl(const char *file, int line, const char *msg)
     std::exit(1);
 }
 
+/// An active OpenGL debug group.
+struct gl_group {
+    const char *name;
+    const char *file;
+    int line;
+};
+
+/// Whether errors are reported through the KHR_debug callback.
+static bool gl_debug_output;
+static std::vector<gl_group> gl_groups;
+
+#if !defined NDEBUG
 struct gl_error {
     unsigned short code;
     const char name[30];
@@ -84,6 +113,8 @@ static const gl_error GLERRORS[] = {
 
 void check_gl_error(const char *file, int line)
 {
+    if (gl_debug_output)
+        return;
     GLenum error;
     while ((error = glGetError())) {
         int i, n = sizeof(GLERRORS) / sizeof(*GLERRORS);
@@ -100,6 +131,112 @@ void check_gl_error(const char *file, int line)
         }
     }
 }
+#endif
+
+#if defined USE_GLEW
+
+static const char *gl_debug_type(GLenum type)
+{
+    switch (type) {
+    case GL_DEBUG_TYPE_ERROR: return "error";
+    case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated";
+    case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR: return "undefined behavior";
+    case GL_DEBUG_TYPE_PORTABILITY: return "portability";
+    case GL_DEBUG_TYPE_PERFORMANCE: return "performance";
+    default: return "message";
+    }
+}
+
+static void APIENTRY gl_debug_message(
+    GLenum source, GLenum type, GLuint id, GLenum severity,
+    GLsizei length, const GLchar *message, const void *user)
+{
+    (void) source;
+    (void) id;
+    (void) severity;
+    (void) user;
+    int len = length < 0 ? static_cast<int>(std::strlen(message)) : length;
+    // Asynchronous messages may arrive on another thread, long after the
+    // group that caused them was popped.
+#if !defined NDEBUG
+    if (!gl_groups.empty()) {
+        const gl_group &g = gl_groups.back();
+        std::fprintf(stderr, "OpenGL %s: %s:%d: %s: %.*s\n",
+                     gl_debug_type(type), g.file, g.line, g.name,
+                     len, message);
+        return;
+    }
+#endif
+    std::fprintf(stderr, "OpenGL %s: %.*s\n",
+                 gl_debug_type(type), len, message);
+}
+
+#endif
+
+/// Report OpenGL errors through KHR_debug, if available.  Messages are
+/// synchronous in debug builds, so they arrive inside the call that
+/// caused them, and asynchronous in release builds.
+static void init_gl_debug()
+{
+#if defined USE_GLEW
+    if (!GLEW_KHR_debug)
+        return;
+    glDebugMessageCallback(gl_debug_message, nullptr);
+    glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE,
+                          GL_DEBUG_SEVERITY_NOTIFICATION,
+                          0, nullptr, GL_FALSE);
+    glEnable(GL_DEBUG_OUTPUT);
+#if defined NDEBUG
+    glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+#else
+    glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+#endif
+    gl_debug_output = true;
+#endif
+}
+
+void push_gl_group(const char *name, const char *file, int line)
+{
+    gl_group g = { name, file, line };
+    gl_groups.push_back(g);
+#if defined USE_GLEW
+    if (gl_debug_output)
+        glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, name);
+#endif
+}
+
+void pop_gl_group()
+{
+    gl_groups.pop_back();
+#if defined USE_GLEW
+    if (gl_debug_output)
+        glPopDebugGroup();
+#endif
+}
+
+viewport get_viewport(int width, int height)
+{
+    viewport v;
+    int sx = width / PWIDTH, sy = height / PHEIGHT;
+    v.scale = sx < sy ? sx : sy;
+    if (v.scale < 1)
+        v.scale = 1;
+    v.width = PWIDTH * v.scale;
+    v.height = PHEIGHT * v.scale;
+    v.x = (width - v.width) / 2;
+    v.y = (height - v.height) / 2;
+    return v;
+}
+
+void output_size(int *width, int *height)
+{
+    if (window) {
+        SDL_GL_GetDrawableSize(window, width, height);
+    } else {
+        *width = IWIDTH;
+        *height = IHEIGHT;
+    }
+}
 
 void delay(int msec)
 {
@@ -157,10 +294,55 @@ static void init_path(const char *data_dir)
 #endif
 }
 
+/// Change to the data directory and open the archive in it.  The
+/// editor saves levels as loose files, so it does not use the archive.
+static void init_data(const char *data_dir, bool edit_mode)
+{
+    init_path(data_dir);
+    if (!edit_mode)
+        archive::open(archive::DEFAULT_PATH);
+}
+
+/// Initialize OpenGL function pointers and debugging for the current
+/// context.
+static void init_gl(bool offscreen)
+{
+#if defined USE_GLEW
+    GLenum glewstatus = glewInit();
+#if defined GLEW_ERROR_NO_GLX_DISPLAY
+    // GLEW built for GLX complains about EGL contexts, but the function
+    // pointers still load.
+    if (offscreen && glewstatus == GLEW_ERROR_NO_GLX_DISPLAY)
+        glewstatus = GLEW_OK;
+#endif
+    if (glewstatus != GLEW_OK) {
+        std::fprintf(stderr, "GLEW error: %s\n",
+                     glewGetErrorString(glewstatus));
+        die("Could not initialize OpenGL.");
+    }
+
+    if (!GLEW_VERSION_2_1)
+        die("OpenGL 2.1 is missing");
+    if (offscreen && !GLEW_ARB_framebuffer_object)
+        die("Offscreen rendering needs ARB_framebuffer_object");
+#endif
+    (void) offscreen;
+    init_gl_debug();
+
+    if (use_shader_cache) {
+        char *pref = SDL_GetPrefPath("Dietrich Epp", "Oubliette");
+        if (pref) {
+            shader::cache_dir = pref;
+            SDL_free(pref);
+        }
+    }
+}
+
 void init()
 {
     int result, flags;
 
+    startup::phase sdl_phase("SDL");
     flags = SDL_INIT_VIDEO | SDL_INIT_TIMER |
         SDL_INIT_AUDIO | SDL_INIT_EVENTS;
     result = SDL_Init(flags);
@@ -179,20 +361,33 @@ void init()
         std::puts("Unable to initialize SDL_mixer");
         return;
     }
+    sdl_phase.stop();
+
+    startup::phase window_phase("window");
 
     // SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
     // SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2);
     // SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
     // SDL_GL_CONTEXT_PROFILE_CORE);
     SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+#if !defined NDEBUG
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_DEBUG_FLAG);
+#endif
 
+    // Recording the output needs a fixed size.
+    flags = SDL_WINDOW_OPENGL;
+    if (!graphics::capture_output) {
+        flags |= SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI;
+        if (fullscreen)
+            flags |= SDL_WINDOW_FULLSCREEN_DESKTOP;
+    }
     window = SDL_CreateWindow(
         "The Oubliette Within",
         SDL_WINDOWPOS_UNDEFINED,
         SDL_WINDOWPOS_UNDEFINED,
         IWIDTH,
         IHEIGHT,
-        SDL_WINDOW_OPENGL);
+        flags);
     check_sdl_error(HERE);
     if (!window)
         die("Unable to create window");
@@ -202,32 +397,221 @@ void init()
     if (!context)
         die("Unable to create OpenGL context");
 
-#if defined USE_GLEW
-    GLenum glewstatus = glewInit();
-    if (glewstatus != GLEW_OK) {
-        std::fprintf(stderr, "GLEW error: %s\n",
-                     glewGetErrorString(glewstatus));
-        die("Could not initialize OpenGL.");
-    }
-
-    if (!GLEW_VERSION_2_1)
-        die("OpenGL 2.1 is missing");
-#endif
+    init_gl(false);
+    window_phase.stop();
 
-    result = Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 1024);
+    startup::phase audio_phase("audio device");
+    result = Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, audio_buffer);
     if (result != 0)
         std::printf("Could not start audio: %s\n", Mix_GetError());
+    audio_phase.stop();
 
     rng::global.init();
 }
 
 void term()
 {
+    Mix_CloseAudio();
     SDL_GL_DeleteContext(context);
     SDL_DestroyWindow(core::window);
     SDL_Quit();
 }
 
+void init_offscreen()
+{
+    if (SDL_Init(SDL_INIT_TIMER | SDL_INIT_EVENTS) < 0)
+        die("Unable to initialize SDL");
+    if (!(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG))
+        die("Unable to initialize SDL_image");
+    create_offscreen_context();
+    init_gl(true);
+    rng::global.init();
+}
+
+void term_offscreen()
+{
+    destroy_offscreen_context();
+    SDL_Quit();
+}
+
+}
+
+/// Save a software-rendered frame as a PNG file.
+static void save_frame(const soft::image &frame, const std::string &path)
+{
+    SDL_Surface *surf = SDL_CreateRGBSurface(
+        0, frame.width, frame.height, 32,
+        0x00ff0000u, 0x0000ff00u, 0x000000ffu, 0xff000000u);
+    if (!surf)
+        core::die_sdl(HERE, "Failed to save frame");
+    // Frame rows are bottom to top.
+    char *pixels = static_cast<char *>(surf->pixels);
+    for (int y = 0; y < frame.height; y++) {
+        unsigned *orow = reinterpret_cast<unsigned *>(
+            pixels + surf->pitch * y);
+        const unsigned *irow = frame.row(frame.height - 1 - y);
+        for (int x = 0; x < frame.width; x++)
+            orow[x] = irow[x] | 0xff000000u;
+    }
+    int r = IMG_SavePNG(surf, path.c_str());
+    SDL_FreeSurface(surf);
+    if (r)
+        core::die_sdl(HERE, "Failed to save frame");
+}
+
+/// Report how long it took to create the game state and load the
+/// first level.
+static void report_load_time(Uint64 start)
+{
+    double ms = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 /
+        (double)SDL_GetPerformanceFrequency();
+    std::fprintf(stderr, "Loaded in %.1f ms, %u loader threads\n",
+                 ms, loader::threads());
+}
+
+/// Start the game, draw the first frame, and shut down, timing each
+/// phase of startup.
+static void run_startup(const char *start_level, bool edit_mode,
+                        const char *data_dir)
+{
+    startup::phase total("startup");
+    startup::phase init_phase("init");
+    core::init();
+    init_phase.stop();
+    startup::phase data_phase("data");
+    core::init_data(data_dir, edit_mode);
+    data_phase.stop();
+    {
+        startup::phase state_phase("game state");
+        game::state gstate(edit_mode);
+        state_phase.stop();
+        startup::phase level_phase("first level");
+        gstate.set_level(start_level);
+        level_phase.stop();
+        startup::phase frame_phase("first frame");
+        gstate.draw(SDL_GetTicks());
+        glFinish();
+        frame_phase.stop();
+        total.stop();
+    }
+    core::term();
+}
+
+/// Quote an argument for the shell.
+static std::string shell_quote(const char *arg)
+{
+#if defined _WIN32
+    return std::string("\"") + arg + "\"";
+#else
+    std::string s("'");
+    for (const char *p = arg; *p; p++) {
+        if (*p == '\'')
+            s += "'\\''";
+        else
+            s += *p;
+    }
+    s += '\'';
+    return s;
+#endif
+}
+
+/// Start the game several times, each in a new process so nothing is
+/// left over from the previous run, and report percentiles for each
+/// phase.  The children get the same arguments, except for the
+/// benchmark itself.
+static int run_startup_bench(int count, int argc, char *argv[])
+{
+    std::string cmd = shell_quote(argv[0]);
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "--startup-bench")) {
+            i++;
+            continue;
+        }
+        cmd += ' ';
+        cmd += shell_quote(argv[i]);
+    }
+    cmd += " --startup-once";
+
+    std::vector<std::vector<startup::record>> runs;
+    for (int i = 0; i < count; i++) {
+        FILE *fp = popen(cmd.c_str(), "r");
+        if (!fp)
+            core::die("Could not start the game");
+        std::vector<startup::record> run = startup::read_records(fp);
+        int status = pclose(fp);
+        if (status != 0 || run.empty()) {
+            std::fprintf(stderr, "Warning: startup run %d failed\n", i + 1);
+            continue;
+        }
+        runs.push_back(std::move(run));
+    }
+    if (runs.empty())
+        return 1;
+    startup::report(runs);
+    return 0;
+}
+
+/// Run the game without a window or audio, rendering in software or
+/// to an offscreen context at a fixed frame rate, and report the
+/// rendering speed.  Frames are rendered as fast as possible.
+static void run_headless(const char *start_level, bool edit_mode,
+                         int frames, const char *dump_dir)
+{
+    const unsigned FRAME_TICKS1 = 1000 / core::MAXFPS;
+    const unsigned FRAME_TICKS = FRAME_TICKS1 > 0 ? FRAME_TICKS1 : 1;
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    startup::phase state_phase("game state");
+    game::state gstate(edit_mode);
+    state_phase.stop();
+    startup::phase level_phase("first level");
+    gstate.set_level(start_level);
+    level_phase.stop();
+    report_load_time(start);
+    startup::report();
+    start = SDL_GetPerformanceCounter();
+    for (int frame = 0; frame < frames; frame++) {
+        gstate.draw(frame * FRAME_TICKS);
+        if (dump_dir) {
+            char name[32];
+            std::snprintf(name, sizeof(name), "/frame%05d.png", frame);
+            save_frame(*gstate.frame(), dump_dir + std::string(name));
+        }
+    }
+    if (!graphics::software_render)
+        glFinish();
+    double ms = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 /
+        (double)SDL_GetPerformanceFrequency();
+    std::fprintf(stderr, "Rendered %d frames in %.1f ms, %.0f frames/s\n",
+                 frames, ms, ms > 0.0 ? frames * 1000.0 / ms : 0.0);
+}
+
+/// Convert window coordinates to picture coordinates.
+static void window_to_picture(int x, int y, int *px, int *py)
+{
+    // Window coordinates are in points, which are not pixels on
+    // high-DPI displays, and count from the top.
+    int ww, wh, dw, dh;
+    SDL_GetWindowSize(core::window, &ww, &wh);
+    core::output_size(&dw, &dh);
+    if (ww <= 0 || wh <= 0) {
+        *px = *py = 0;
+        return;
+    }
+    core::viewport v = core::get_viewport(dw, dh);
+    double ox = (x + 0.5) * dw / ww, oy = dh - (y + 0.5) * dh / wh;
+    *px = (int)std::floor((ox - v.x) / v.scale);
+    *py = (int)std::floor((oy - v.y) / v.scale);
+}
+
+/// Toggle between a window and fullscreen.
+static void toggle_fullscreen()
+{
+    Uint32 flags = SDL_GetWindowFlags(core::window);
+    bool full = (flags & SDL_WINDOW_FULLSCREEN_DESKTOP) ==
+        SDL_WINDOW_FULLSCREEN_DESKTOP;
+    SDL_SetWindowFullscreen(
+        core::window, full ? 0 : SDL_WINDOW_FULLSCREEN_DESKTOP);
 }
 
 using game::key;
@@ -288,6 +672,17 @@ int main(int argc, char *argv[])
     const char *start_level = "difficulty";
     const char *data_dir = nullptr;
     bool edit_mode = false;
+    bool build_atlas = false;
+    bool build_archive = false;
+    bool build_sfx = false;
+    int startup_bench = 0;
+    bool startup_once = false;
+    std::vector<const char *> build_levels;
+    const char *bench_name = nullptr;
+    bool software = false;
+    bool offscreen = false;
+    int frames = 1000;
+    const char *dump_dir = nullptr;
     int i = 1;
     while (i < argc) {
         const char *a = argv[i];
@@ -306,6 +701,138 @@ int main(int argc, char *argv[])
         } else if (!std::strcmp(a, "--edit") || !std::strcmp(a, "-e")) {
             edit_mode = true;
             i++;
+        } else if (!std::strcmp(a, "--build-atlas")) {
+            build_atlas = true;
+            i++;
+        } else if (!std::strcmp(a, "--build-archive")) {
+            build_archive = true;
+            i++;
+        } else if (!std::strcmp(a, "--build-sfx")) {
+            build_sfx = true;
+            i++;
+        } else if (!std::strcmp(a, "--build-level")) {
+            i++;
+            if (i >= argc) {
+                std::fprintf(stderr,
+                             "Warning: --build-level needs an argument\n");
+                continue;
+            }
+            build_levels.push_back(argv[i]);
+            i++;
+        } else if (!std::strcmp(a, "--tv")) {
+            i++;
+            if (i >= argc) {
+                std::fprintf(stderr, "Warning: --tv needs an argument\n");
+                continue;
+            }
+            const char *q = argv[i];
+            i++;
+            if (!std::strcmp(q, "auto"))
+                graphics::tv_setting = graphics::tv_quality::AUTO;
+            else if (!std::strcmp(q, "full"))
+                graphics::tv_setting = graphics::tv_quality::FULL;
+            else if (!std::strcmp(q, "fast"))
+                graphics::tv_setting = graphics::tv_quality::FAST;
+            else if (!std::strcmp(q, "blit"))
+                graphics::tv_setting = graphics::tv_quality::BLIT;
+            else
+                std::fprintf(stderr, "Warning: unknown TV quality: %s\n", q);
+        } else if (!std::strcmp(a, "--bench")) {
+            i++;
+            if (i >= argc) {
+                std::fprintf(stderr, "Warning: --bench needs an argument\n");
+                continue;
+            }
+            bench_name = argv[i];
+            i++;
+        } else if (!std::strcmp(a, "--startup-bench")) {
+            // Start the game N times, each in a new process, and report
+            // percentiles for each phase.  The shader cache and the OS
+            // file cache stay warm after the first run; pass
+            // --no-shader-cache to compile the shaders every time.
+            i++;
+            if (i >= argc) {
+                std::fprintf(stderr,
+                             "Warning: --startup-bench needs an argument\n");
+                continue;
+            }
+            startup_bench = std::atoi(argv[i]);
+            i++;
+        } else if (!std::strcmp(a, "--startup-once")) {
+            // One run of --startup-bench, which prints its phases.
+            startup_once = true;
+            i++;
+        } else if (!std::strcmp(a, "--software")) {
+            software = true;
+            i++;
+        } else if (!std::strcmp(a, "--fullscreen")) {
+            core::fullscreen = true;
+            i++;
+        } else if (!std::strcmp(a, "--offscreen")) {
+            offscreen = true;
+            i++;
+        } else if (!std::strcmp(a, "--frames")) {
+            i++;
+            if (i >= argc) {
+                std::fprintf(stderr, "Warning: --frames needs an argument\n");
+                continue;
+            }
+            frames = std::atoi(argv[i]);
+            i++;
+        } else if (!std::strcmp(a, "--dump")) {
+            i++;
+            if (i >= argc) {
+                std::fprintf(stderr, "Warning: --dump needs an argument\n");
+                continue;
+            }
+            dump_dir = argv[i];
+            i++;
+        } else if (!std::strcmp(a, "--capture")) {
+            i++;
+            if (i >= argc) {
+                std::fprintf(stderr,
+                             "Warning: --capture needs an argument\n");
+                continue;
+            }
+            graphics::capture_path = argv[i];
+            i++;
+        } else if (!std::strcmp(a, "--capture-output")) {
+            graphics::capture_output = true;
+            i++;
+        } else if (!std::strcmp(a, "--profile")) {
+            graphics::profile_passes = true;
+            i++;
+        } else if (!std::strcmp(a, "--loader-threads")) {
+            i++;
+            if (i >= argc) {
+                std::fprintf(stderr,
+                             "Warning: --loader-threads needs an argument\n");
+                continue;
+            }
+            int n = std::atoi(argv[i]);
+            if (n < 1 || n > 64)
+                std::fprintf(stderr, "Warning: --loader-threads must be "
+                             "from 1 to 64\n");
+            else
+                loader::set_threads(n);
+            i++;
+        } else if (!std::strcmp(a, "--audio-buffer")) {
+            i++;
+            if (i >= argc) {
+                std::fprintf(stderr,
+                             "Warning: --audio-buffer needs an argument\n");
+                continue;
+            }
+            int n = std::atoi(argv[i]);
+            if (n < 64 || n > 8192 || (n & (n - 1)))
+                std::fprintf(stderr, "Warning: --audio-buffer must be a "
+                             "power of two from 64 to 8192\n");
+            else
+                core::audio_buffer = n;
+            i++;
+        } else if (!std::strcmp(a, "--no-shader-cache")) {
+            core::use_shader_cache = false;
+            i++;
         } else if (len >= 4 && !std::memcmp(a, "-psn", 4)) {
             i++;
         } else if (len >= 3 && !std::memcmp(a, "-NS", 3)) {
@@ -316,42 +843,135 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (bench_name)
+        return bench::run(bench_name);
+
+    if (build_atlas) {
+        if (SDL_Init(0) < 0)
+            core::die("Unable to initialize SDL");
+        if (!(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG))
+            core::die("Unable to initialize SDL_image");
+        core::init_path(data_dir);
+        graphics::sprite_data::build_atlas();
+        SDL_Quit();
+        return 0;
+    }
+
+    if (!build_levels.empty()) {
+        if (SDL_Init(0) < 0)
+            core::die("Unable to initialize SDL");
+        if (!(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG))
+            core::die("Unable to initialize SDL_image");
+        core::init_path(data_dir);
+        for (const char *level : build_levels)
+            game::compiled_level::compile(level);
+        SDL_Quit();
+        return 0;
+    }
+
+    if (build_sfx) {
+        if (SDL_Init(0) < 0)
+            core::die("Unable to initialize SDL");
+        core::init_path(data_dir);
+        audio::build_sfx();
+        SDL_Quit();
+        return 0;
+    }
+
+    if (build_archive) {
+        core::init_path(data_dir);
+        archive::build(archive::DEFAULT_PATH);
+        return 0;
+    }
+
+    if (startup_bench > 0)
+        return run_startup_bench(startup_bench, argc, argv);
+
+    if (startup_once) {
+        run_startup(start_level, edit_mode, data_dir);
+        startup::write_records(stdout);
+        return 0;
+    }
+
+    if (software) {
+        if (SDL_Init(SDL_INIT_TIMER | SDL_INIT_EVENTS) < 0)
+            core::die("Unable to initialize SDL");
+        if (!(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG))
+            core::die("Unable to initialize SDL_image");
+        core::init_data(data_dir, edit_mode);
+        rng::global.init();
+        graphics::software_render = true;
+        run_headless(start_level, edit_mode, frames, dump_dir);
+        SDL_Quit();
+        return 0;
+    }
+
+    if (offscreen) {
+        core::init_offscreen();
+        core::init_data(data_dir, edit_mode);
+        graphics::offscreen_render = true;
+        run_headless(start_level, edit_mode, frames, dump_dir);
+        core::term_offscreen();
+        return 0;
+    }
+
     const unsigned MIN_TICKS1 = 1000 / core::MAXFPS;
     const unsigned MIN_TICKS = MIN_TICKS1 > 0 ? MIN_TICKS1 : 1;
 
+    startup::phase init_phase("init");
     core::init();
-    core::init_path(data_dir);
+    init_phase.stop();
+    startup::phase data_phase("data");
+    core::init_data(data_dir, edit_mode);
+    data_phase.stop();
 
     {
         bool do_quit = false;
         unsigned last_frame = SDL_GetTicks();
+        Uint64 load_start = SDL_GetPerformanceCounter();
+        startup::phase state_phase("game state");
         game::state gstate(edit_mode);
+        state_phase.stop();
+        startup::phase level_phase("first level");
         gstate.set_level(start_level);
+        level_phase.stop();
+        report_load_time(load_start);
+        startup::report();
         while (!do_quit) {
             SDL_Event e;
+            int x, y;
             while (SDL_PollEvent(&e)) {
                 switch (e.common.type) {
                 case SDL_QUIT:
                     do_quit = true;
                     break;
 
+                case SDL_WINDOWEVENT:
+                    gstate.invalidate();
+                    break;
+
                 case SDL_MOUSEBUTTONDOWN:
                 case SDL_MOUSEBUTTONUP:
+                    window_to_picture(e.button.x, e.button.y, &x, &y);
                     gstate.mouse_click(
-                        e.button.x / core::SCALE,
-                        (core::IHEIGHT - 1 - e.button.y) / core::SCALE,
+                        x, y,
                         e.common.type == SDL_MOUSEBUTTONDOWN ?
                         e.button.button : -1);
                     break;
 
                 case SDL_MOUSEMOTION:
-                    gstate.mouse_move(
-                        e.motion.x / core::SCALE,
-                        (core::IHEIGHT - 1 - e.motion.y) / core::SCALE);
+                    window_to_picture(e.motion.x, e.motion.y, &x, &y);
+                    gstate.mouse_move(x, y);
                     break;
 
                 case SDL_KEYDOWN:
                 case SDL_KEYUP:
+                    if (e.key.keysym.scancode == SDL_SCANCODE_F11 &&
+                        !graphics::capture_output) {
+                        if (e.common.type == SDL_KEYDOWN && !e.key.repeat)
+                            toggle_fullscreen();
+                        break;
+                    }
                     key k;
                     if (decode_key(e.key.keysym.scancode, &k))
                         gstate.event_key(k, e.common.type == SDL_KEYDOWN);
@@ -359,8 +979,8 @@ int main(int argc, char *argv[])
                 }
             }
 
-            gstate.draw(SDL_GetTicks());
-            core::swap_window();
+            if (gstate.draw(SDL_GetTicks()))
+                core::swap_window();
 
             unsigned now = SDL_GetTicks();
             unsigned delta = now - last_frame;
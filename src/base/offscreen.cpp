@@ -0,0 +1,145 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include "offscreen.hpp"
+#include "defs.hpp"
+#if defined USE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <cstdio>
+#include <cstring>
+#endif
+namespace core {
+
+#if defined USE_EGL
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLContext context = EGL_NO_CONTEXT;
+static EGLSurface surface = EGL_NO_SURFACE;
+
+/// Check whether a space-separated extension string has an extension.
+static bool has_extension(const char *exts, const char *name)
+{
+    if (!exts)
+        return false;
+    std::size_t len = std::strlen(name);
+    const char *p = exts;
+    while ((p = std::strstr(p, name)) != nullptr) {
+        if ((p == exts || p[-1] == ' ') && (p[len] == ' ' || !p[len]))
+            return true;
+        p += len;
+    }
+    return false;
+}
+
+/// Get a display that does not need a window system, if possible.
+static EGLDisplay get_display()
+{
+    const char *exts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+#if defined EGL_PLATFORM_SURFACELESS_MESA
+    if (has_extension(exts, "EGL_MESA_platform_surfaceless") &&
+        has_extension(exts, "EGL_EXT_platform_base")) {
+        auto get_platform_display =
+            reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+                eglGetProcAddress("eglGetPlatformDisplayEXT"));
+        if (get_platform_display) {
+            EGLDisplay d = get_platform_display(
+                EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY,
+                nullptr);
+            if (d != EGL_NO_DISPLAY)
+                return d;
+        }
+    }
+#else
+    (void) exts;
+#endif
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+void create_offscreen_context()
+{
+    display = get_display();
+    if (display == EGL_NO_DISPLAY)
+        die("Could not get an EGL display");
+    EGLint major, minor;
+    if (!eglInitialize(display, &major, &minor))
+        die("Could not initialize EGL");
+    if (!eglBindAPI(EGL_OPENGL_API))
+        die("EGL does not support OpenGL");
+
+    const char *exts = eglQueryString(display, EGL_EXTENSIONS);
+    bool surfaceless =
+        has_extension(exts, "EGL_KHR_surfaceless_context");
+    const EGLint config_attrib[] = {
+        EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint nconfig;
+    if (!eglChooseConfig(display, config_attrib, &config, 1, &nconfig) ||
+        nconfig < 1)
+        die("No suitable EGL configuration");
+
+    const EGLint context_attrib[] = {
+#if !defined NDEBUG && defined EGL_CONTEXT_OPENGL_DEBUG
+        EGL_CONTEXT_OPENGL_DEBUG, EGL_TRUE,
+#endif
+        EGL_NONE
+    };
+    context = eglCreateContext(
+        display, config, EGL_NO_CONTEXT, context_attrib);
+    if (context == EGL_NO_CONTEXT)
+        die("Could not create an EGL context");
+
+    // Without surfaceless contexts, a small pbuffer stands in for the
+    // window.  Everything is drawn to framebuffer objects either way.
+    if (!surfaceless) {
+        const EGLint pbuffer_attrib[] = {
+            EGL_WIDTH, 1,
+            EGL_HEIGHT, 1,
+            EGL_NONE
+        };
+        surface = eglCreatePbufferSurface(display, config, pbuffer_attrib);
+        if (surface == EGL_NO_SURFACE)
+            die("Could not create an EGL pbuffer");
+    }
+    if (!eglMakeCurrent(display, surface, surface, context))
+        die("Could not make the EGL context current");
+
+    std::fprintf(stderr, "EGL %d.%d offscreen context, %s\n",
+                 major, minor, surfaceless ? "surfaceless" : "pbuffer");
+}
+
+void destroy_offscreen_context()
+{
+    if (display == EGL_NO_DISPLAY)
+        return;
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
+    if (surface != EGL_NO_SURFACE)
+        eglDestroySurface(display, surface);
+    if (context != EGL_NO_CONTEXT)
+        eglDestroyContext(display, context);
+    eglTerminate(display);
+    display = EGL_NO_DISPLAY;
+    context = EGL_NO_CONTEXT;
+    surface = EGL_NO_SURFACE;
+}
+
+#else
+
+void create_offscreen_context()
+{
+    die("Offscreen rendering needs EGL, which is not available");
+}
+
+void destroy_offscreen_context()
+{ }
+
+#endif
+
+}
@@ -0,0 +1,18 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_OFFSCREEN_HPP
+#define LD_OFFSCREEN_HPP
+namespace core {
+
+/// Create an OpenGL context with EGL and make it current, without a
+/// window.  The context is surfaceless if the driver allows it, so
+/// rendering must go to framebuffer objects.  Works with Mesa's
+/// software rasterizers, so it runs on machines without a display.
+void create_offscreen_context();
+
+/// Destroy the offscreen context.
+void destroy_offscreen_context();
+
+}
+#endif
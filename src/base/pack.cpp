@@ -2,13 +2,22 @@
    This file is part of Oubliette.  Oubliette is licensed under the terms
    of the 2-clause BSD license.  For more information, see LICENSE.txt. */
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
+#include <thread>
 #include <vector>
 #include <assert.h>
 #include "defs.hpp"
 #include "pack.hpp"
 namespace pack {
 
+// Below this many rectangles, candidate sizes are tried serially.
+static const std::size_t PARALLEL_THRESHOLD = 256;
+
+options::options()
+    : max_size(1024), max_pages(1), allow_rotate(false)
+{ }
+
 // Rect, sorts from biggest to smallest.
 struct rect {
     size rectsize;
@@ -19,20 +28,25 @@ struct rect {
 
 bool rect::operator<(const rect &other) const
 {
-    if (rectsize.width > other.rectsize.width)
-        return true;
-    if (rectsize.width < other.rectsize.width)
-        return false;
-    return rectsize.height > other.rectsize.height;
+    int a0 = std::max(rectsize.width, rectsize.height);
+    int b0 = std::max(other.rectsize.width, other.rectsize.height);
+    if (a0 != b0)
+        return a0 > b0;
+    int a1 = std::min(rectsize.width, rectsize.height);
+    int b1 = std::min(other.rectsize.width, other.rectsize.height);
+    if (a1 != b1)
+        return a1 > b1;
+    return index < other.index;
 }
 
 // Metrics for how good a packing is.
 struct metrics {
-    int area;
+    int pages;
+    long area;
     int nonsquare;
 
     metrics();
-    metrics(const size &size);
+    metrics(const packing &p);
     bool operator<(const metrics &other) const;
 };
 
@@ -40,108 +54,260 @@ metrics::metrics()
 {
 }
 
-metrics::metrics(const size &size)
-    : area(size.width * size.height),
-      nonsquare(std::abs(size.width - size.height))
+metrics::metrics(const packing &p)
+    : pages(p.pages),
+      area((long)p.pages * p.packsize.width * p.packsize.height),
+      nonsquare(std::abs(p.packsize.width - p.packsize.height))
 {
 }
 
 bool metrics::operator<(const metrics &other) const
 {
-    if (area < other.area)
-        return true;
-    if (area > other.area)
-        return false;
+    if (pages != other.pages)
+        return pages < other.pages;
+    if (area != other.area)
+        return area < other.area;
     return nonsquare < other.nonsquare;
 }
 
-// Packing state.
-struct packer {
-    std::vector<int> frontier;
-    packing result;
-    std::vector<rect> rects;
+// A horizontal segment of the skyline.
+struct segment {
+    int x, y, width;
+};
+
+// A candidate position for a rectangle.
+struct position {
+    int x, y, top;
+    std::size_t seg;
+};
+
+// A page packed with the skyline bottom-left heuristic.
+class skyline {
+private:
+    int width_, height_;
+    std::vector<segment> segs_;
+
+public:
+    skyline(int width, int height);
 
-    bool try_pack(int width, int height);
+    // Find the lowest position for a rectangle.  Returns false if none.
+    bool find(int w, int h, position &pos) const;
+    // Add a rectangle at a position returned by find().
+    void insert(const position &pos, int w, int h);
 };
 
-bool packer::try_pack(int width, int height)
+skyline::skyline(int width, int height)
+    : width_(width), height_(height)
 {
-    frontier.clear();
-    frontier.resize(height, 0);
+    segment s = { 0, 0, width };
+    segs_.push_back(s);
+}
+
+bool skyline::find(int w, int h, position &pos) const
+{
+    bool found = false;
+    std::size_t n = segs_.size();
+    for (std::size_t i = 0; i < n; i++) {
+        int x = segs_[i].x;
+        if (x + w > width_)
+            break;
+        int y = 0;
+        for (std::size_t j = i; j < n && segs_[j].x < x + w; j++) {
+            if (segs_[j].y > y)
+                y = segs_[j].y;
+        }
+        int top = y + h;
+        if (top > height_)
+            continue;
+        if (!found || top < pos.top || (top == pos.top && x < pos.x)) {
+            found = true;
+            pos.x = x;
+            pos.y = y;
+            pos.top = top;
+            pos.seg = i;
+        }
+    }
+    return found;
+}
+
+void skyline::insert(const position &pos, int w, int h)
+{
+    int x0 = pos.x, x1 = pos.x + w;
+    std::size_t i = pos.seg, j = i;
+    while (j < segs_.size() && segs_[j].x + segs_[j].width <= x1)
+        j++;
+    if (j < segs_.size() && segs_[j].x < x1) {
+        segs_[j].width -= x1 - segs_[j].x;
+        segs_[j].x = x1;
+    }
+    segment s = { x0, pos.y + h, w };
+    segs_.erase(segs_.begin() + i, segs_.begin() + j);
+    segs_.insert(segs_.begin() + i, s);
+
+    // Merge neighbors at the same height.
+    if (i + 1 < segs_.size() && segs_[i + 1].y == s.y) {
+        segs_[i].width += segs_[i + 1].width;
+        segs_.erase(segs_.begin() + i + 1);
+    }
+    if (i > 0 && segs_[i - 1].y == s.y) {
+        segs_[i - 1].width += segs_[i].width;
+        segs_.erase(segs_.begin() + i);
+    }
+}
+
+// Find the lowest position on a page, possibly transposed.
+static bool find_position(const skyline &page, int w, int h,
+                          bool can_rotate, position &pos, bool &rotated)
+{
+    position rpos;
+    bool ok = page.find(w, h, pos);
+    rotated = false;
+    if (can_rotate && page.find(h, w, rpos) &&
+        (!ok || rpos.top < pos.top)) {
+        pos = rpos;
+        rotated = true;
+        ok = true;
+    }
+    return ok;
+}
+
+// Pack sorted rectangles into pages of the given size.
+static bool try_pack(const std::vector<rect> &rects, size pagesize,
+                     const options &opts, packing &result)
+{
+    std::vector<skyline> pages;
+    result.packsize = pagesize;
+    result.pages = 0;
     result.locations.resize(rects.size());
-    result.packsize.width = width;
-    result.packsize.height = height;
-    int ypos = 0;
-    for (auto rect : rects) {
-        int sw = rect.rectsize.width, sh = rect.rectsize.height;
-        std::size_t index = rect.index;
-        if (ypos + sw > height)
-            ypos = 0;
-        while (ypos + sh <= height && frontier[ypos] + sw > width)
-            ypos++;
-        if (ypos + sh > height)
-            return false;
-        int xpos = frontier[ypos];
-        for (int i = 0; i < ypos + sh; i++) {
-            if (frontier[i] < xpos + sw)
-                frontier[i] = xpos + sw;
+    for (auto &r : rects) {
+        int w = r.rectsize.width, h = r.rectsize.height;
+        bool can_rotate = opts.allow_rotate && w != h;
+        position pos;
+        bool rotated = false;
+        int page = -1;
+        for (std::size_t p = 0; p < pages.size(); p++) {
+            if (find_position(pages[p], w, h, can_rotate, pos, rotated)) {
+                page = p;
+                break;
+            }
+        }
+        if (page < 0) {
+            if ((int)pages.size() >= opts.max_pages)
+                return false;
+            pages.emplace_back(pagesize.width, pagesize.height);
+            page = pages.size() - 1;
+            if (!find_position(pages[page], w, h, can_rotate, pos, rotated))
+                return false;
         }
-        assert(0 <= ypos && ypos <= height - sh);
-        assert(0 <= xpos && xpos <= width - sw);
-        result.locations[index].x = xpos;
-        result.locations[index].y = ypos;
-        ypos += sh;
+        if (rotated)
+            std::swap(w, h);
+        pages[page].insert(pos, w, h);
+        assert(0 <= pos.x && pos.x <= pagesize.width - w);
+        assert(0 <= pos.y && pos.y <= pagesize.height - h);
+        location &loc = result.locations[r.index];
+        loc.x = pos.x;
+        loc.y = pos.y;
+        loc.page = page;
+        loc.rotated = rotated;
     }
+    result.pages = pages.size();
     return true;
 }
 
 packing pack(const std::vector<size> &rects)
 {
-    packer packer;
+    packing result = pack(rects, options());
+    if (result.pages == 0)
+        core::die("Could not pack sprites.");
+    return result;
+}
+
+packing pack(const std::vector<size> &rects, const options &opts)
+{
+    std::vector<rect> sorted;
     std::size_t rectarea = 0;
-    packer.rects.reserve(rects.size());
+    sorted.reserve(rects.size());
     for (std::size_t i = 0; i < rects.size(); i++) {
         rect r;
         r.rectsize = rects[i];
         r.index = i;
-        packer.rects.push_back(r);
+        sorted.push_back(r);
         rectarea += static_cast<std::size_t>(rects[i].width) *
             static_cast<std::size_t>(rects[i].height);
     }
-    std::sort(packer.rects.begin(), packer.rects.end());
+    std::sort(sorted.begin(), sorted.end());
 
-    bool havepacking = false;
-    packing bestpacking;
-    for (int i = 4; i < 10; i++) {
+    // Candidate page sizes, every power of two from 16 to the maximum
+    // which could possibly hold all of the rectangles.
+    std::vector<size> candidates;
+    for (int i = 4; (1 << i) <= opts.max_size; i++) {
         int height = 1 << i;
-        bool success = false;
-        for (int j = 4; j < 10; j++) {
+        for (int j = 4; (1 << j) <= opts.max_size; j++) {
             int width = 1 << j;
-            if (rectarea > static_cast<std::size_t>(1) << (i + j))
+            bool fits = true;
+            for (std::size_t k = 0; fits && k < rects.size(); k++) {
+                const size &r = rects[k];
+                if (opts.allow_rotate)
+                    fits = (r.width <= width && r.height <= height) ||
+                        (r.height <= width && r.width <= height);
+                else
+                    fits = r.width <= width && r.height <= height;
+            }
+            if (!fits)
+                continue;
+            if (rectarea > (static_cast<std::size_t>(opts.max_pages)
+                            << (i + j)))
                 continue;
-            if (packer.try_pack(width, height)) {
-                success = true;
+            size sz = { width, height };
+            candidates.push_back(sz);
+        }
+    }
+
+    std::vector<packing> results(candidates.size());
+    std::vector<char> success(candidates.size(), 0);
+    std::atomic<std::size_t> next(0);
+    auto worker = [&]() {
+        while (true) {
+            std::size_t k = next++;
+            if (k >= candidates.size())
                 break;
-            }
+            success[k] = try_pack(sorted, candidates[k], opts, results[k]);
         }
-        if (!success)
+    };
+
+    unsigned nthreads = 1;
+    if (rects.size() >= PARALLEL_THRESHOLD) {
+        nthreads = std::thread::hardware_concurrency();
+        if (nthreads < 1)
+            nthreads = 1;
+        if (nthreads > candidates.size())
+            nthreads = candidates.size();
+    }
+    if (nthreads <= 1) {
+        worker();
+    } else {
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < nthreads; i++)
+            threads.emplace_back(worker);
+        for (auto &t : threads)
+            t.join();
+    }
+
+    int best = -1;
+    for (std::size_t k = 0; k < candidates.size(); k++) {
+        if (!success[k])
             continue;
-        if (havepacking) {
-            metrics curmetrics(packer.result.packsize);
-            metrics bestmetrics(bestpacking.packsize);
-            if (curmetrics < bestmetrics) {
-                packing temp(std::move(bestpacking));
-                bestpacking = std::move(packer.result);
-                packer.result = std::move(temp);
-            }
-        } else {
-            bestpacking = std::move(packer.result);
-            havepacking = true;
-        }
+        if (best < 0 || metrics(results[k]) < metrics(results[best]))
+            best = k;
     }
-    if (!havepacking)
-        core::die("Could not pack sprites.");
-    return bestpacking;
+    if (best < 0) {
+        packing none;
+        none.packsize.width = 0;
+        none.packsize.height = 0;
+        none.pages = 0;
+        return none;
+    }
+    return std::move(results[best]);
 }
 
 }
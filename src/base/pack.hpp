@@ -18,13 +18,32 @@ struct size {
 struct location {
     int x;
     int y;
+    /// The page containing the rectangle.
+    int page;
+    /// Whether the rectangle is transposed (width and height swapped).
+    bool rotated;
+};
+
+/// Options controlling how rectangles are packed.
+struct options {
+    /// The largest allowed page width or height, a power of two.
+    int max_size;
+    /// The largest allowed number of pages.
+    int max_pages;
+    /// Whether rectangles may be transposed to fit better.
+    bool allow_rotate;
+
+    options();
 };
 
 /// A complete packing of a set of rectangles.
 struct packing {
-    /// The size of the rectangle enclosing the packed rectangles.
+    /// The size of each page.  All pages have the same size.
     size packsize;
 
+    /// The number of pages used.
+    int pages;
+
     /// The location of the packed rectangles.
     std::vector<location> locations;
 };
@@ -32,6 +51,10 @@ struct packing {
 /// Efficiently pack a set of rectangles in a larger rectangle.
 packing pack(const std::vector<size> &rects);
 
+/// Efficiently pack a set of rectangles in one or more pages.  Returns a
+/// packing with zero pages if the rectangles do not fit.
+packing pack(const std::vector<size> &rects, const options &opts);
+
 }
 
 #endif
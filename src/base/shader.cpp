@@ -5,13 +5,22 @@
 #include "file.hpp"
 #include "shader.hpp"
 #include <cstdio>
+#include <cstring>
 #include <stdexcept>
+#include <vector>
 #include <assert.h>
 
 namespace shader {
 
-/// Load a GLSL shader.  Returns 0 on failure.
-GLuint load_shader(const std::string &name, GLenum type)
+std::string cache_dir;
+
+/// Cached program binary file magic, "SHBC".
+static const unsigned CACHE_MAGIC = 0x43424853u;
+/// Size of the cached program binary header.
+static const std::size_t CACHE_HEADER = 20;
+
+/// Get the path to a GLSL shader.
+static std::string shader_path(const std::string &name, GLenum type)
 {
     std::string path("shader/");
     path += name;
@@ -20,29 +29,31 @@ GLuint load_shader(const std::string &name, GLenum type)
     case GL_FRAGMENT_SHADER: path += ".frag.glsl"; break;
     default: assert(0);
     }
+    return path;
+}
 
-    core::check_gl_error(HERE);
-
-    data data;
-    if (!data::read(&data, path))
-        return 0;
-
+/// Start compiling a GLSL shader.  The status is checked when the
+/// program is linked.
+static GLuint compile_shader(const data &source, GLenum type)
+{
     const char *darr[1];
     GLint larr[1];
 
     GLuint shader = glCreateShader(type);
-    darr[0] = static_cast<const char *>(data.ptr());
-    larr[0] = data.size();
+    darr[0] = static_cast<const char *>(source.ptr());
+    larr[0] = source.size();
     glShaderSource(shader, 1, darr, larr);
     glCompileShader(shader);
-    GLint flag;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &flag);
-    if (flag) {
-        core::check_gl_error(HERE);
-        return shader;
-    }
+    return shader;
+}
 
-    GLint loglen;
+/// Print the log of a shader which failed to compile.
+static void shader_log(GLuint shader, const std::string &path)
+{
+    GLint flag, loglen;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &flag);
+    if (flag)
+        return;
     glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &loglen);
     std::fprintf(stderr, "%s: compilation failed\n", path.c_str());
     if (loglen > 0) {
@@ -52,31 +63,21 @@ GLuint load_shader(const std::string &name, GLenum type)
         std::fputc('\n', stderr);
         delete[] log;
     }
-    glDeleteShader(shader);
-    return 0;
 }
 
-/// Link a shader program.  Returns false on failure.
-bool LinkProgram(GLuint prog, std::string &name)
+/// Print the log of a program which failed to link.
+static void program_log(GLuint prog, const std::string &name)
 {
-    GLint flag, loglen;
-    char *log;
-
-    glLinkProgram(prog);
-    glGetProgramiv(prog, GL_LINK_STATUS, &flag);
-    if (flag)
-        return true;
-
+    GLint loglen;
     glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &loglen);
-    std::fprintf(stderr, "%s: linking failed", name.c_str());
+    std::fprintf(stderr, "%s: linking failed\n", name.c_str());
     if (loglen > 0) {
-        log = new char[loglen];
+        char *log = new char[loglen];
         glGetProgramInfoLog(prog, loglen, NULL, log);
         std::fputs(log, stderr);
         std::fputc('\n', stderr);
         delete[] log;
     }
-    return false;
 }
 
 /// Load the indexes of shader uniforms into an object.
@@ -99,36 +100,225 @@ void get_attributes(GLuint prog, void *object, const field *attributes)
     }
 }
 
-GLuint load_program(const std::string &vertexshader,
-                    const std::string &fragmentshader,
-                    const field *uniforms,
-                    const field *attributes,
-                    void *object)
+/// Hash bytes into a 64-bit FNV-1a hash.
+static void hash_bytes(unsigned long long &h, const void *ptr,
+                       std::size_t size)
 {
-    std::string name = vertexshader + ", " + fragmentshader;
-    GLuint vertex = load_shader(vertexshader, GL_VERTEX_SHADER);
-    if (vertex == 0) {
-        return 0;
+    const unsigned char *p = static_cast<const unsigned char *>(ptr);
+    for (std::size_t i = 0; i < size; i++)
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    h = (h ^ 0xff) * 0x100000001b3ull;
+}
+
+/// Hash a GL string into a 64-bit FNV-1a hash.
+static void hash_string(unsigned long long &h, GLenum name)
+{
+    const char *s = reinterpret_cast<const char *>(glGetString(name));
+    if (s)
+        hash_bytes(h, s, std::strlen(s));
+}
+
+static unsigned read_u32(const unsigned char *p)
+{
+    return (unsigned)p[0] | ((unsigned)p[1] << 8) |
+        ((unsigned)p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static void write_u32(unsigned char *p, unsigned x)
+{
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+/// Determine whether program binaries can be cached, and enable
+/// parallel compilation if it is supported.
+static bool init_cache()
+{
+    static int state = -1;
+    if (state >= 0)
+        return state != 0;
+    state = 0;
+#if defined USE_GLEW
+#if defined GL_KHR_parallel_shader_compile
+    if (GLEW_KHR_parallel_shader_compile)
+        glMaxShaderCompilerThreadsKHR(0xffffffffu);
+#endif
+    if (!cache_dir.empty() && GLEW_ARB_get_program_binary) {
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        state = formats > 0;
     }
-    GLuint fragment = load_shader(fragmentshader, GL_FRAGMENT_SHADER);
-    if (fragment == 0) {
-        glDeleteShader(vertex);
-        return 0;
+#endif
+    return state != 0;
+}
+
+/// Load a program from the binary cache.  Returns false if the binary
+/// is missing, stale, or rejected by the driver.
+static bool load_cached(build &b)
+{
+#if defined USE_GLEW
+    // A missing binary is not an error, so check before reading.
+    FILE *fp = std::fopen(b.cachepath.c_str(), "rb");
+    if (!fp)
+        return false;
+    std::fclose(fp);
+    data bin;
+    if (!data::read(&bin, b.cachepath))
+        return false;
+    const unsigned char *p = static_cast<const unsigned char *>(bin.ptr());
+    if (bin.size() < CACHE_HEADER || read_u32(p) != CACHE_MAGIC ||
+        read_u32(p + 4) != (unsigned)b.key ||
+        read_u32(p + 8) != (unsigned)(b.key >> 32) ||
+        read_u32(p + 16) != bin.size() - CACHE_HEADER)
+        return false;
+    GLenum format = read_u32(p + 12);
+    b.prog = glCreateProgram();
+    glProgramBinary(b.prog, format, p + CACHE_HEADER,
+                    bin.size() - CACHE_HEADER);
+    GLint flag = 0;
+    glGetProgramiv(b.prog, GL_LINK_STATUS, &flag);
+    if (flag)
+        return true;
+    glDeleteProgram(b.prog);
+    b.prog = 0;
+    // Clear the error from an unsupported format.
+    while (glGetError()) { }
+#else
+    (void)b;
+#endif
+    return false;
+}
+
+/// Save a linked program to the binary cache.
+static void save_cached(const build &b, GLuint prog)
+{
+#if defined USE_GLEW
+    GLint length = 0;
+    glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+    std::vector<unsigned char> bin(CACHE_HEADER + length);
+    GLenum format = 0;
+    glGetProgramBinary(prog, length, nullptr, &format,
+                       bin.data() + CACHE_HEADER);
+    unsigned char *p = bin.data();
+    write_u32(p, CACHE_MAGIC);
+    write_u32(p + 4, (unsigned)b.key);
+    write_u32(p + 8, (unsigned)(b.key >> 32));
+    write_u32(p + 12, format);
+    write_u32(p + 16, length);
+    FILE *fp = std::fopen(b.cachepath.c_str(), "wb");
+    if (!fp)
+        return;
+    std::size_t amt = std::fwrite(bin.data(), 1, bin.size(), fp);
+    if (std::fclose(fp) || amt != bin.size()) {
+        std::fprintf(stderr, "Could not write %s\n", b.cachepath.c_str());
+        std::remove(b.cachepath.c_str());
+    }
+#else
+    (void)b;
+    (void)prog;
+#endif
+}
+
+void start_program(build &b,
+                   const std::string &vertexshader,
+                   const std::string &fragmentshader)
+{
+    b.name = vertexshader + ", " + fragmentshader;
+    b.cachepath.clear();
+    b.key = 0;
+    b.prog = 0;
+    b.vertex = 0;
+    b.fragment = 0;
+    b.cached = false;
+
+    core::check_gl_error(HERE);
+
+    data vsrc, fsrc;
+    if (!data::read(&vsrc, shader_path(vertexshader, GL_VERTEX_SHADER)) ||
+        !data::read(&fsrc, shader_path(fragmentshader, GL_FRAGMENT_SHADER)))
+        return;
+
+    if (init_cache()) {
+        unsigned long long h = 0xcbf29ce484222325ull;
+        hash_bytes(h, vsrc.ptr(), vsrc.size());
+        hash_bytes(h, fsrc.ptr(), fsrc.size());
+        hash_string(h, GL_VENDOR);
+        hash_string(h, GL_RENDERER);
+        hash_string(h, GL_VERSION);
+        b.key = h;
+        b.cachepath = cache_dir + "shader-" + vertexshader + "-" +
+            fragmentshader + ".bin";
+        if (load_cached(b)) {
+            b.cached = true;
+            return;
+        }
     }
-    GLuint prog = glCreateProgram();
-    glAttachShader(prog, vertex);
-    glAttachShader(prog, fragment);
-    glDeleteShader(vertex);
-    glDeleteShader(fragment);
-    if (!LinkProgram(prog, name)) {
-        glDeleteProgram(prog);
+
+    b.vertex = compile_shader(vsrc, GL_VERTEX_SHADER);
+    b.fragment = compile_shader(fsrc, GL_FRAGMENT_SHADER);
+    b.prog = glCreateProgram();
+    glAttachShader(b.prog, b.vertex);
+    glAttachShader(b.prog, b.fragment);
+#if defined USE_GLEW
+    if (!b.cachepath.empty())
+        glProgramParameteri(
+            b.prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#endif
+    glLinkProgram(b.prog);
+}
+
+GLuint finish_program(build &b,
+                      const field *uniforms,
+                      const field *attributes,
+                      void *object)
+{
+    GLuint prog = b.prog;
+    b.prog = 0;
+    if (!prog)
         return 0;
+    if (!b.cached) {
+        GLint flag;
+        glGetProgramiv(prog, GL_LINK_STATUS, &flag);
+        bool ok = flag != 0;
+        if (!ok) {
+            std::size_t comma = b.name.find(", ");
+            shader_log(b.vertex, shader_path(
+                b.name.substr(0, comma), GL_VERTEX_SHADER));
+            shader_log(b.fragment, shader_path(
+                b.name.substr(comma + 2), GL_FRAGMENT_SHADER));
+            program_log(prog, b.name);
+        }
+        glDetachShader(prog, b.vertex);
+        glDetachShader(prog, b.fragment);
+        glDeleteShader(b.vertex);
+        glDeleteShader(b.fragment);
+        b.vertex = 0;
+        b.fragment = 0;
+        if (!ok) {
+            glDeleteProgram(prog);
+            return 0;
+        }
+        if (!b.cachepath.empty())
+            save_cached(b, prog);
     }
     get_uniforms(prog, object, uniforms);
     get_attributes(prog, object, attributes);
+    core::check_gl_error(HERE);
     return prog;
 }
 
+GLuint load_program(const std::string &vertexshader,
+                    const std::string &fragmentshader,
+                    const field *uniforms,
+                    const field *attributes,
+                    void *object)
+{
+    build b;
+    start_program(b, vertexshader, fragmentshader);
+    return finish_program(b, uniforms, attributes, object);
+}
+
 #define FIELD(n) { #n, offsetof(TYPE, n) }
 
 #define TYPE plain
@@ -149,6 +339,7 @@ const field sprite::UNIFORMS[] = {
     FIELD(u_vertxform),
     FIELD(u_texscale),
     FIELD(u_texture),
+    FIELD(u_palette),
     { nullptr, 0 }
 };
 
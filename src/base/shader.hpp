@@ -17,6 +17,37 @@ struct field {
     std::size_t offset;
 };
 
+/// Directory for cached program binaries, ending in a path separator,
+/// or empty to always compile programs from source.
+extern std::string cache_dir;
+
+/// A shader program which is being compiled and linked.
+struct build {
+    std::string name;
+    /// Path to the cached binary, or empty.
+    std::string cachepath;
+    /// Hash of the sources and driver, identifying the cached binary.
+    unsigned long long key;
+    GLuint prog;
+    GLuint vertex;
+    GLuint fragment;
+    /// Whether the program was loaded from the cache.
+    bool cached;
+};
+
+/// Start loading an OpenGL shader program, from the binary cache if
+/// possible.  Compiling and linking may continue in the background,
+/// in parallel with other programs, until the program is finished.
+void start_program(build &b,
+                   const std::string &vertexshader,
+                   const std::string &fragmentshader);
+
+/// Finish loading a shader program.  Returns 0 on failure.
+GLuint finish_program(build &b,
+                      const field *uniforms,
+                      const field *attributes,
+                      void *object);
+
 /// Load an OpenGL shader program.  Returns 0 on failure.
 GLuint load_program(const std::string &vertexshader,
                     const std::string &fragmentshader,
@@ -25,11 +56,14 @@ GLuint load_program(const std::string &vertexshader,
                     void *object);
 
 /// An OpenGL shader program.  The parameter T has uniforms and attributes.
+/// Loading starts when the program is constructed, and the program must
+/// be finished before it is used.
 template<class T>
 class program {
 private:
     GLuint prog_;
     T fields_;
+    build build_;
 
 public:
     program(const std::string &vertexshader,
@@ -38,6 +72,10 @@ public:
     ~program();
     program &operator =(const program &) = delete;
 
+    /// Finish loading the program.
+    void finish();
+    /// Determine whether the program was loaded from the binary cache.
+    bool cached() const { return build_.cached; }
     /// Get program attribute and uniform indexes.
     const T *operator->() const { return &fields_; }
     /// Get the program object.
@@ -49,16 +87,24 @@ program<T>::program(const std::string &vertexshader,
                     const std::string &fragmentshader)
     : prog_(0), fields_()
 {
-    prog_ = load_program(
-        vertexshader, fragmentshader,
-        T::UNIFORMS, T::ATTRIBUTES,
-        &fields_);
+    start_program(build_, vertexshader, fragmentshader);
+}
+
+template<class T>
+void program<T>::finish()
+{
+    if (build_.prog)
+        prog_ = finish_program(
+            build_, T::UNIFORMS, T::ATTRIBUTES, &fields_);
 }
 
 template<class T>
 program<T>::~program()
 {
-    glDeleteProgram(prog_);
+    if (prog_)
+        glDeleteProgram(prog_);
+    else if (build_.prog)
+        glDeleteProgram(build_.prog);
 }
 
 /// Uniforms and attributes for the "plain" shader.
@@ -71,7 +117,7 @@ struct plain {
     GLint u_color;
 };
 
-/// Uniforms and attributes for the "sprite" shader.
+/// Uniforms and attributes for the "sprite" and "spriteindex" shaders.
 struct sprite {
     static const field UNIFORMS[];
     static const field ATTRIBUTES[];
@@ -80,6 +126,8 @@ struct sprite {
     GLint u_vertxform;
     GLint u_texscale;
     GLint u_texture;
+    /// Palette for 8-bit index textures, -1 for true color shaders.
+    GLint u_palette;
 };
 
 /// Uniforms and attributes for the "text" shader.
@@ -0,0 +1,325 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include "soft.hpp"
+#include "image.hpp"
+#include <algorithm>
+#include <cmath>
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+namespace soft {
+
+// Quads are converted a span at a time through a buffer of this size.
+static const int SPAN = 256;
+
+/// Divide by 255, rounding, for 0 <= x <= 255 * 255.
+static inline unsigned div255(unsigned x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+/// Multiply a premultiplied color by a factor from 0 to 255.
+static inline unsigned scale_color(unsigned c, unsigned f)
+{
+    if (f == 255)
+        return c;
+    if (f == 0)
+        return 0;
+    return (div255((c >> 24) * f) << 24) |
+        (div255((c >> 16 & 255) * f) << 16) |
+        (div255((c >> 8 & 255) * f) << 8) |
+        div255((c & 255) * f);
+}
+
+/// Premultiply a straight alpha color.
+static inline unsigned premultiply(unsigned c)
+{
+    unsigned a = c >> 24;
+    if (a == 255)
+        return c;
+    return (scale_color(c, a) & 0xffffffu) | (a << 24);
+}
+
+image::image()
+    : width(0), height(0)
+{ }
+
+image::image(int width, int height)
+    : width(width), height(height), pixels(width * height, 0u)
+{ }
+
+image::image(int width, int height, const void *data, int pitch)
+    : width(width), height(height), pixels(width * height)
+{
+    for (int y = 0; y < height; y++) {
+        const unsigned *irow = reinterpret_cast<const unsigned *>(
+            static_cast<const char *>(data) + pitch * y);
+        unsigned *orow = row(y);
+        for (int x = 0; x < width; x++)
+            orow[x] = premultiply(irow[x]);
+    }
+}
+
+image image::load(const std::string &path)
+{
+    int width, height;
+    std::vector<unsigned> data =
+        ::image::load_pixels(path, &width, &height);
+    return image(width, height, data.data(), width * 4);
+}
+
+void clear(image &dest, unsigned color)
+{
+    std::fill(dest.pixels.begin(), dest.pixels.end(), color);
+}
+
+/// Blend one premultiplied pixel onto another.
+static inline unsigned blend_pixel(unsigned d, unsigned s)
+{
+    unsigned ia = 255 - (s >> 24);
+    if (ia == 0)
+        return s;
+    unsigned r = 0;
+    for (int i = 0; i < 32; i += 8) {
+        unsigned c = div255((d >> i & 255) * ia) + (s >> i & 255);
+        r |= (c > 255 ? 255 : c) << i;
+    }
+    return r;
+}
+
+void blend_span(unsigned *dest, const unsigned *src, int count)
+{
+    int i = 0;
+#if defined __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi32(0xff);
+    const __m128i round = _mm_set1_epi16(128);
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(src + i));
+        __m128i a = _mm_srli_epi32(s, 24);
+        int opaque = _mm_movemask_epi8(_mm_cmpeq_epi32(a, ones));
+        if (opaque == 0xffff) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dest + i), s);
+            continue;
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff)
+            continue;
+        __m128i d = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(dest + i));
+        // Broadcast 255 - alpha to every channel.
+        __m128i ia = _mm_sub_epi32(ones, a);
+        ia = _mm_or_si128(ia, _mm_slli_epi32(ia, 8));
+        ia = _mm_or_si128(ia, _mm_slli_epi32(ia, 16));
+        __m128i lo = _mm_mullo_epi16(
+            _mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(ia, zero));
+        __m128i hi = _mm_mullo_epi16(
+            _mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(ia, zero));
+        lo = _mm_add_epi16(lo, round);
+        hi = _mm_add_epi16(hi, round);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        __m128i r = _mm_adds_epu8(_mm_packus_epi16(lo, hi), s);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dest + i), r);
+    }
+#endif
+    for (; i < count; i++) {
+        unsigned s = src[i];
+        if (s)
+            dest[i] = blend_pixel(dest[i], s);
+    }
+}
+
+/// The destination rectangle of an axis-aligned quad, clipped.
+struct quad_rect {
+    int x0, y0, x1, y1;
+};
+
+/// Get the clipped destination rectangle of a quad given by three of
+/// its corners.  Returns false if it is empty.
+static bool get_rect(const image &dest, int px0, int py0,
+                     int px1, int py1, int px2, int py2,
+                     quad_rect &r)
+{
+    int px3 = px1 + px2 - px0, py3 = py1 + py2 - py0;
+    r.x0 = std::max(std::min(std::min(px0, px1), std::min(px2, px3)), 0);
+    r.y0 = std::max(std::min(std::min(py0, py1), std::min(py2, py3)), 0);
+    r.x1 = std::min(std::max(std::max(px0, px1), std::max(px2, px3)),
+                    dest.width);
+    r.y1 = std::min(std::max(std::max(py0, py1), std::max(py2, py3)),
+                    dest.height);
+    return r.x0 < r.x1 && r.y0 < r.y1;
+}
+
+void draw(image &dest, const quads &q)
+{
+    unsigned span[SPAN];
+    const image &tex = *q.tex;
+    if (tex.width <= 0 || tex.height <= 0)
+        return;
+    for (int i = 0; i + 6 <= q.count; i += 6) {
+        const short *v0 = q.vert[i], *v1 = q.vert[i + 1], *v2 = q.vert[i + 2];
+        int px0 = v0[0] + q.dx, py0 = v0[1] + q.dy;
+        int ax = v1[0] - v0[0], ay = v1[1] - v0[1];
+        int bx = v2[0] - v0[0], by = v2[1] - v0[1];
+        int det = ax * by - bx * ay;
+        quad_rect r;
+        if (!det || !get_rect(dest, px0, py0, px0 + ax, py0 + ay,
+                              px0 + bx, py0 + by, r))
+            continue;
+
+        // Affine map from destination pixels to texels, 16.16 fixed.
+        double inv = 1.0 / det;
+        double du1 = (v1[2] - v0[2]) * q.uscale;
+        double du2 = (v2[2] - v0[2]) * q.uscale;
+        double dv1 = (v1[3] - v0[3]) * q.vscale;
+        double dv2 = (v2[3] - v0[3]) * q.vscale;
+        double dudx = (du1 * by - du2 * ay) * inv;
+        double dudy = (du2 * ax - du1 * bx) * inv;
+        double dvdx = (dv1 * by - dv2 * ay) * inv;
+        double dvdy = (dv2 * ax - dv1 * bx) * inv;
+        double ex = r.x0 + 0.5 - px0, ey = r.y0 + 0.5 - py0;
+        double u = v0[2] * q.uscale + dudx * ex + dudy * ey;
+        double v = v0[3] * q.vscale + dvdx * ex + dvdy * ey;
+        int fu = (int)std::floor(u * 65536.0);
+        int fv = (int)std::floor(v * 65536.0);
+        int fdudx = (int)std::floor(dudx * 65536.0 + 0.5);
+        int fdudy = (int)std::floor(dudy * 65536.0 + 0.5);
+        int fdvdx = (int)std::floor(dvdx * 65536.0 + 0.5);
+        int fdvdy = (int)std::floor(dvdy * 65536.0 + 0.5);
+
+        // Unscaled and unflipped rows blend straight from the texture.
+        bool direct = q.mode == source::PREMULTIPLIED &&
+            fdudx == 0x10000 && fdvdx == 0;
+        for (int y = r.y0; y < r.y1; y++) {
+            unsigned *drow = dest.row(y);
+            int uu = fu, vv = fv;
+            if (direct) {
+                int tu = uu >> 16, tv = vv >> 16;
+                if (tu >= 0 && tu + (r.x1 - r.x0) <= tex.width &&
+                    tv >= 0 && tv < tex.height) {
+                    blend_span(drow + r.x0, tex.row(tv) + tu, r.x1 - r.x0);
+                    fu += fdudy;
+                    fv += fdvdy;
+                    continue;
+                }
+            }
+            for (int x = r.x0; x < r.x1; x += SPAN) {
+                int n = std::min(SPAN, r.x1 - x);
+                for (int k = 0; k < n; k++) {
+                    int tu = std::min(std::max(uu >> 16, 0), tex.width - 1);
+                    int tv = std::min(std::max(vv >> 16, 0), tex.height - 1);
+                    unsigned c = tex.pixels[tv * tex.width + tu];
+                    if (q.mode == source::COVERAGE)
+                        c = scale_color(q.color, c >> 16 & 255);
+                    span[k] = c;
+                    uu += fdudx;
+                    vv += fdvdx;
+                }
+                blend_span(drow + x, span, n);
+            }
+            fu += fdudy;
+            fv += fdvdy;
+        }
+    }
+}
+
+void fill(image &dest, const short (*vert)[2], int count,
+          int dx, int dy, unsigned color)
+{
+    unsigned span[SPAN];
+    std::fill(span, span + SPAN, color);
+    for (int i = 0; i + 6 <= count; i += 6) {
+        const short *v0 = vert[i], *v1 = vert[i + 1], *v2 = vert[i + 2];
+        quad_rect r;
+        if (!get_rect(dest, v0[0] + dx, v0[1] + dy, v1[0] + dx, v1[1] + dy,
+                      v2[0] + dx, v2[1] + dy, r))
+            continue;
+        for (int y = r.y0; y < r.y1; y++) {
+            for (int x = r.x0; x < r.x1; x += SPAN)
+                blend_span(dest.row(y) + x, span, std::min(SPAN, r.x1 - x));
+        }
+    }
+}
+
+/// Get a channel of a pixel as a float.
+static inline float channel(unsigned c, int shift)
+{
+    return (float)(c >> shift & 255) * (1.0f / 255.0f);
+}
+
+/// Get the texel of a repeating texture at a coordinate in texels.
+static inline int wrap(float x, int size)
+{
+    int i = (int)std::floor(x) % size;
+    return i < 0 ? i + size : i;
+}
+
+void tv(image &dest, const image &picture, int scale,
+        const tv_params &params)
+{
+    const image &pattern = *params.pattern;
+    const image &banding = *params.banding;
+    const image &noise = *params.noise;
+    const float *off = params.noiseoffset, *col = params.color;
+    float cx = 0.5f * picture.width, cy = 0.5f * picture.height;
+    float vscale = 1.0f / (cx * cx + cy * cy);
+    float inv = 1.0f / scale;
+    if (dest.width != picture.width * scale ||
+        dest.height != picture.height * scale)
+        dest = image(picture.width * scale, picture.height * scale);
+
+    // Texel columns and vignette terms only depend on x.
+    std::vector<int> patx(dest.width), noisex(dest.width);
+    std::vector<float> distx(dest.width);
+    for (int x = 0; x < dest.width; x++) {
+        float vx = (x + 0.5f) * inv;
+        patx[x] = wrap(vx * 0.25f * pattern.width, pattern.width);
+        noisex[x] = wrap((vx + off[0]) * (1.0f / 64.0f) * noise.width,
+                         noise.width);
+        distx[x] = (vx - cx) * (vx - cx) * vscale;
+    }
+
+    for (int y = 0; y < dest.height; y++) {
+        float vy = (y + 0.5f) * inv;
+        unsigned b = banding.pixels[
+            wrap((vy + off[2]) * (1.0f / 128.0f) * banding.width,
+                 banding.width)];
+        const unsigned *prow = pattern.row(
+            wrap(vy * 0.25f * pattern.height, pattern.height));
+        const unsigned *nrow = noise.row(
+            wrap((vy + off[1]) * (1.0f / 64.0f) * noise.height,
+                 noise.height));
+        const unsigned *irow = picture.row(y / scale);
+        unsigned *drow = dest.row(y);
+        float disty = (vy - cy) * (vy - cy) * vscale;
+        // Channels stay in 0-255, so the banding factor also divides out
+        // the scale of the pattern.
+        float band[3];
+        for (int i = 0; i < 3; i++)
+            band[i] = (0.5f + 0.5f * channel(b, 16 - 8 * i)) *
+                (1.0f / 255.0f);
+        for (int x = 0; x < dest.width; x++) {
+            unsigned p = irow[x / scale];
+            unsigned pt = prow[patx[x]];
+            unsigned n = nrow[noisex[x]];
+            float d = distx[x] + disty;
+            d = d * d;
+            float fade = 1.0f - col[3] * d;
+            unsigned r = 0xff000000u;
+            for (int i = 0; i < 3; i++) {
+                int shift = 16 - 8 * i;
+                float c = ((p >> shift & 255) * fade + col[i] * d * 255.0f) *
+                    (pt >> shift & 255) * band[i] +
+                    (n >> shift & 255) * 0.0625f + 0.5f;
+                c = c < 0.0f ? 0.0f : c > 255.0f ? 255.0f : c;
+                r |= (unsigned)c << shift;
+            }
+            drow[x] = r;
+        }
+    }
+}
+
+}
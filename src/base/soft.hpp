@@ -0,0 +1,81 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_SOFT_HPP
+#define LD_SOFT_HPP
+#include <string>
+#include <vector>
+namespace soft {
+
+/// An image with premultiplied ARGB pixels.  Row 0 is the first row of
+/// texture data, or the bottom row of a render target, as in OpenGL.
+struct image {
+    int width;
+    int height;
+    std::vector<unsigned> pixels;
+
+    image();
+    image(int width, int height);
+    /// Copy straight alpha ARGB pixels, premultiplying the alpha.
+    image(int width, int height, const void *data, int pitch);
+
+    unsigned *row(int y) { return pixels.data() + y * width; }
+    const unsigned *row(int y) const { return pixels.data() + y * width; }
+
+    /// Load an image file, premultiplying the alpha.
+    static image load(const std::string &path);
+};
+
+/// How quad source pixels are converted before blending.  All modes
+/// blend the result with premultiplied alpha.
+enum class source {
+    /// The texture has premultiplied alpha.
+    PREMULTIPLIED,
+    /// The texture's red channel scales a premultiplied color.
+    COVERAGE
+};
+
+/// A draw call for textured quads from GL_TRIANGLES vertex data with
+/// six (x, y, u, v) vertexes per axis-aligned quad.
+struct quads {
+    const short (*vert)[4];
+    int count;
+    /// Offset added to the vertex positions.
+    int dx, dy;
+    /// The texture, and the scale from texture coordinates to texels.
+    const image *tex;
+    int uscale, vscale;
+    source mode;
+    /// Premultiplied ARGB color, for COVERAGE.
+    unsigned color;
+};
+
+/// Fill an image with a color.
+void clear(image &dest, unsigned color);
+
+/// Draw textured quads, sampling the nearest texel at pixel centers.
+void draw(image &dest, const quads &q);
+
+/// Fill quads from GL_TRIANGLES vertex data with six (x, y) vertexes
+/// per axis-aligned quad, blending a premultiplied color.
+void fill(image &dest, const short (*vert)[2], int count,
+          int dx, int dy, unsigned color);
+
+/// Blend a span of premultiplied pixels onto another.
+void blend_span(unsigned *dest, const unsigned *src, int count);
+
+/// Textures and parameters for the TV effect.
+struct tv_params {
+    const image *pattern;
+    const image *banding;
+    const image *noise;
+    float noiseoffset[4];
+    float color[4];
+};
+
+/// Scale a picture up by an integer factor with the TV effect.
+void tv(image &dest, const image &picture, int scale,
+        const tv_params &params);
+
+}
+#endif
@@ -5,6 +5,7 @@
 #define LD_SPRITE_HPP
 #include "array.hpp"
 #include "opengl.hpp"
+#include "soft.hpp"
 #include <array>
 #include <cstdlib>
 #include <vector>
@@ -23,6 +24,27 @@ orientation operator*(orientation x, orientation y);
 /// A 2D integer rectangle.
 struct rect {
     short x, y, w, h, cx, cy;
+    /// The sprite sheet page containing the rectangle.
+    short page;
+    /// Whether the pixels are stored transposed in the sheet.
+    bool rotated;
+};
+
+/// The six vertexes of a sprite at the origin, with texture
+/// coordinates, in the format used by array.
+struct quad {
+    short vert[6][4];
+    int page;
+};
+
+/// Get the quad for a sprite with the given orientation.
+quad make_quad(const rect &tex, orientation orient);
+
+/// A sprite to draw as part of a batch.
+struct instance {
+    int index;
+    short x, y;
+    orientation orient;
 };
 
 /// A sprite to add to a sprite sheet.
@@ -35,36 +57,83 @@ struct sprite {
 class sheet {
 private:
     std::vector<rect> sprites_;
-    GLuint texture_;
+    /// Quads for each sprite, in each orientation.
+    std::vector<quad> quads_;
+    std::vector<GLuint> textures_;
+    std::vector<soft::image> images_;
+    std::vector<unsigned> colors_;
+    GLuint palette_;
     int width_, height_;
     float texscale_[2];
 
+    void make_quads();
+
 public:
     sheet();
-    sheet(const std::string &dirname, const sprite *sprites);
+    /// Load a sprite sheet.  If the atlas is nonempty, the prebuilt atlas
+    /// with that name is used unless it is missing or out of date.  If
+    /// upload is false, the pages are kept in memory for software
+    /// rendering instead of being uploaded as textures.
+    sheet(const std::string &dirname, const sprite *sprites,
+          const std::string &atlas = std::string(), bool upload = true);
+    /// Create a sheet with the given rectangles but no pages.
+    explicit sheet(std::vector<rect> rects);
     sheet(const sheet &other) = delete;
     sheet(sheet &&other);
     ~sheet();
     sheet &operator=(const sheet &other) = delete;
     sheet &operator=(sheet &&other);
 
-    /// Get the texture object containing the sprites.
-    GLuint texture() const { return texture_; }
-    /// Get the width of the texture.
+    /// Get the texture object containing the sprites on a page.
+    GLuint texture(int page = 0) const { return textures_.at(page); }
+    /// Get the premultiplied pixels of a page, if not uploaded.
+    const soft::image &pixels(int page) const
+    { return images_.at(page); }
+    /// Get the number of pages (textures) in the sheet.
+    int pages() const
+    { return textures_.empty() ? images_.size() : textures_.size(); }
+    /// Get the palette texture, or 0 if the pages are true color.
+    GLuint palette() const { return palette_; }
+    /// Get the palette index of a premultiplied ARGB color, or -1.
+    int find_color(unsigned color) const;
+    /// Change a palette color, for palette effects.
+    void set_color(int index, unsigned color);
+    /// Get the width of each page.
     int width() const { return width_; }
-    /// Get the height of the texture.
+    /// Get the height of each page.
     int height() const { return height_; }
     /// Get the factor to convert pixel coordinates to texture coordinates.
     const float *texscale() const { return texscale_; }
     /// Get the rectangle containing the given sprite.
     rect get(int index) const { return sprites_.at(index); }
+    /// Get the quad for a sprite with the given orientation.
+    const quad &get(int index, orientation orient) const
+    { return quads_.at(index * 8 + static_cast<int>(orient)); }
+
+    /// Pack the sprites and write them out as a prebuilt atlas.
+    static void build_atlas(const std::string &dirname,
+                            const sprite *sprites,
+                            const std::string &atlas);
 };
 
 // Array of sprite rectangles with texture coordinates.
-// Draw with GL_TRIANGLES.
+// Draw with GL_TRIANGLES, one run at a time.
 class array {
+public:
+    /// A run of consecutive vertexes using the same sheet page.
+    struct run {
+        int page;
+        int first;
+        int count;
+    };
+
 private:
     ::array::array<short[4]> array_;
+    std::vector<run> runs_;
+    std::vector<run> uploaded_runs_;
+
+    /// Insert the vertexes for a sprite on the given page.
+    short (*insert(int page))[4];
 
 public:
     array();
@@ -80,14 +149,21 @@ public:
     void add(rect tex, int x, int y);
     /// Add a sprite (tex) at the given lower-left coordinate.
     void add(rect tex, int x, int y, orientation orient);
-    /// Upload the array data.
-    void upload(GLuint usage);
+    /// Add a batch of sprites from a sheet, at their centers.
+    void add(const sheet &sh, const instance *sprites, std::size_t count);
+    /// Upload the array data.  Returns true if it changed since the last
+    /// upload.
+    bool upload(GLuint usage);
     /// Bind the OpenGL attribute.
     void set_attrib(GLint attrib);
     /// Get the number of vertexes.
     int size() const { return array_.size(); }
     /// Determine whether the array is empty.
     bool empty() const { return array_.empty(); }
+    /// Get the vertex data.
+    const short (*data() const)[4] { return array_.data(); }
+    /// Get the runs of vertexes, in drawing order.
+    const std::vector<run> &runs() const { return runs_; }
 };
 
 }
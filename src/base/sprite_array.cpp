@@ -2,14 +2,51 @@
    This file is part of Oubliette.  Oubliette is licensed under the terms
    of the 2-clause BSD license.  For more information, see LICENSE.txt. */
 #include "sprite.hpp"
+#if defined __SSE2__
+#include <emmintrin.h>
+#elif defined __ARM_NEON
+#include <arm_neon.h>
+#endif
 namespace sprite {
 
+namespace {
+
+/// Offsets from a sprite's center to its edges.
+enum { RX0, RX1, RY0, RY1 };
+
+/// For each orientation, which offsets give the x and y coordinates of
+/// the lower left, lower right, upper left, and upper right corners.
+constexpr unsigned char CORNERS[8][2][4] = {
+    // NORMAL
+    {{ RX0, RX1, RX0, RX1 }, { RY0, RY0, RY1, RY1 }},
+    // ROTATE_90
+    {{ RY1, RY1, RY0, RY0 }, { RX0, RX1, RX0, RX1 }},
+    // ROTATE_180
+    {{ RX1, RX0, RX1, RX0 }, { RY1, RY1, RY0, RY0 }},
+    // ROTATE_270
+    {{ RY0, RY0, RY1, RY1 }, { RX1, RX0, RX1, RX0 }},
+    // FLIP_VERTICAL
+    {{ RX0, RX1, RX0, RX1 }, { RY1, RY1, RY0, RY0 }},
+    // TRANSPOSE_2
+    {{ RY1, RY1, RY0, RY0 }, { RX1, RX0, RX1, RX0 }},
+    // FLIP_HORIZONTAL
+    {{ RX1, RX0, RX1, RX0 }, { RY0, RY0, RY1, RY1 }},
+    // TRANSPOSE
+    {{ RY0, RY0, RY1, RY1 }, { RX0, RX1, RX0, RX1 }}
+};
+
+/// Which corner each of the six vertexes uses.
+constexpr unsigned char VERTEX_CORNER[6] = { 0, 1, 2, 2, 1, 3 };
+
+}
+
 array::array()
 {
 }
 
 array::array(array &&other)
-    : array_(std::move(other.array_))
+    : array_(std::move(other.array_)), runs_(std::move(other.runs_)),
+      uploaded_runs_(std::move(other.uploaded_runs_))
 {
 }
 
@@ -20,38 +57,66 @@ array::~array()
 void array::clear()
 {
     array_.clear();
+    runs_.clear();
+}
+
+short (*array::insert(int page))[4]
+{
+    if (runs_.empty() || runs_.back().page != page) {
+        run r = { page, array_.size(), 0 };
+        runs_.push_back(r);
+    }
+    runs_.back().count += 6;
+    return array_.insert(6);
+}
+
+/// Set the texture coordinates for a sprite's six vertexes.
+static void set_texcoords(short (*data)[4], const rect &tex)
+{
+    // Texture coordinates of the lower left, lower right, upper left,
+    // and upper right corners.  Transposed sprites are stored with
+    // their rows as columns.
+    short u[4], v[4];
+    if (!tex.rotated) {
+        u[0] = u[2] = tex.x;
+        u[1] = u[3] = tex.x + tex.w;
+        v[0] = v[1] = tex.y + tex.h;
+        v[2] = v[3] = tex.y;
+    } else {
+        u[0] = u[1] = tex.x + tex.h;
+        u[2] = u[3] = tex.x;
+        v[0] = v[2] = tex.y;
+        v[1] = v[3] = tex.y + tex.w;
+    }
+
+    data[0][2] = u[0]; data[0][3] = v[0];
+    data[1][2] = u[1]; data[1][3] = v[1];
+    data[2][2] = u[2]; data[2][3] = v[2];
+    data[3][2] = u[2]; data[3][3] = v[2];
+    data[4][2] = u[1]; data[4][3] = v[1];
+    data[5][2] = u[3]; data[5][3] = v[3];
 }
 
 void array::add(rect tex, int x, int y)
 {
-    short (*data)[4] = array_.insert(6);
+    short (*data)[4] = insert(tex.page);
 
-    short tx0 = tex.x, tx1 = tex.x + tex.w;
-    short ty1 = tex.y, ty0 = tex.y + tex.h;
     short vx0 = x, vx1 = x + tex.w;
     short vy0 = y, vy1 = y + tex.h;
 
-    data[0][0] = vx0; data[0][1] = vy0; data[0][2] = tx0; data[0][3] = ty0;
-    data[1][0] = vx1; data[1][1] = vy0; data[1][2] = tx1; data[1][3] = ty0;
-    data[2][0] = vx0; data[2][1] = vy1; data[2][2] = tx0; data[2][3] = ty1;
-    data[3][0] = vx0; data[3][1] = vy1; data[3][2] = tx0; data[3][3] = ty1;
-    data[4][0] = vx1; data[4][1] = vy0; data[4][2] = tx1; data[4][3] = ty0;
-    data[5][0] = vx1; data[5][1] = vy1; data[5][2] = tx1; data[5][3] = ty1;
+    data[0][0] = vx0; data[0][1] = vy0;
+    data[1][0] = vx1; data[1][1] = vy0;
+    data[2][0] = vx0; data[2][1] = vy1;
+    data[3][0] = vx0; data[3][1] = vy1;
+    data[4][0] = vx1; data[4][1] = vy0;
+    data[5][0] = vx1; data[5][1] = vy1;
+    set_texcoords(data, tex);
 }
 
 void array::add(rect tex, int x, int y, orientation orient)
 {
-    short (*data)[4] = array_.insert(6);
-
-    short tx0 = tex.x, tx1 = tex.x + tex.w;
-    short ty1 = tex.y, ty0 = tex.y + tex.h;
-
-    data[0][2] = tx0; data[0][3] = ty0;
-    data[1][2] = tx1; data[1][3] = ty0;
-    data[2][2] = tx0; data[2][3] = ty1;
-    data[3][2] = tx0; data[3][3] = ty1;
-    data[4][2] = tx1; data[4][3] = ty0;
-    data[5][2] = tx1; data[5][3] = ty1;
+    short (*data)[4] = insert(tex.page);
+    set_texcoords(data, tex);
 
     short rx0 = -tex.cx, rx1 = tex.w - tex.cx;
     short ry0 = -tex.cy, ry1 = tex.h - tex.cy;
@@ -128,9 +193,72 @@ void array::add(rect tex, int x, int y, orientation orient)
     data[5][0] = vx[3]; data[5][1] = vy[3];
 }
 
-void array::upload(GLuint usage)
+quad make_quad(const rect &tex, orientation orient)
+{
+    quad q;
+    q.page = tex.page;
+    set_texcoords(q.vert, tex);
+    const short offset[4] = {
+        static_cast<short>(-tex.cx),
+        static_cast<short>(tex.w - tex.cx),
+        static_cast<short>(-tex.cy),
+        static_cast<short>(tex.h - tex.cy)
+    };
+    const auto &c = CORNERS[static_cast<int>(orient)];
+    for (int i = 0; i < 6; i++) {
+        q.vert[i][0] = offset[c[0][VERTEX_CORNER[i]]];
+        q.vert[i][1] = offset[c[1][VERTEX_CORNER[i]]];
+    }
+    return q;
+}
+
+void array::add(const sheet &sh, const instance *sprites, std::size_t count)
 {
-    array_.upload(usage);
+    array_.reserve(array_.size() + count * 6);
+    for (std::size_t i = 0; i < count; i++) {
+        const instance &s = sprites[i];
+        const quad &q = sh.get(s.index, s.orient);
+        short (*data)[4] = insert(q.page);
+        // Each quad is 48 bytes: three vectors of two vertexes.
+#if defined __SSE2__
+        __m128i off = _mm_set_epi16(0, 0, s.y, s.x, 0, 0, s.y, s.x);
+        const __m128i *src = reinterpret_cast<const __m128i *>(q.vert);
+        __m128i *dest = reinterpret_cast<__m128i *>(data);
+        for (int j = 0; j < 3; j++)
+            _mm_storeu_si128(
+                dest + j, _mm_add_epi16(_mm_loadu_si128(src + j), off));
+#elif defined __ARM_NEON
+        const short offv[8] = { s.x, s.y, 0, 0, s.x, s.y, 0, 0 };
+        int16x8_t off = vld1q_s16(offv);
+        for (int j = 0; j < 3; j++)
+            vst1q_s16(&data[j*2][0],
+                      vaddq_s16(vld1q_s16(&q.vert[j*2][0]), off));
+#else
+        for (int j = 0; j < 6; j++) {
+            data[j][0] = q.vert[j][0] + s.x;
+            data[j][1] = q.vert[j][1] + s.y;
+            data[j][2] = q.vert[j][2];
+            data[j][3] = q.vert[j][3];
+        }
+#endif
+    }
+}
+
+bool array::upload(GLuint usage)
+{
+    bool changed = array_.upload(usage);
+    if (!changed && uploaded_runs_.size() == runs_.size()) {
+        for (std::size_t i = 0; i < runs_.size(); i++) {
+            if (runs_[i].page != uploaded_runs_[i].page ||
+                runs_[i].count != uploaded_runs_[i].count)
+                changed = true;
+        }
+    } else {
+        changed = true;
+    }
+    if (changed)
+        uploaded_runs_ = runs_;
+    return changed;
 }
 
 void array::set_attrib(GLint attrib)
@@ -2,9 +2,13 @@
    This file is part of Oubliette.  Oubliette is licensed under the terms
    of the 2-clause BSD license.  For more information, see LICENSE.txt. */
 #include "defs.hpp"
+#include "file.hpp"
+#include "image.hpp"
+#include "loader.hpp"
 #include "sprite.hpp"
 #include "opengl.hpp"
 #include "pack.hpp"
+#include "startup.hpp"
 #include "surface.hpp"
 #include <unordered_map>
 #include <cstdio>
@@ -14,17 +18,170 @@
 
 namespace sprite {
 
-sheet::sheet()
-    : sprites_(), texture_(0), width_(0), height_(0)
+namespace {
+
+/// Sprite sheet pixels and rectangles, before they are uploaded.
+struct sheet_image {
+    std::vector<rect> rects;
+    std::vector<sdl::surface> pages;
+};
+
+/// Atlas table file magic, "SPAT".
+const unsigned ATLAS_MAGIC = 0x54415053u;
+/// Atlas table file version.
+const unsigned ATLAS_VERSION = 2;
+/// Size of the atlas table header.
+const std::size_t ATLAS_HEADER = 24;
+/// Size of each atlas table entry.
+const std::size_t ATLAS_ENTRY = 16;
+/// Largest sprite sheet page size.
+const int PAGE_SIZE = 1024;
+/// Largest number of sprite sheet pages.
+const int MAX_PAGES = 16;
+
+}
+
+/// Load an image and convert it to ARGB8888.  If the image is not
+/// required, returns an empty surface on failure instead of exiting.
+static sdl::surface load_image(const std::string &path, bool required)
 {
-    texscale_[0] = texscale_[1] = 0.0f;
+    sdl::surface image;
+    data file;
+    if (data::read(&file, path))
+        image.surfptr = IMG_Load_RW(file.rwops(), 1);
+    if (!image.surfptr && !required) {
+        SDL_ClearError();
+        return image;
+    }
+    if (!image.surfptr) {
+        core::check_sdl_error(HERE);
+        std::fprintf(stderr, "Error: failed to load image: %s\n",
+                     path.c_str());
+        core::die("Failed to load image");
+    }
+    if (image->format->format == SDL_PIXELFORMAT_ARGB8888)
+        return image;
+
+    sdl::surface converted;
+    converted.surfptr = SDL_ConvertSurfaceFormat(
+        image.surfptr, SDL_PIXELFORMAT_ARGB8888, 0);
+    if (!converted.surfptr && !required) {
+        SDL_ClearError();
+        return converted;
+    }
+    if (!converted.surfptr) {
+        core::check_sdl_error(HERE);
+        std::fprintf(
+            stderr, "Error: failed to load image: %s\n",
+            path.c_str());
+        core::die("Failed to load image");
+    }
+    return converted;
 }
 
-sheet::sheet(const std::string &dirname, const sprite *sprites)
-    : sprites_(), texture_(0), width_(0), height_(0)
+/// Load images on the loader threads.  Images which are not required
+/// are empty if they fail to load.
+static std::vector<sdl::surface> load_images(
+    const std::vector<std::string> &paths, bool required)
 {
-    texscale_[0] = texscale_[1] = 0.0f;
+    std::vector<std::future<sdl::surface>> pending;
+    pending.reserve(paths.size());
+    for (const auto &path : paths)
+        pending.push_back(loader::submit([path, required]() {
+            return load_image(path, required);
+        }));
     std::vector<sdl::surface> images;
+    images.reserve(paths.size());
+    for (auto &f : pending)
+        images.push_back(f.get());
+    return images;
+}
+
+/// Create an empty ARGB8888 surface.
+static sdl::surface create_surface(int width, int height)
+{
+    sdl::surface surf;
+    surf.surfptr = SDL_CreateRGBSurface(
+        0, width, height, 32,
+        0x00ff0000u, 0x0000ff00u, 0x000000ffu, 0xff000000u);
+    if (!surf.surfptr)
+        core::die_sdl(HERE, "Failed to pack sprites");
+    return surf;
+}
+
+/// Copy an ARGB8888 image with its rows and columns swapped.
+static sdl::surface transpose_image(SDL_Surface *image)
+{
+    sdl::surface out = create_surface(image->h, image->w);
+    if (SDL_LockSurface(image) || SDL_LockSurface(out.surfptr))
+        core::die_sdl(HERE, "Failed to pack sprites");
+    const char *ip = static_cast<const char *>(image->pixels);
+    char *op = static_cast<char *>(out->pixels);
+    for (int y = 0; y < out->h; y++) {
+        unsigned *orow = reinterpret_cast<unsigned *>(op + out->pitch * y);
+        for (int x = 0; x < out->w; x++)
+            orow[x] = reinterpret_cast<const unsigned *>(
+                ip + image->pitch * x)[y];
+    }
+    SDL_UnlockSurface(out.surfptr);
+    SDL_UnlockSurface(image);
+    return out;
+}
+
+/// Get the path to an atlas page image.
+static std::string page_path(const std::string &atlas, int page)
+{
+    return atlas + '.' + std::to_string(page) + ".png";
+}
+
+/// Hash the sprite table, so stale atlases can be detected.
+static unsigned sprite_hash(const sprite *sprites)
+{
+    unsigned h = 2166136261u;
+    for (int i = 0; sprites[i].name; i++) {
+        for (const char *p = sprites[i].name; ; p++) {
+            h = (h ^ (unsigned char)*p) * 16777619u;
+            if (!*p)
+                break;
+        }
+        const short v[6] = {
+            sprites[i].x, sprites[i].y, sprites[i].w,
+            sprites[i].h, sprites[i].cx, sprites[i].cy
+        };
+        for (int j = 0; j < 6; j++) {
+            h = (h ^ (v[j] & 0xff)) * 16777619u;
+            h = (h ^ ((v[j] >> 8) & 0xff)) * 16777619u;
+        }
+    }
+    return h;
+}
+
+static unsigned read_u32(const unsigned char *p)
+{
+    return (unsigned)p[0] | ((unsigned)p[1] << 8) |
+        ((unsigned)p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static short read_i16(const unsigned char *p)
+{
+    return (short)((unsigned)p[0] | ((unsigned)p[1] << 8));
+}
+
+static void write_u32(unsigned char *p, unsigned x)
+{
+    p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+static void write_i16(unsigned char *p, short x)
+{
+    p[0] = (unsigned)x; p[1] = (unsigned)x >> 8;
+}
+
+/// Load each sprite image and pack them into a single surface.
+static void pack_sheet(sheet_image &out, const std::string &dirname,
+                       const sprite *sprites)
+{
+    std::vector<std::string> paths;
     std::vector<std::size_t> spriteimages;
     std::size_t count = 0;
 
@@ -38,38 +195,13 @@ sheet::sheet(const std::string &dirname, const sprite *sprites)
             std::string name(sprites[i].name);
             auto x = imagenames.insert(
                 std::unordered_map<std::string, std::size_t>::value_type(
-                    name, images.size()));
-            if (x.second) {
-                std::string path = dirpath;
-                path += name;
-                path += ".png";
-                sdl::surface image;
-                image.surfptr = IMG_Load(path.c_str());
-                if (!image.surfptr) {
-                    core::check_sdl_error(HERE);
-                    std::fprintf(stderr, "Error: failed to load image: %s\n",
-                                 path.c_str());
-                    core::die("Failed to load image");
-                }
-                if (image->format->format == SDL_PIXELFORMAT_ARGB8888) {
-                    images.push_back(std::move(image));
-                } else {
-                    sdl::surface converted;
-                    converted.surfptr = SDL_ConvertSurfaceFormat(
-                        image.surfptr, SDL_PIXELFORMAT_ARGB8888, 0);
-                    if (!converted.surfptr) {
-                        core::check_sdl_error(HERE);
-                        std::fprintf(
-                            stderr, "Error: failed to load image: %s\n",
-                            path.c_str());
-                        core::die("Failed to load image");
-                    }
-                    images.push_back(std::move(converted));
-                }
-            }
+                    name, paths.size()));
+            if (x.second)
+                paths.push_back(dirpath + name + ".png");
             spriteimages.push_back(x.first->second);
         }
     }
+    std::vector<sdl::surface> images = load_images(paths, true);
 
     std::vector<pack::size> imagesizes;
     imagesizes.reserve(images.size());
@@ -78,79 +210,349 @@ sheet::sheet(const std::string &dirname, const sprite *sprites)
         imagesizes.push_back(sz);
     }
 
-    pack::packing packing = pack::pack(imagesizes);
+    pack::options opts;
+    opts.max_size = PAGE_SIZE;
+    opts.max_pages = MAX_PAGES;
+    opts.allow_rotate = true;
+    pack::packing packing = pack::pack(imagesizes, opts);
+    if (packing.pages == 0)
+        core::die("Could not pack sprites.");
 
-    std::fprintf(stderr, "Packing %zu sprites into a %dx%d sheet\n",
-                 count, packing.packsize.width, packing.packsize.height);
+    std::fprintf(stderr, "Packing %zu sprites into %d %dx%d sheets\n",
+                 count, packing.pages,
+                 packing.packsize.width, packing.packsize.height);
 
-    sprites_.reserve(count);
+    out.rects.clear();
+    out.rects.reserve(count);
     for (std::size_t i = 0; i < count; i++) {
         auto loc = packing.locations[spriteimages[i]];
         rect rect;
-        rect.x = sprites[i].x + loc.x;
-        rect.y = sprites[i].y + loc.y;
+        if (loc.rotated) {
+            rect.x = sprites[i].y + loc.x;
+            rect.y = sprites[i].x + loc.y;
+        } else {
+            rect.x = sprites[i].x + loc.x;
+            rect.y = sprites[i].y + loc.y;
+        }
         rect.w = sprites[i].w;
         rect.h = sprites[i].h;
         rect.cx = sprites[i].cx;
         rect.cy = sprites[i].cy;
-        sprites_.push_back(rect);
+        rect.page = loc.page;
+        rect.rotated = loc.rotated;
+        out.rects.push_back(rect);
     }
 
-    width_ = packing.packsize.width;
-    height_ = packing.packsize.height;
-    texscale_[0] = 1.0 / width_;
-    texscale_[1] = 1.0 / height_;
-
-    sdl::surface surf;
-    surf.surfptr = SDL_CreateRGBSurface(
-        0, packing.packsize.width, packing.packsize.height, 32,
-        0x00ff0000u, 0x0000ff00u, 0x000000ffu, 0xff000000u);
-    if (!surf.surfptr) core::die_sdl(HERE, "Failed to pack sprites");
+    out.pages.clear();
+    for (int i = 0; i < packing.pages; i++)
+        out.pages.push_back(create_surface(
+            packing.packsize.width, packing.packsize.height));
 
     int r;
 
-    SDL_Surface *main = surf.surfptr;
     for (std::size_t i = 0; i < images.size(); i++) {
+        const pack::location &loc = packing.locations[i];
+        if (loc.rotated)
+            images[i] = transpose_image(images[i].surfptr);
         SDL_Surface *surf = images[i].surfptr;
         r = SDL_SetSurfaceBlendMode(surf, SDL_BLENDMODE_BLEND);
         if (r) core::die_sdl(HERE, "Failed to pack sprites");
 
         SDL_Rect rect;
-        rect.x = packing.locations[i].x;
-        rect.y = packing.locations[i].y;
+        rect.x = loc.x;
+        rect.y = loc.y;
         rect.w = surf->w;
         rect.h = surf->h;
 
-        r = SDL_BlitSurface(surf, nullptr, main, &rect);
+        r = SDL_BlitSurface(
+            surf, nullptr, out.pages[loc.page].surfptr, &rect);
         if (r) core::die_sdl(HERE, "Failed to pack sprites");
     }
+}
+
+/// Load a prebuilt atlas.  Returns false if it is missing or stale, or
+/// if a page cannot be loaded.
+static bool load_atlas(sheet_image &out, const std::string &atlas,
+                       const sprite *sprites)
+{
+    std::size_t count = 0;
+    while (sprites[count].name)
+        count++;
 
-    r = SDL_LockSurface(main);
-    if (r) core::die_sdl(HERE, "Failed to pack sprites");
-
-    glGenTextures(1, &texture_);
-    glBindTexture(GL_TEXTURE_2D, texture_);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexImage2D(
-        GL_TEXTURE_2D,
-        0,
-        GL_RGBA8,
-        packing.packsize.width,
-        packing.packsize.height,
-        0,
-        GL_BGRA,
-        GL_UNSIGNED_INT_8_8_8_8_REV,
-        main->pixels);
+    data table;
+    if (!data::read(&table, atlas + ".dat"))
+        return false;
+    const unsigned char *p =
+        static_cast<const unsigned char *>(table.ptr());
+    if (table.size() < ATLAS_HEADER ||
+        read_u32(p) != ATLAS_MAGIC ||
+        read_u32(p + 4) != ATLAS_VERSION ||
+        read_u32(p + 8) != sprite_hash(sprites) ||
+        read_u32(p + 12) != count ||
+        table.size() != ATLAS_HEADER + ATLAS_ENTRY * count) {
+        std::fprintf(stderr, "Sprite atlas is out of date: %s.dat\n",
+                     atlas.c_str());
+        return false;
+    }
+    int width = (unsigned short)read_i16(p + 16);
+    int height = (unsigned short)read_i16(p + 18);
+    int pages = read_u32(p + 20);
+    if (pages < 1 || pages > MAX_PAGES)
+        return false;
+
+    out.rects.clear();
+    out.rects.reserve(count);
+    for (std::size_t i = 0; i < count; i++) {
+        const unsigned char *e = p + ATLAS_HEADER + ATLAS_ENTRY * i;
+        rect rect;
+        rect.x = read_i16(e);
+        rect.y = read_i16(e + 2);
+        rect.w = read_i16(e + 4);
+        rect.h = read_i16(e + 6);
+        rect.cx = read_i16(e + 8);
+        rect.cy = read_i16(e + 10);
+        rect.page = read_i16(e + 12);
+        rect.rotated = (read_i16(e + 14) & 1) != 0;
+        if (rect.page < 0 || rect.page >= pages)
+            return false;
+        out.rects.push_back(rect);
+    }
+
+    std::vector<std::string> paths;
+    for (int i = 0; i < pages; i++)
+        paths.push_back(page_path(atlas, i));
+    out.pages = load_images(paths, false);
+    for (int i = 0; i < pages; i++) {
+        if (!out.pages[i].surfptr) {
+            std::fprintf(stderr, "Could not load sprite atlas page: %s\n",
+                         paths[i].c_str());
+            return false;
+        }
+        if (out.pages[i]->w != width || out.pages[i]->h != height) {
+            std::fprintf(stderr, "Sprite atlas has the wrong size: %s\n",
+                         paths[i].c_str());
+            return false;
+        }
+    }
+
+    std::fprintf(stderr, "Loaded %zu sprites from %d %dx%d atlas pages\n",
+                 count, pages, width, height);
+    return true;
+}
+
+/// Convert the sheet pages to 8-bit palette indexes.  Index 0 is
+/// transparent.  Returns false if there are more than 256 colors.
+static bool index_pages(const sheet_image &image,
+                        std::vector<unsigned> &colors,
+                        std::vector<std::vector<unsigned char>> &indexes)
+{
+    std::unordered_map<unsigned, int> colormap;
+    colors.assign(1, 0u);
+    indexes.clear();
+    for (const auto &page : image.pages) {
+        SDL_Surface *surf = page.surfptr;
+        if (SDL_LockSurface(surf))
+            core::die_sdl(HERE, "Failed to pack sprites");
+        indexes.emplace_back(surf->w * surf->h);
+        unsigned char *op = indexes.back().data();
+        const char *ip = static_cast<const char *>(surf->pixels);
+        bool ok = true;
+        for (int y = 0; ok && y < surf->h; y++) {
+            const unsigned *irow =
+                reinterpret_cast<const unsigned *>(ip + surf->pitch * y);
+            for (int x = 0; x < surf->w; x++) {
+                unsigned c = irow[x];
+                int index = 0;
+                if (c >> 24) {
+                    auto it = colormap.find(c);
+                    if (it != colormap.end()) {
+                        index = it->second;
+                    } else if (colors.size() < 256) {
+                        index = colors.size();
+                        colormap[c] = index;
+                        colors.push_back(c);
+                    } else {
+                        ok = false;
+                        break;
+                    }
+                }
+                op[y * surf->w + x] = index;
+            }
+        }
+        SDL_UnlockSurface(surf);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+sheet::sheet()
+    : sprites_(), textures_(), images_(), colors_(), palette_(0),
+      width_(0), height_(0)
+{
+    texscale_[0] = texscale_[1] = 0.0f;
+}
+
+sheet::sheet(std::vector<rect> rects)
+    : sprites_(std::move(rects)), textures_(), images_(), colors_(),
+      palette_(0), width_(0), height_(0)
+{
+    texscale_[0] = texscale_[1] = 0.0f;
+    make_quads();
+}
+
+sheet::sheet(const std::string &dirname, const sprite *sprites,
+             const std::string &atlas, bool upload)
+    : sprites_(), textures_(), images_(), colors_(), palette_(0),
+      width_(0), height_(0)
+{
+    startup::phase phase("sprite sheet");
+    texscale_[0] = texscale_[1] = 0.0f;
+
+    sheet_image image;
+    if (atlas.empty() || !load_atlas(image, atlas, sprites))
+        pack_sheet(image, dirname, sprites);
+
+    sprites_ = std::move(image.rects);
+    make_quads();
+    width_ = image.pages[0]->w;
+    height_ = image.pages[0]->h;
+    texscale_[0] = 1.0 / width_;
+    texscale_[1] = 1.0 / height_;
+
+    if (!upload) {
+        for (const auto &page : image.pages) {
+            SDL_Surface *surf = page.surfptr;
+            if (SDL_LockSurface(surf))
+                core::die_sdl(HERE, "Failed to pack sprites");
+            images_.emplace_back(surf->w, surf->h, surf->pixels, surf->pitch);
+            SDL_UnlockSurface(surf);
+        }
+        return;
+    }
+
+    std::vector<std::vector<unsigned char>> indexes;
+    if (index_pages(image, colors_, indexes)) {
+        for (const auto &page : indexes) {
+            textures_.push_back(image::create_index_texture(
+                width_, height_));
+            image::upload_indexes(
+                0, 0, width_, height_, width_, page.data());
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        palette_ = image::create_palette(colors_.data(), colors_.size());
+        std::fprintf(stderr, "Sprite sheet uses %zu colors\n",
+                     colors_.size());
+        return;
+    }
+
+    colors_.clear();
+    textures_.resize(image.pages.size());
+    glGenTextures(textures_.size(), textures_.data());
+    for (std::size_t i = 0; i < image.pages.size(); i++) {
+        SDL_Surface *main = image.pages[i].surfptr;
+        int r = SDL_LockSurface(main);
+        if (r) core::die_sdl(HERE, "Failed to pack sprites");
+
+        glBindTexture(GL_TEXTURE_2D, textures_[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(
+            GL_TEXTURE_2D,
+            0,
+            GL_RGBA8,
+            width_,
+            height_,
+            0,
+            GL_BGRA,
+            GL_UNSIGNED_INT_8_8_8_8_REV,
+            main->pixels);
+        SDL_UnlockSurface(main);
+    }
     glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+int sheet::find_color(unsigned color) const
+{
+    for (std::size_t i = 1; i < colors_.size(); i++) {
+        if (colors_[i] == color)
+            return i;
+    }
+    return -1;
+}
+
+void sheet::set_color(int index, unsigned color)
+{
+    if (!palette_ || index < 0 || (std::size_t)index >= colors_.size())
+        return;
+    image::set_palette_color(palette_, index, color);
+}
+
+void sheet::build_atlas(const std::string &dirname, const sprite *sprites,
+                        const std::string &atlas)
+{
+    sheet_image image;
+    pack_sheet(image, dirname, sprites);
+
+    for (std::size_t i = 0; i < image.pages.size(); i++) {
+        std::string path = page_path(atlas, i);
+        if (IMG_SavePNG(image.pages[i].surfptr, path.c_str()))
+            core::die_sdl(HERE, "Failed to write sprite atlas");
+    }
+
+    std::size_t count = image.rects.size();
+    std::vector<unsigned char> table(ATLAS_HEADER + ATLAS_ENTRY * count);
+    unsigned char *p = table.data();
+    write_u32(p, ATLAS_MAGIC);
+    write_u32(p + 4, ATLAS_VERSION);
+    write_u32(p + 8, sprite_hash(sprites));
+    write_u32(p + 12, count);
+    write_i16(p + 16, image.pages[0]->w);
+    write_i16(p + 18, image.pages[0]->h);
+    write_u32(p + 20, image.pages.size());
+    for (std::size_t i = 0; i < count; i++) {
+        unsigned char *e = p + ATLAS_HEADER + ATLAS_ENTRY * i;
+        const rect &rect = image.rects[i];
+        write_i16(e, rect.x);
+        write_i16(e + 2, rect.y);
+        write_i16(e + 4, rect.w);
+        write_i16(e + 6, rect.h);
+        write_i16(e + 8, rect.cx);
+        write_i16(e + 10, rect.cy);
+        write_i16(e + 12, rect.page);
+        write_i16(e + 14, rect.rotated ? 1 : 0);
+    }
+
+    std::string path = atlas + ".dat";
+    FILE *fp = std::fopen(path.c_str(), "wb");
+    if (!fp) {
+        std::fprintf(stderr, "Could not open file: %s\n", path.c_str());
+        core::die("Failed to write sprite atlas");
+    }
+    std::size_t amt = std::fwrite(table.data(), 1, table.size(), fp);
+    if (std::fclose(fp) || amt != table.size())
+        core::die("Failed to write sprite atlas");
+
+    std::fprintf(stderr, "Wrote %zu atlas pages and %s\n",
+                 image.pages.size(), path.c_str());
+}
+
 sheet::sheet(sheet &&other)
-    : sprites_(std::move(other.sprites_)), texture_(other.texture_),
+    : sprites_(std::move(other.sprites_)),
+      quads_(std::move(other.quads_)),
+      textures_(std::move(other.textures_)),
+      images_(std::move(other.images_)),
+      colors_(std::move(other.colors_)), palette_(other.palette_),
       width_(other.width_), height_(other.height_)
 {
+    texscale_[0] = other.texscale_[0];
+    texscale_[1] = other.texscale_[1];
     other.sprites_.clear();
-    other.texture_ = 0;
+    other.quads_.clear();
+    other.textures_.clear();
+    other.images_.clear();
+    other.colors_.clear();
+    other.palette_ = 0;
     other.width_ = 0;
     other.height_ = 0;
     other.texscale_[0] = 0.0f;
@@ -161,17 +563,27 @@ sheet &sheet::operator=(sheet &&other)
 {
     if (this == &other)
         return *this;
-    if (texture_ != 0)
-        glDeleteTextures(1, &texture_);
+    if (!textures_.empty())
+        glDeleteTextures(textures_.size(), textures_.data());
+    if (palette_)
+        glDeleteTextures(1, &palette_);
 
     sprites_ = std::move(other.sprites_);
-    texture_ = other.texture_;
+    quads_ = std::move(other.quads_);
+    textures_ = std::move(other.textures_);
+    images_ = std::move(other.images_);
+    colors_ = std::move(other.colors_);
+    palette_ = other.palette_;
     width_ = other.width_;
     height_ = other.height_;
     texscale_[0] = other.texscale_[0];
     texscale_[1] = other.texscale_[1];
     other.sprites_.clear();
-    other.texture_ = 0;
+    other.quads_.clear();
+    other.textures_.clear();
+    other.images_.clear();
+    other.colors_.clear();
+    other.palette_ = 0;
     other.width_ = 0;
     other.height_ = 0;
     other.texscale_[0] = 0.0f;
@@ -180,10 +592,22 @@ sheet &sheet::operator=(sheet &&other)
     return *this;
 }
 
+void sheet::make_quads()
+{
+    quads_.clear();
+    quads_.reserve(sprites_.size() * 8);
+    for (const rect &r : sprites_) {
+        for (int i = 0; i < 8; i++)
+            quads_.push_back(make_quad(r, static_cast<orientation>(i)));
+    }
+}
+
 sheet::~sheet()
 {
-    if (texture_ != 0)
-        glDeleteTextures(1, &texture_);
+    if (!textures_.empty())
+        glDeleteTextures(textures_.size(), textures_.data());
+    if (palette_)
+        glDeleteTextures(1, &palette_);
 }
 
 }
@@ -0,0 +1,153 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include "startup.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+namespace startup {
+
+static std::vector<record> phases;
+static int depth;
+
+/// Get the time on a monotonic clock, in milliseconds.
+static double now_ms()
+{
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+phase::phase(const char *name)
+    : index_(phases.size()), start_(now_ms())
+{
+    record r;
+    r.name = name;
+    r.depth = depth++;
+    r.ms = 0.0;
+    phases.push_back(r);
+}
+
+phase::~phase()
+{
+    stop();
+}
+
+void phase::stop()
+{
+    if (index_ < 0)
+        return;
+    if ((std::size_t)index_ < phases.size())
+        phases[index_].ms = now_ms() - start_;
+    index_ = -1;
+    depth--;
+}
+
+const std::vector<record> &records()
+{
+    return phases;
+}
+
+void clear()
+{
+    phases.clear();
+}
+
+void report()
+{
+    std::fputs("Startup (ms):\n", stderr);
+    for (const auto &r : phases)
+        std::fprintf(stderr, "%8.1f  %*s%s\n",
+                     r.ms, r.depth * 2, "", r.name);
+}
+
+/// Prefix for lines written by write_records().
+static const char RECORD_PREFIX[] = "startup:";
+
+void write_records(std::FILE *fp)
+{
+    for (const auto &r : phases)
+        std::fprintf(fp, "%s %d %.3f %s\n",
+                     RECORD_PREFIX, r.depth, r.ms, r.name);
+    std::fflush(fp);
+}
+
+std::vector<record> read_records(std::FILE *fp)
+{
+    static std::set<std::string> names;
+    std::vector<record> result;
+    char line[256];
+    std::size_t plen = std::strlen(RECORD_PREFIX);
+    while (std::fgets(line, sizeof(line), fp)) {
+        if (std::strncmp(line, RECORD_PREFIX, plen))
+            continue;
+        record r;
+        int pos;
+        if (std::sscanf(line + plen, " %d %lf %n",
+                        &r.depth, &r.ms, &pos) < 2)
+            continue;
+        std::string name(line + plen + pos);
+        while (!name.empty() &&
+               (name.back() == '\n' || name.back() == '\r'))
+            name.pop_back();
+        r.name = names.insert(name).first->c_str();
+        result.push_back(r);
+    }
+    return result;
+}
+
+/// Get a percentile of sorted samples, using the nearest rank.
+static double percentile(const std::vector<double> &sorted, int pct)
+{
+    std::size_t n = sorted.size();
+    std::size_t rank = (n * pct + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void report(const std::vector<std::vector<record>> &runs)
+{
+    // Phases are matched between runs by their names and the names of
+    // the phases they are nested inside.
+    struct row {
+        const char *name;
+        int depth;
+        std::vector<double> ms;
+    };
+    std::vector<row> rows;
+    std::map<std::string, std::size_t> index;
+    for (const auto &run : runs) {
+        std::vector<std::string> path;
+        for (const auto &r : run) {
+            path.resize(r.depth);
+            std::string key;
+            for (const auto &p : path) {
+                key += p;
+                key += '/';
+            }
+            key += r.name;
+            path.push_back(r.name);
+            auto it = index.find(key);
+            if (it == index.end()) {
+                it = index.insert(std::make_pair(key, rows.size())).first;
+                rows.push_back(row{ r.name, r.depth, {} });
+            }
+            rows[it->second].ms.push_back(r.ms);
+        }
+    }
+
+    std::fprintf(stderr, "Startup, %zu runs (ms):\n", runs.size());
+    std::fprintf(stderr, "%8s %8s %8s %8s %5s\n",
+                 "min", "p50", "p90", "max", "runs");
+    for (auto &rw : rows) {
+        std::sort(rw.ms.begin(), rw.ms.end());
+        std::fprintf(stderr, "%8.1f %8.1f %8.1f %8.1f %5zu  %*s%s\n",
+                     rw.ms.front(), percentile(rw.ms, 50),
+                     percentile(rw.ms, 90), rw.ms.back(), rw.ms.size(),
+                     rw.depth * 2, "", rw.name);
+    }
+}
+
+}
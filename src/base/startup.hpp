@@ -0,0 +1,59 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_STARTUP_HPP
+#define LD_STARTUP_HPP
+#include <cstdio>
+#include <vector>
+namespace startup {
+
+/// A timed phase of startup.
+struct record {
+    const char *name;
+    /// Number of phases this one is nested inside.
+    int depth;
+    /// Time spent in the phase, in milliseconds.
+    double ms;
+};
+
+/// Times a phase of startup, from construction until it is stopped or
+/// destroyed.  Phases which start while another phase is running are
+/// nested inside it.  Phases are only timed on the main thread.
+class phase {
+private:
+    int index_;
+    double start_;
+
+public:
+    explicit phase(const char *name);
+    phase(const phase &) = delete;
+    ~phase();
+    phase &operator=(const phase &) = delete;
+
+    /// Stop timing the phase.
+    void stop();
+};
+
+/// Get the phases timed since the last clear, in the order they
+/// started.
+const std::vector<record> &records();
+
+/// Forget the timed phases.
+void clear();
+
+/// Print the timed phases as a tree.
+void report();
+
+/// Write the timed phases in the form read_records() reads, to pass
+/// them from a child process to its parent.
+void write_records(std::FILE *fp);
+
+/// Read phases written by write_records(), skipping any other lines.
+/// The names are kept for the life of the process.
+std::vector<record> read_records(std::FILE *fp);
+
+/// Print percentiles for each phase over several runs.
+void report(const std::vector<std::vector<record>> &runs);
+
+}
+#endif
@@ -78,6 +78,8 @@ inline ivec &operator-=(ivec &u, ivec v) { u.x -= v.x; u.y -= v.y; return u; }
 inline ivec operator*(int a, ivec v) { return ivec(a * v.x, a * v.y); }
 inline ivec operator*(ivec v, int a) { return ivec(a * v.x, a * v.y); }
 inline ivec &operator*=(ivec &v, int a) { v.x *= a; v.y *= a; return v; }
+inline bool operator==(ivec u, ivec v) { return u.x == v.x && u.y == v.y; }
+inline bool operator!=(ivec u, ivec v) { return u.x != v.x || u.y != v.y; }
 
 /// Integer rectangle.
 struct irect {
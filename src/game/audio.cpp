@@ -2,14 +2,75 @@
    This file is part of Oubliette.  Oubliette is licensed under the terms
    of the 2-clause BSD license.  For more information, see LICENSE.txt. */
 #include "audio.hpp"
+#include "mixer.hpp"
+#include "music.hpp"
 #include "base/defs.hpp"
+#include "base/file.hpp"
+#include "base/loader.hpp"
+#include "base/startup.hpp"
 #include <SDL_mixer.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <cmath>
 namespace audio {
 
-static const int SFX_CHANNELS = 6;
-static const int FADE_OUT_TIME = 250;
+// The sound bank is in native byte order, and is used in place once it
+// is read or mapped.  The sounds are stored in the order of the sfx
+// enumeration, as 16-bit samples, with the gains from sfx/volume.txt
+// already applied.
+//
+// Header:
+//   0: magic, "OSFX"
+//   4: version
+//   8: sample rate
+//   12: number of channels
+//   16: number of sounds
+//   20: file size
+//
+// Sound:
+//   0: name, padded with zeros
+//   16: offset of the samples
+//   20: number of frames
+
+namespace {
+
+const char BANK_PATH[] = "sfx/sfx.bank";
+const char BANK_MAGIC[4] = { 'O', 'S', 'F', 'X' };
+const unsigned BANK_VERSION = 1;
+/// Format of the sound bank, which matches the format of the output.
+const int BANK_RATE = 44100;
+const int BANK_CHANNELS = 2;
+
+struct bank_header {
+    char magic[4];
+    unsigned version;
+    unsigned rate;
+    unsigned channels;
+    unsigned count;
+    unsigned size;
+};
+
+struct bank_sound {
+    char name[16];
+    unsigned offset;
+    unsigned frames;
+};
+
+typedef std::chrono::steady_clock clock;
+
+double elapsed_ms(clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+        clock::now() - start).count();
+}
+
+}
+
+/// Number of sound effects which can play at once.
+static const int SFX_VOICES = 12;
 
 /// Convert decibels to magnitude (voltage ratio, not power ratio).
 static double db_to_linear(double db)
@@ -21,16 +82,6 @@ static double db_to_linear(double db)
 static const double MUSIC_VOLUME = db_to_linear(-6.0);
 static const double SFX_VOLUME = db_to_linear(-10.0);
 
-static int convert_volume(double gain)
-{
-    int volume = std::floor(MIX_MAX_VOLUME * gain + 0.5);
-    if (volume <= 0)
-        volume = 1;
-    else if (volume > MIX_MAX_VOLUME)
-        volume = MIX_MAX_VOLUME;
-    return volume;
-}
-
 static const char WAVE_NAMES[SFX_COUNT][13] = {
     "door_open",
     "enemy_die",
@@ -43,23 +94,59 @@ static const char WAVE_NAMES[SFX_COUNT][13] = {
     "shot_impact"
 };
 
+/// Highest priority of a sound effect.
+static const int MAX_PRIORITY = 3;
+
+/// Maximum gain for copies of a sound effect played on the same tick.
+static const double MAX_MERGE_GAIN = 2.0;
+
+static_assert(sizeof(WAVE_NAMES[0]) <= sizeof(bank_sound::name),
+              "sound effect names must fit in the sound bank");
+
+/// Priority of each sound effect, for when there are too many sounds.
+static const int WAVE_PRIORITY[SFX_COUNT] = {
+    2, // door_open
+    2, // enemy_die
+    1, // enemy_hit
+    1, // enemy_shoot
+    3, // player_hit
+    2, // player_jump
+    2, // player_shoot
+    0, // player_step
+    1  // shot_impact
+};
+
 struct system::wave {
-    Mix_Chunk *data;
+    /// Samples in the output format.
+    const short *samples;
+    /// Number of frames.
+    std::size_t length;
     double volume;
+    /// The sound being decoded on the loader threads, if there is no
+    /// sound bank.
+    std::future<Mix_Chunk *> pending;
 
-    wave() : data(nullptr), volume(1.0) { }
+    wave() : samples(nullptr), length(0), volume(1.0) { }
 };
 
 struct system::track_info {
     std::string name;
     double loop_length;
-    Mix_Chunk *data;
 
-    track_info() : loop_length(-1.0), data(nullptr) { }
+    track_info() : loop_length(-1.0) { }
 };
 
 static const std::string WHITESPACE(" \n\t\r");
 
+/// Load a sound from the archive or the data directory.
+static Mix_Chunk *load_wav(const std::string &path)
+{
+    data file;
+    if (!data::read(&file, path))
+        return nullptr;
+    return Mix_LoadWAV_RW(file.rwops(), 1);
+}
+
 // Parse a line containing a string and a number.
 static int parse_line(const std::string &input,
                       std::string &name, double &data)
@@ -87,52 +174,30 @@ static int parse_line(const std::string &input,
     return 1;
 }
 
-system::system()
-    : sfx_channel_(0), music_channel_(0)
+/// Get the gain for each sound effect from sfx/volume.txt.
+static void read_volumes(double volume[SFX_COUNT])
 {
-    for (int i = 0; i < MUSIC_CHANNELS; i++)
-        music_tracks_[i] = false;
-    load_sfx();
-    load_trackinfo();
-}
+    for (int i = 0; i < SFX_COUNT; i++)
+        volume[i] = 1.0;
 
-system::~system()
-{
-}
-
-void system::load_sfx()
-{
-    sfx_wave_.reserve(SFX_COUNT);
-    for (int i = 0; i < SFX_COUNT; i++) {
-        std::string path("sfx/");
-        path += WAVE_NAMES[i];
-        path += ".ogg";
-        wave w;
-        w.data = Mix_LoadWAV(path.c_str());
-        if (!w.data)
-            std::printf("Could not load %s\n", path.c_str());
-        w.volume = 1.0;
-        sfx_wave_.push_back(w);
-    }
-
-    FILE *fp = std::fopen("sfx/volume.txt", "r");
-    if (!fp) {
+    data file;
+    if (!data::read(&file, "sfx/volume.txt")) {
         std::puts("Could not open sfx/volume.txt");
         return;
     }
 
     int lineno = 0;
-    char linebuf[64], *linep;
-    while ((linep = std::fgets(linebuf, sizeof(linebuf), fp)) != nullptr) {
+    line_reader lines(file);
+    std::string line, name;
+    while (lines.next(line)) {
         lineno++;
-        std::string line(linebuf), name;
-        double volume;
-        int result = parse_line(line, name, volume);
+        double db;
+        int result = parse_line(line, name, db);
         if (result > 0) {
             int i = 0;
             for (; i < SFX_COUNT; i++) {
                 if (name == WAVE_NAMES[i]) {
-                    sfx_wave_.at(i).volume = db_to_linear(volume);
+                    volume[i] = db_to_linear(db);
                     break;
                 }
             }
@@ -148,19 +213,139 @@ void system::load_sfx()
     }
 }
 
+system::system()
+    : channels_(0), merged_(0), music_track_(-1)
+{
+    for (int i = 0; i < SFX_COUNT; i++)
+        sfx_pending_[i] = 0;
+    startup::phase phase("audio");
+    load_trackinfo();
+
+    int rate, channels;
+    Uint16 format;
+    if (!Mix_QuerySpec(&rate, &format, &channels))
+        return;
+    if (format != AUDIO_S16SYS) {
+        std::puts("Audio disabled: output is not 16-bit");
+        return;
+    }
+    channels_ = channels;
+    load_sfx(rate, channels);
+    mixer_.reset(new mixer(channels, SFX_VOICES));
+    music_.reset(new music_player(MUSIC_VOLUME, rate, channels));
+    Mix_HookMusic(callback, this);
+}
+
+system::~system()
+{
+    if (!mixer_)
+        return;
+    Mix_HookMusic(nullptr, nullptr);
+    if (merged_ || mixer_->stolen() || mixer_->dropped())
+        std::printf("Sound effects: %u merged, %u cut off, %u dropped\n",
+                    merged_, mixer_->stolen(), mixer_->dropped());
+}
+
+void system::callback(void *udata, unsigned char *stream, int len)
+{
+    system &s = *static_cast<system *>(udata);
+    short *samples = reinterpret_cast<short *>(stream);
+    int frames = len / (2 * s.channels_);
+    s.music_->mix(samples, frames);
+    s.mixer_->mix(samples, frames);
+}
+
+void system::load_sfx(int rate, int channels)
+{
+    startup::phase phase("sound effects");
+    clock::time_point start = clock::now();
+    sfx_wave_.resize(SFX_COUNT);
+    if (load_bank(rate, channels)) {
+        std::printf("Loaded sound bank in %.1f ms\n", elapsed_ms(start));
+        return;
+    }
+
+    double volume[SFX_COUNT];
+    read_volumes(volume);
+    std::shared_ptr<std::atomic<int>> remaining =
+        std::make_shared<std::atomic<int>>(SFX_COUNT);
+    for (int i = 0; i < SFX_COUNT; i++) {
+        std::string path("sfx/");
+        path += WAVE_NAMES[i];
+        path += ".ogg";
+        wave &w = sfx_wave_[i];
+        w.pending = loader::submit([path, remaining, start]() {
+            Mix_Chunk *data = load_wav(path);
+            if (!data)
+                std::printf("Could not load %s\n", path.c_str());
+            if (--*remaining == 0)
+                std::printf("Decoded sound effects in %.1f ms\n",
+                            elapsed_ms(start));
+            return data;
+        });
+        w.volume = volume[i];
+    }
+}
+
+bool system::load_bank(int rate, int channels)
+{
+    if (!data::exists(BANK_PATH))
+        return false;
+    std::unique_ptr<data> file(new data);
+    if (!data::read(file.get(), BANK_PATH))
+        return false;
+
+    std::size_t size = file->size();
+    const unsigned char *base =
+        static_cast<const unsigned char *>(file->ptr());
+    const bank_header *h = reinterpret_cast<const bank_header *>(base);
+    if (size < sizeof(bank_header) + sizeof(bank_sound) * SFX_COUNT ||
+        std::memcmp(h->magic, BANK_MAGIC, 4) ||
+        h->version != BANK_VERSION || h->size != size ||
+        h->count != (unsigned)SFX_COUNT) {
+        std::fprintf(stderr, "Invalid sound bank: %s\n", BANK_PATH);
+        return false;
+    }
+    if ((int)h->rate != rate || (int)h->channels != channels) {
+        std::puts("Sound bank does not match the output format");
+        return false;
+    }
+    const bank_sound *snd =
+        reinterpret_cast<const bank_sound *>(base + sizeof(bank_header));
+    for (int i = 0; i < SFX_COUNT; i++) {
+        const bank_sound &b = snd[i];
+        if (std::strncmp(b.name, WAVE_NAMES[i], sizeof(b.name)) ||
+            (b.offset & 1) ||
+            b.offset > size ||
+            (size - b.offset) / (2 * channels) < b.frames) {
+            std::fprintf(stderr, "Invalid sound bank: %s\n", BANK_PATH);
+            return false;
+        }
+    }
+
+    for (int i = 0; i < SFX_COUNT; i++) {
+        wave &w = sfx_wave_[i];
+        w.samples = reinterpret_cast<const short *>(base + snd[i].offset);
+        w.length = snd[i].frames;
+        w.volume = 1.0;
+    }
+    bank_ = std::move(file);
+    return true;
+}
+
 void system::load_trackinfo()
 {
-    FILE *fp = std::fopen("music/looplength.txt", "r");
-    if (!fp) {
+    data file;
+    if (!data::read(&file, "music/looplength.txt")) {
         std::puts("Could not open music/looplength.txt");
         return;
     }
 
     int lineno = 0;
-    char linebuf[64], *linep;
-    while ((linep = std::fgets(linebuf, sizeof(linebuf), fp)) != nullptr) {
+    line_reader lines(file);
+    std::string line;
+    while (lines.next(line)) {
         lineno++;
-        std::string line(linebuf);
         track_info info;
         int result = parse_line(line, info.name, info.loop_length);
         if (result > 0) {
@@ -192,55 +377,117 @@ void system::play_music(const std::string &name, bool one_shot)
         }
     }
 
-    int &playing = music_tracks_[music_channel_];
-    if (playing >= 0) {
-        if (!Mix_Playing(SFX_CHANNELS + music_channel_))
-            playing = -1;
-    }
-    if (new_track == playing)
+    if (!music_)
+        return;
+    if (music_track_ >= 0 && !music_->playing())
+        music_track_ = -1;
+    if (new_track == music_track_)
+        return;
+    music_track_ = new_track;
+    if (new_track < 0) {
+        music_->stop();
         return;
-    if (playing >= 0) {
-        if (!music_one_shot_)
-            Mix_FadeOutChannel(SFX_CHANNELS + music_channel_, FADE_OUT_TIME);
-        music_channel_ = !music_channel_;
-        music_tracks_[music_channel_] = -1;
-    }
-    if (new_track >= 0) {
-        track_info &info = tracks_[new_track];
-        music_tracks_[music_channel_] = new_track;
-        if (!info.data) {
-            std::string path("music/");
-            path += info.name;
-            path += ".ogg";
-            info.data = Mix_LoadWAV(path.c_str());
-            if (!info.data)
-                std::printf("Failed to load %s: %s\n",
-                            path.c_str(), Mix_GetError());
-        }
-        if (info.data) {
-            Mix_Volume(SFX_CHANNELS + music_channel_, convert_volume(MUSIC_VOLUME));
-            Mix_PlayChannel(SFX_CHANNELS + music_channel_, info.data,
-                            one_shot ? 0 : -1);
-            music_one_shot_ = one_shot;
-        }
     }
+    const track_info &info = tracks_[new_track];
+    music_->play("music/" + info.name + ".ogg", info.loop_length, one_shot);
 }
 
 void system::play_sfx(sfx s)
 {
-    int channel = sfx_channel_ + 1;
-    if (channel >= SFX_CHANNELS)
-        channel = 0;
-    if (Mix_Playing(channel)) {
-        std::puts("Too many sounds, dropped");
+    if (!mixer_)
         return;
-    }
-    const wave &w = sfx_wave_.at((int)s);
-    if (!w.data)
+    sfx_pending_[(int)s]++;
+}
+
+void system::flush_sfx()
+{
+    if (!mixer_)
         return;
-    Mix_Volume(channel, convert_volume(w.volume * SFX_VOLUME));
-    Mix_PlayChannel(channel, w.data, 0);
-    sfx_channel_ = channel;
+    // Start the most important sounds first, so they get voices.
+    for (int p = MAX_PRIORITY; p >= 0; p--) {
+        for (int i = 0; i < SFX_COUNT; i++) {
+            int count = sfx_pending_[i];
+            if (!count || WAVE_PRIORITY[i] != p)
+                continue;
+            sfx_pending_[i] = 0;
+            merged_ += count - 1;
+            wave &w = sfx_wave_[i];
+            if (w.pending.valid()) {
+                Mix_Chunk *chunk = w.pending.get();
+                if (chunk) {
+                    w.samples = reinterpret_cast<const short *>(
+                        chunk->abuf);
+                    w.length = chunk->alen / (2 * channels_);
+                }
+            }
+            if (!w.samples)
+                continue;
+            // Copies of a sound on the same tick would play in unison,
+            // so play it once, louder.
+            sound snd;
+            snd.samples = w.samples;
+            snd.length = w.length;
+            snd.gain = w.volume * SFX_VOLUME *
+                std::min(MAX_MERGE_GAIN, std::sqrt((double)count));
+            snd.priority = p;
+            if (!mixer_->play(snd))
+                std::puts("Too many sounds, dropped");
+        }
+    }
+}
+
+void build_sfx()
+{
+    double volume[SFX_COUNT];
+    read_volumes(volume);
+
+    std::vector<short> samples[SFX_COUNT];
+    bank_sound snd[SFX_COUNT];
+    std::size_t offset = sizeof(bank_header) + sizeof(snd);
+    for (int i = 0; i < SFX_COUNT; i++) {
+        std::string path("sfx/");
+        path += WAVE_NAMES[i];
+        path += ".ogg";
+        std::vector<short> &pcm = samples[i];
+        if (!decode_file(path, BANK_RATE, BANK_CHANNELS, &pcm))
+            core::die("Failed to build sound bank");
+        for (auto &x : pcm) {
+            double v = std::floor(x * volume[i] + 0.5);
+            x = (short)std::max(-32768.0, std::min(32767.0, v));
+        }
+        std::memset(&snd[i], 0, sizeof(snd[i]));
+        std::memcpy(snd[i].name, WAVE_NAMES[i], std::strlen(WAVE_NAMES[i]));
+        snd[i].offset = offset;
+        snd[i].frames = pcm.size() / BANK_CHANNELS;
+        offset += pcm.size() * 2;
+    }
+
+    bank_header h;
+    std::memcpy(h.magic, BANK_MAGIC, 4);
+    h.version = BANK_VERSION;
+    h.rate = BANK_RATE;
+    h.channels = BANK_CHANNELS;
+    h.count = SFX_COUNT;
+    h.size = offset;
+
+    std::vector<unsigned char> out(h.size);
+    unsigned char *p = out.data();
+    std::memcpy(p, &h, sizeof(h));
+    std::memcpy(p + sizeof(h), snd, sizeof(snd));
+    for (int i = 0; i < SFX_COUNT; i++)
+        std::memcpy(p + snd[i].offset, samples[i].data(),
+                    samples[i].size() * 2);
+
+    FILE *fp = std::fopen(BANK_PATH, "wb");
+    if (!fp) {
+        std::fprintf(stderr, "Could not open file: %s\n", BANK_PATH);
+        core::die("Failed to build sound bank");
+    }
+    std::size_t amt = std::fwrite(out.data(), 1, out.size(), fp);
+    if (std::fclose(fp) || amt != out.size())
+        core::die("Failed to build sound bank");
+    std::fprintf(stderr, "Wrote %s, %d sounds, %zu bytes\n",
+                 BANK_PATH, SFX_COUNT, out.size());
 }
 
 }
@@ -3,8 +3,10 @@
    of the 2-clause BSD license.  For more information, see LICENSE.txt. */
 #ifndef LD_GAME_AUDIO_HPP
 #define LD_GAME_AUDIO_HPP
+#include <memory>
 #include <string>
 #include <vector>
+class data;
 namespace audio {
 
 enum class sfx {
@@ -21,23 +23,36 @@ enum class sfx {
 
 static const int SFX_COUNT = static_cast<int>(sfx::SHOT_IMPACT) + 1;
 
-/// The audio system.
+class mixer;
+class music_player;
+
+/// The audio system.  Sound effects and music are mixed by our own
+/// code, in the audio callback.
 class system {
 private:
-    static const int MUSIC_CHANNELS = 2;
     struct wave;
     struct track_info;
 
+    /// Number of output channels.
+    int channels_;
     std::vector<wave> sfx_wave_;
-    int sfx_channel_;
+    /// Number of times each sound effect was played this tick.
+    int sfx_pending_[SFX_COUNT];
+    /// Number of sound effects merged with a copy on the same tick.
+    unsigned merged_;
+    /// The sound bank, which the sound effects refer to.
+    std::unique_ptr<::data> bank_;
+    std::unique_ptr<mixer> mixer_;
 
     std::vector<track_info> tracks_;
-    int music_channel_;
-    int music_tracks_[MUSIC_CHANNELS];
-    bool music_one_shot_;
+    std::unique_ptr<music_player> music_;
+    /// The current track, or -1.
+    int music_track_;
 
     void load_trackinfo();
-    void load_sfx();
+    void load_sfx(int rate, int channels);
+    bool load_bank(int rate, int channels);
+    static void callback(void *udata, unsigned char *stream, int len);
 
 public:
     system();
@@ -50,9 +65,18 @@ public:
     /// Set the current music track.  Set to empty to stop music.
     void play_music(const std::string &name, bool one_shot);
 
-    /// Play a sound effect.
+    /// Play a sound effect.  The sound starts when the tick's sound
+    /// effects are flushed.
     void play_sfx(sfx s);
+
+    /// Start the sound effects played this tick.  Copies of the same
+    /// sound effect are merged into one.
+    void flush_sfx();
 };
 
+/// Build the sound bank, which holds the sound effects decoded in the
+/// output format, so they are not decoded at startup.
+void build_sfx();
+
 }
 #endif
@@ -0,0 +1,269 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "base/pack.hpp"
+#include "base/rand.hpp"
+#include "base/soft.hpp"
+#include "base/sprite.hpp"
+#include "bench.hpp"
+#include "mixer.hpp"
+namespace bench {
+
+typedef std::chrono::steady_clock clock;
+
+/// Get the time since a starting point, in milliseconds.
+static double elapsed_ms(clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+        clock::now() - start).count();
+}
+
+/// Pack random sprite-sized rectangles into multi-page atlases.
+static void bench_pack()
+{
+    static const int COUNTS[] = { 10, 100, 1000, 10000 };
+    const int ITER = 5;
+
+    std::printf("%8s %6s %10s %8s %10s\n",
+                "rects", "pages", "size", "usage", "time (ms)");
+    for (int count : COUNTS) {
+        rng r = { 0x12345678u, 0x9abcdef0u, 0x0fedcba9u, 0x87654321u };
+        std::vector<pack::size> rects(count);
+        long area = 0;
+        for (auto &sz : rects) {
+            sz.width = 8 + r.next() % 57;
+            sz.height = 8 + r.next() % 57;
+            area += sz.width * sz.height;
+        }
+
+        pack::options opts;
+        opts.max_size = 1024;
+        opts.max_pages = 64;
+        opts.allow_rotate = true;
+        pack::packing packing;
+        clock::time_point start = clock::now();
+        for (int i = 0; i < ITER; i++)
+            packing = pack::pack(rects, opts);
+        double time = elapsed_ms(start) / ITER;
+
+        long total = (long)packing.pages *
+            packing.packsize.width * packing.packsize.height;
+        std::printf("%8d %6d %4dx%-5d %7.1f%% %10.2f\n",
+                    count, packing.pages,
+                    packing.packsize.width, packing.packsize.height,
+                    total ? 100.0 * area / total : 0.0, time);
+    }
+}
+
+/// Draw sprites from a synthetic atlas into a native-size picture with
+/// the software renderer.
+static void bench_blit()
+{
+    static const int COUNTS[] = { 100, 1000, 10000 };
+    const int SIZE = 16, PICW = 320, PICH = 180;
+    const double SECONDS = 0.5;
+
+    // Sprites with binary alpha, a quarter of the pixels transparent.
+    rng r = { 0x12345678u, 0x9abcdef0u, 0x0fedcba9u, 0x87654321u };
+    soft::image atlas(256, 256);
+    for (auto &p : atlas.pixels)
+        p = (r.next() & 3) ? (r.next() | 0xff000000u) : 0u;
+    soft::image picture(PICW, PICH);
+
+    std::printf("%8s %10s %12s %10s\n",
+                "sprites", "frames/s", "Mpixels/s", "time (ms)");
+    for (int count : COUNTS) {
+        std::unique_ptr<short[][4]> vert(new short[count * 6][4]);
+        for (int i = 0; i < count; i++) {
+            short x0 = r.next() % (PICW + SIZE) - SIZE, x1 = x0 + SIZE;
+            short y0 = r.next() % (PICH + SIZE) - SIZE, y1 = y0 + SIZE;
+            short u0 = (r.next() % 16) * SIZE, u1 = u0 + SIZE;
+            short v0 = (r.next() % 16) * SIZE, v1 = v0 + SIZE;
+            short (*d)[4] = &vert[i * 6];
+            d[0][0] = x0; d[0][1] = y0; d[0][2] = u0; d[0][3] = v1;
+            d[1][0] = x1; d[1][1] = y0; d[1][2] = u1; d[1][3] = v1;
+            d[2][0] = x0; d[2][1] = y1; d[2][2] = u0; d[2][3] = v0;
+            d[3][0] = x0; d[3][1] = y1; d[3][2] = u0; d[3][3] = v0;
+            d[4][0] = x1; d[4][1] = y0; d[4][2] = u1; d[4][3] = v1;
+            d[5][0] = x1; d[5][1] = y1; d[5][2] = u1; d[5][3] = v0;
+        }
+
+        soft::quads q;
+        q.vert = vert.get();
+        q.count = count * 6;
+        q.dx = 0;
+        q.dy = 0;
+        q.tex = &atlas;
+        q.uscale = 1;
+        q.vscale = 1;
+        q.mode = soft::source::PREMULTIPLIED;
+        q.color = 0;
+
+        int frames = 0;
+        double time;
+        clock::time_point start = clock::now();
+        do {
+            soft::clear(picture, 0xff000000u);
+            soft::draw(picture, q);
+            frames++;
+            time = elapsed_ms(start);
+        } while (time < SECONDS * 1000.0);
+
+        double pixels = (double)count * SIZE * SIZE * frames;
+        std::printf("%8d %10.0f %12.1f %10.3f\n",
+                    count, frames * 1000.0 / time,
+                    pixels / (time * 1000.0), time / frames);
+    }
+}
+
+/// Generate sprite vertexes one sprite at a time and in batches.
+static void bench_sprites()
+{
+    static const int COUNTS[] = { 10, 100, 1000, 10000 };
+    const int SPRITES = 40;
+    const double SECONDS = 0.25;
+
+    rng r = { 0x12345678u, 0x9abcdef0u, 0x0fedcba9u, 0x87654321u };
+    std::vector<sprite::rect> rects(SPRITES);
+    for (auto &rc : rects) {
+        rc.x = (r.next() % 16) * 16;
+        rc.y = (r.next() % 16) * 16;
+        rc.w = 8 + r.next() % 9;
+        rc.h = 8 + r.next() % 9;
+        rc.cx = rc.w / 2;
+        rc.cy = rc.h / 2;
+        rc.page = r.next() % 2;
+        rc.rotated = (r.next() & 1) != 0;
+    }
+    sprite::sheet sheet(rects);
+
+    std::printf("%8s %14s %14s %8s\n",
+                "sprites", "single (ns)", "batch (ns)", "speedup");
+    for (int count : COUNTS) {
+        std::vector<sprite::instance> inst(count);
+        for (auto &in : inst) {
+            in.index = r.next() % SPRITES;
+            in.x = r.next() % 320;
+            in.y = r.next() % 180;
+            in.orient = static_cast<sprite::orientation>(r.next() % 8);
+        }
+
+        double ns[2];
+        sprite::array arrays[2];
+        for (int mode = 0; mode < 2; mode++) {
+            sprite::array &arr = arrays[mode];
+            long iter = 0;
+            double time;
+            clock::time_point start = clock::now();
+            do {
+                arr.clear();
+                if (mode == 0) {
+                    for (const auto &in : inst)
+                        arr.add(sheet.get(in.index), in.x, in.y, in.orient);
+                } else {
+                    arr.add(sheet, inst.data(), inst.size());
+                }
+                iter++;
+                time = elapsed_ms(start);
+            } while (time < SECONDS * 1000.0);
+            ns[mode] = time * 1e6 / ((double)iter * count);
+        }
+
+        bool same = arrays[0].size() == arrays[1].size() &&
+            arrays[0].runs().size() == arrays[1].runs().size() &&
+            !std::memcmp(arrays[0].data(), arrays[1].data(),
+                         sizeof(short) * 4 * arrays[0].size());
+        std::printf("%8d %14.2f %14.2f %7.2fx%s\n",
+                    count, ns[0], ns[1], ns[0] / ns[1],
+                    same ? "" : "  MISMATCH");
+    }
+}
+
+/// Mix sound effects with and without SIMD.
+static void bench_mixer()
+{
+    static const int COUNTS[] = { 1, 4, 16, 48 };
+    const int CHANNELS = 2;
+    const int LENGTH = 44100;
+    const int BUFFER = 1024;
+    const double SECONDS = 0.25;
+
+    rng r = { 0x12345678u, 0x9abcdef0u, 0x0fedcba9u, 0x87654321u };
+    std::vector<short> noise(LENGTH * CHANNELS);
+    for (auto &x : noise)
+        x = (short)(r.next() & 0xffff) >> 2;
+
+    std::printf("%8s %14s %14s %8s\n",
+                "voices", "scalar (ns)", "simd (ns)", "speedup");
+    for (int count : COUNTS) {
+        double ns[2];
+        std::vector<short> out[2];
+        for (int mode = 0; mode < 2; mode++) {
+            std::vector<short> &buf = out[mode];
+            buf.resize(LENGTH * CHANNELS);
+            long iter = 0;
+            double time;
+            clock::time_point start = clock::now();
+            do {
+                audio::mixer m(CHANNELS, count);
+                m.set_simd(mode != 0);
+                for (int i = 0; i < count; i++) {
+                    audio::sound snd;
+                    snd.samples = noise.data() + (i * 97 % LENGTH) * CHANNELS;
+                    snd.length = LENGTH - i * 97 % LENGTH;
+                    snd.gain = 0.5f;
+                    snd.priority = 0;
+                    m.play(snd);
+                    m.mix(nullptr, 0);
+                }
+                std::fill(buf.begin(), buf.end(), 0);
+                for (int pos = 0; pos < LENGTH; pos += BUFFER)
+                    m.mix(buf.data() + pos * CHANNELS,
+                          std::min(BUFFER, LENGTH - pos));
+                iter++;
+                time = elapsed_ms(start);
+            } while (time < SECONDS * 1000.0);
+            ns[mode] = time * 1e6 / ((double)iter * LENGTH);
+        }
+
+        bool same = out[0] == out[1];
+        std::printf("%8d %14.2f %14.2f %7.2fx%s\n",
+                    count, ns[0], ns[1], ns[0] / ns[1],
+                    same ? "" : "  MISMATCH");
+    }
+}
+
+struct benchmark {
+    const char *name;
+    void (*func)();
+};
+
+static const benchmark BENCHMARKS[] = {
+    { "pack", bench_pack },
+    { "blit", bench_blit },
+    { "sprites", bench_sprites },
+    { "mixer", bench_mixer },
+};
+
+int run(const char *name)
+{
+    for (const auto &b : BENCHMARKS) {
+        if (!std::strcmp(name, b.name)) {
+            b.func();
+            return 0;
+        }
+    }
+    std::fprintf(stderr, "Unknown benchmark: %s\nBenchmarks:", name);
+    for (const auto &b : BENCHMARKS)
+        std::fprintf(stderr, " %s", b.name);
+    std::fputc('\n', stderr);
+    return 1;
+}
+
+}
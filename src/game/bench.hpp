@@ -0,0 +1,13 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_GAME_BENCH_HPP
+#define LD_GAME_BENCH_HPP
+namespace bench {
+
+/// Run the named benchmark and print the results.  Returns the process
+/// exit status, nonzero if there is no benchmark with that name.
+int run(const char *name);
+
+}
+#endif
@@ -0,0 +1,39 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_GAME_DRAW_LIST_HPP
+#define LD_GAME_DRAW_LIST_HPP
+#include "base/sprite.hpp"
+#include "base/vec.hpp"
+#include "sprite.hpp"
+#include <vector>
+namespace graphics {
+
+/// A list of sprites to draw.  Lists do not touch the graphics system,
+/// so separate lists can be filled on separate threads, and then added
+/// to the graphics system in order with system::add_sprites.
+class draw_list {
+private:
+    std::vector<::sprite::instance> sprites_;
+
+public:
+    /// Clear the list, keeping its storage.
+    void clear() { sprites_.clear(); }
+    /// Add a sprite to the list.
+    void add_sprite(anysprite sp, ivec pos, ::sprite::orientation orient)
+    {
+        ::sprite::instance s;
+        s.index = sp;
+        s.x = pos.x;
+        s.y = pos.y;
+        s.orient = orient;
+        sprites_.push_back(s);
+    }
+    /// Get the sprites in the list.
+    const ::sprite::instance *data() const { return sprites_.data(); }
+    /// Get the number of sprites in the list.
+    std::size_t size() const { return sprites_.size(); }
+};
+
+}
+#endif
@@ -3,16 +3,22 @@
    of the 2-clause BSD license.  For more information, see LICENSE.txt. */
 #include "entity.hpp"
 #include "base/defs.hpp"
+#include "base/loader.hpp"
 #include "audio.hpp"
 #include "color.hpp"
 #include "control.hpp"
 #include "defs.hpp"
 #include "graphics.hpp"
 #include "leveldata.hpp"
+#include "levelcache.hpp"
 #include "stats.hpp"
 #include "persistent.hpp"
 #include <cstdio>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 namespace game {
 
 using ::audio::sfx;
@@ -32,6 +38,11 @@ static const int CAMERA_X = 16;
 static const int CAMERA_Y = 16;
 static const frect CAMERA(-CAMERA_X, -CAMERA_Y, +CAMERA_X, +CAMERA_Y);
 
+// Entities are drawn in chunks, and only in parallel when there are
+// enough of them to pay for handing chunks to the loader threads.
+static const std::size_t DRAW_CHUNK = 256;
+static const std::size_t DRAW_PARALLEL_THRESHOLD = 1024;
+
 struct entity_is_dead {
     bool operator()(const std::unique_ptr<entity> &p) {
         return p->m_team != team::DEAD;
@@ -70,12 +81,13 @@ entity_system::entity_system(persistent_state &state,
                              const control_system &control,
                              audio::system &audio,
                              const std::string &levelname,
-                             const std::string &lastlevel)
+                             const std::string &lastlevel,
+                             const level_files &files)
     : state_(state), control_(control), audio_(audio), levelname_(levelname),
-      is_click_(false)
+      is_click_(false), statics_changed_(true)
 {
-    level_.set_level(levelname);
-    auto data = leveldata::read_level(levelname);
+    level_.set_map(files.map);
+    auto data = files.spawns;
     auto b = data.begin(), e = data.end();
     spawnpoint *pspawn = nullptr, *dspawn = nullptr, *dspawn2 = nullptr;
     std::string dname;
@@ -88,6 +100,7 @@ entity_system::entity_system(persistent_state &state,
 
         case spawntype::DOOR:
             entities_.emplace_back(new door(*this, fvec(i->pos), i->data));
+            door_targets_.push_back(i->data);
             if (door_name(i->data) == lastlevel)
                 dspawn = &*i;
             dspawn2 = &*i;
@@ -150,6 +163,10 @@ void entity_system::update()
         state_.hittime--;
     hover_trigger_ = ivec(-1000, -1000);
 
+    for (const auto &ent : new_entities_) {
+        if (ent->has_static())
+            statics_changed_ = true;
+    }
     entities_.insert(
         entities_.end(),
         std::make_move_iterator(new_entities_.begin()),
@@ -161,6 +178,10 @@ void entity_system::update()
     }
     auto part = std::stable_partition(
         entities_.begin(), entities_.end(), entity_is_dead());
+    for (auto i = part, e = entities_.end(); i != e; i++) {
+        if ((*i)->has_static())
+            statics_changed_ = true;
+    }
     entities_.erase(part, entities_.end());
 
     camera_.update();
@@ -179,21 +200,86 @@ void entity_system::draw(::graphics::system &gr, int reltime)
         gr.set_blend_color(base);
     }
 
+    ::graphics::draw_list hearts;
     for (int i = 0; i < state_.maxhealth; i++) {
-        gr.add_sprite(
+        hearts.add_sprite(
             i < state_.health ? ui::HEART1 : ui::HEART2,
             ivec(core::PWIDTH - 8 - 16*i, core::PHEIGHT - 8),
-            orientation::NORMAL,
-            true);
+            orientation::NORMAL);
+    }
+    gr.add_sprites(hearts, true);
+
+    if (statics_changed_) {
+        statics_changed_ = false;
+        ::graphics::draw_list statics;
+        for (const auto &ent : entities_)
+            ent->draw_static(statics);
+        gr.set_static_sprites(statics);
     }
 
     fvec camera = camera_.get_pos(reltime);
     lastcamera_ = ivec(camera);
     gr.set_camera_pos(lastcamera_);
-    for (auto i = entities_.begin(), e = entities_.end(); i != e; i++) {
-        entity &ent = **i;
-        ent.draw(gr, reltime);
+    draw_entities(gr, reltime);
+}
+
+void entity_system::draw_entities(::graphics::system &gr, int reltime)
+{
+    std::size_t count = entities_.size();
+    std::size_t nchunks = (count + DRAW_CHUNK - 1) / DRAW_CHUNK;
+    if (draw_lists_.size() < nchunks)
+        draw_lists_.resize(nchunks);
+
+    // Entities only read their state when drawing, so chunks can be
+    // drawn in parallel.  The lists are added in entity order, so the
+    // result is the same as drawing serially.  The loader threads help
+    // with large levels.  They may be busy loading, so this thread
+    // takes chunks too, and a helper which starts late finds nothing
+    // left and returns without touching the entities.
+    struct draw_job {
+        std::atomic<std::size_t> next;
+        std::mutex mutex;
+        std::condition_variable cond;
+        /// Number of chunks drawn, guarded by the mutex.
+        std::size_t done;
+    };
+    std::shared_ptr<draw_job> job = std::make_shared<draw_job>();
+    job->next = 0;
+    job->done = 0;
+    auto worker = [this, job, count, nchunks, reltime]() {
+        std::size_t n = 0;
+        while (true) {
+            std::size_t k = job->next++;
+            if (k >= nchunks)
+                break;
+            ::graphics::draw_list &list = draw_lists_[k];
+            list.clear();
+            std::size_t end = std::min(count, (k + 1) * DRAW_CHUNK);
+            for (std::size_t i = k * DRAW_CHUNK; i < end; i++)
+                entities_[i]->draw(list, reltime);
+            n++;
+        }
+        if (n) {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->done += n;
+            if (job->done == nchunks)
+                job->cond.notify_one();
+        }
+    };
+
+    if (count >= DRAW_PARALLEL_THRESHOLD) {
+        std::size_t nhelpers = std::min<std::size_t>(
+            loader::threads(), nchunks - 1);
+        for (std::size_t i = 0; i < nhelpers; i++)
+            loader::post(worker);
     }
+    worker();
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->cond.wait(lock, [&job, nchunks] { return job->done == nchunks; });
+    lock.unlock();
+
+    for (std::size_t k = 0; k < nchunks; k++)
+        gr.add_sprites(draw_lists_[k]);
 }
 
 void entity_system::add_entity(entity *ent)
@@ -276,6 +362,16 @@ void entity::damage(int amount)
     (void)amount;
 }
 
+void entity::draw_static(::graphics::draw_list &list)
+{
+    (void)list;
+}
+
+bool entity::has_static() const
+{
+    return false;
+}
+
 // ======================================================================
 
 physics_component::physics_component(irect bbox, fvec pos, fvec vel)
@@ -631,9 +727,9 @@ void player::damage(int amt)
     }
 }
 
-void player::draw(::graphics::system &gr, int reltime)
+void player::draw(::graphics::draw_list &list, int reltime)
 {
-    gr.add_sprite(
+    list.add_sprite(
         sprite::PLAYER,
         ivec(physics.get_pos(reltime)),
         orientation::NORMAL);
@@ -677,21 +773,30 @@ void door::interact()
     }
 }
 
-void door::draw(::graphics::system &gr, int reltime)
+void door::draw(::graphics::draw_list &list, int reltime)
 {
     (void)reltime;
-    gr.add_sprite(
-        m_is_locked ? sprite::DOOR3 : sprite::DOOR2,
-        m_pos,
-        orientation::NORMAL);
     if (!m_is_locked && m_system.test_hover(m_bbox)) {
-        gr.add_sprite(
+        list.add_sprite(
             ui::ARROW,
             m_pos + ivec(0, 28),
             orientation::NORMAL);
     }
 }
 
+void door::draw_static(::graphics::draw_list &list)
+{
+    list.add_sprite(
+        m_is_locked ? sprite::DOOR3 : sprite::DOOR2,
+        m_pos,
+        orientation::NORMAL);
+}
+
+bool door::has_static() const
+{
+    return true;
+}
+
 // ======================================================================
 
 chest::chest(entity_system &sys, fvec pos, const std::string &contents)
@@ -728,21 +833,30 @@ void chest::interact()
     m_team = team::DEAD;
 }
 
-void chest::draw(::graphics::system &gr, int reltime)
+void chest::draw(::graphics::draw_list &list, int reltime)
 {
     (void)reltime;
-    gr.add_sprite(
-        sprite::CHEST,
-        m_pos,
-        orientation::NORMAL);
     if (m_system.test_hover(m_bbox)) {
-        gr.add_sprite(
+        list.add_sprite(
             ui::ARROW,
             m_pos + ivec(0, 24),
             orientation::NORMAL);
     }
 }
 
+void chest::draw_static(::graphics::draw_list &list)
+{
+    list.add_sprite(
+        sprite::CHEST,
+        m_pos,
+        orientation::NORMAL);
+}
+
+bool chest::has_static() const
+{
+    return true;
+}
+
 // ======================================================================
 
 enemy::enemy(entity_system &sys, fvec pos,
@@ -785,9 +899,9 @@ void enemy::damage(int amount)
     }
 }
 
-void enemy::draw(::graphics::system &gr, int reltime)
+void enemy::draw(::graphics::draw_list &list, int reltime)
 {
-    gr.add_sprite(
+    list.add_sprite(
         m_actor,
         physics.get_pos(reltime),
         orientation::NORMAL);
@@ -815,9 +929,9 @@ void shot::update()
         m_team = team::DEAD;
 }
 
-void shot::draw(::graphics::system &gr, int reltime)
+void shot::draw(::graphics::draw_list &list, int reltime)
 {
-    gr.add_sprite(
+    list.add_sprite(
         time > 0 ? m_sp1 : m_sp2,
         projectile.get_pos(reltime),
         orientation::NORMAL);
@@ -841,7 +955,7 @@ void poof::update()
         m_team = team::DEAD;
 }
 
-void poof::draw(::graphics::system &gr, int reltime)
+void poof::draw(::graphics::draw_list &list, int reltime)
 {
     (void)reltime;
     anysprite s;
@@ -851,7 +965,7 @@ void poof::draw(::graphics::system &gr, int reltime)
     case 2: s = sprite::POOF3; break;
     default: return;
     }
-    gr.add_sprite(s, m_pos, orientation::NORMAL);
+    list.add_sprite(s, m_pos, orientation::NORMAL);
 }
 
 // ======================================================================
@@ -863,10 +977,20 @@ glyph::glyph(entity_system &sys, fvec pos, ::graphics::anysprite sp)
 glyph::~glyph()
 { }
 
-void glyph::draw(::graphics::system &gr, int reltime)
+void glyph::draw(::graphics::draw_list &list, int reltime)
 {
+    (void)list;
     (void)reltime;
-    gr.add_sprite(m_sprite, m_pos, orientation::NORMAL);
+}
+
+void glyph::draw_static(::graphics::draw_list &list)
+{
+    list.add_sprite(m_sprite, m_pos, orientation::NORMAL);
+}
+
+bool glyph::has_static() const
+{
+    return true;
 }
 
 // ======================================================================
@@ -898,7 +1022,7 @@ void signal_glyph::update()
     }
 }
 
-void signal_glyph::draw(::graphics::system &gr, int reltime)
+void signal_glyph::draw(::graphics::draw_list &list, int reltime)
 {
     float delta;
     if (m_time < SIGNAL_RISETIME)
@@ -907,7 +1031,7 @@ void signal_glyph::draw(::graphics::system &gr, int reltime)
                 (SIGNAL_RISETIME * defs::FRAMETIME));
     else
         delta = SIGNAL_RISEDISTANCE;
-    gr.add_sprite(
+    list.add_sprite(
         m_sprite,
         m_pos + ivec(0, std::floor(delta)),
         orientation::NORMAL);
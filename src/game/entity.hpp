@@ -5,6 +5,7 @@
 #define LD_GAME_ENTITY_HPP
 #include "base/vec.hpp"
 #include "camera.hpp"
+#include "draw_list.hpp"
 #include "levelmap.hpp"
 #include "sprite.hpp"
 #include <string>
@@ -22,6 +23,7 @@ class control_system;
 struct walking_stats;
 struct jumping_stats;
 struct enemy_stats;
+struct level_files;
 struct persistent_state;
 
 /// Teams for entities.
@@ -75,13 +77,25 @@ private:
     ivec click_pos_;
     /// Whether we clicked the mouse.
     bool is_click_;
+    /// Whether an entity with static parts was added or removed.
+    bool statics_changed_;
+    /// Draw lists for chunks of entities, reused between frames.
+    std::vector<::graphics::draw_list> draw_lists_;
+    /// Where the doors in the level lead.
+    std::vector<std::string> door_targets_;
+
+    /// Draw the entities, in parallel if there are many of them.
+    void draw_entities(::graphics::system &gr, int reltime);
 
 public:
+    /// Start a level, taking the collision map and spawn points from
+    /// its files.
     entity_system(persistent_state &state,
                   const control_system &control,
                   audio::system &audio,
                   const std::string &levelname,
-                  const std::string &lastlevel);
+                  const std::string &lastlevel,
+                  const level_files &files);
 
     /// Update the entities.
     void update();
@@ -106,6 +120,8 @@ public:
 
     const control_system &control() const { return control_; }
     const levelmap &level() const { return level_; }
+    const std::vector<std::string> &door_targets() const
+    { return door_targets_; }
     const std::vector<std::unique_ptr<entity>> &entities() const
     { return entities_; }
     persistent_state &state() { return state_; }
@@ -140,7 +156,13 @@ public:
     /// Damage the object.
     virtual void damage(int amount);
     /// Draw the sprite to the graphics system.
-    virtual void draw(::graphics::system &gr, int reltime) = 0;
+    virtual void draw(::graphics::draw_list &list, int reltime) = 0;
+    /// Draw the parts of the entity which never change.  These are
+    /// composited with the level background when entities with static
+    /// parts are added or removed.
+    virtual void draw_static(::graphics::draw_list &list);
+    /// Whether the entity draws anything in draw_static().
+    virtual bool has_static() const;
 
     /// Link to the enclosing world state.
     entity_system &m_system;
@@ -258,7 +280,7 @@ public:
 
     virtual void update();
     virtual void damage(int amount);
-    virtual void draw(::graphics::system &gr, int reltime);
+    virtual void draw(::graphics::draw_list &list, int reltime);
 };
 
 /// Doors between areas.
@@ -273,7 +295,9 @@ public:
     virtual ~door();
 
     virtual void interact();
-    virtual void draw(::graphics::system &gr, int reltime);
+    virtual void draw(::graphics::draw_list &list, int reltime);
+    virtual void draw_static(::graphics::draw_list &list);
+    virtual bool has_static() const;
 };
 
 /// Treasure chest.
@@ -287,7 +311,9 @@ public:
     virtual ~chest();
 
     virtual void interact();
-    virtual void draw(::graphics::system &gr, int reltime);
+    virtual void draw(::graphics::draw_list &list, int reltime);
+    virtual void draw_static(::graphics::draw_list &list);
+    virtual bool has_static() const;
 };
 
 /// Enemy.
@@ -309,7 +335,7 @@ public:
 
     virtual void update();
     virtual void damage(int amount);
-    virtual void draw(::graphics::system &gr, int reltime);
+    virtual void draw(::graphics::draw_list &list, int reltime);
 };
 
 /// Projectiles.
@@ -326,7 +352,7 @@ public:
     virtual ~shot();
 
     virtual void update();
-    virtual void draw(::graphics::system &gr, int reltime);
+    virtual void draw(::graphics::draw_list &list, int reltime);
 };
 
 /// Projectile poof.
@@ -340,7 +366,7 @@ public:
     virtual ~poof();
 
     virtual void update();
-    virtual void draw(::graphics::system &gr, int reltime);
+    virtual void draw(::graphics::draw_list &list, int reltime);
 };
 
 /// A static sprite.
@@ -353,7 +379,9 @@ public:
     glyph(entity_system &sys, fvec pos, ::graphics::anysprite sp);
     virtual ~glyph();
 
-    virtual void draw(::graphics::system &gr, int reltime);
+    virtual void draw(::graphics::draw_list &list, int reltime);
+    virtual void draw_static(::graphics::draw_list &list);
+    virtual bool has_static() const;
 };
 
 /// A rising glyph which possibly triggers a transition to another level.
@@ -371,7 +399,7 @@ public:
     virtual ~signal_glyph();
 
     virtual void update();
-    virtual void draw(::graphics::system &gr, int reltime);
+    virtual void draw(::graphics::draw_list &list, int reltime);
 };
 
 }
@@ -7,8 +7,18 @@
 #include "defs.hpp"
 #include "base/defs.hpp"
 #include "base/rand.hpp"
+#include "base/startup.hpp"
+#include <cmath>
+#include <cstdio>
 namespace graphics {
 
+tv_quality tv_setting = tv_quality::AUTO;
+bool software_render = false;
+bool offscreen_render = false;
+std::string capture_path;
+bool capture_output = false;
+bool profile_passes = false;
+
 static int round_up_pow2(int x)
 {
     unsigned v = x - 1;
@@ -24,63 +34,159 @@ static int round_up_pow2(int x)
 
 common_data::common_data()
     : sprite("sprite", "sprite"),
+      sprite_index("sprite", "spriteindex"),
       tv("tv", "tv"),
+      tv_fast("tv", "tvfast"),
       plain("plain", "plain"),
       text("sprite", "text")
-{ }
+{
+    // The programs may compile in parallel until they are finished.
+    sprite.finish();
+    sprite_index.finish();
+    tv.finish();
+    tv_fast.finish();
+    plain.finish();
+    text.finish();
+}
+
+/// Load the shader commons, and report how long it took.  The images
+/// for the other parts of the system are decoded on the loader
+/// threads while the shaders compile.
+static common_data *load_common()
+{
+    static const char *const IMAGES[] = {
+        "font/terminus.png", "tv/pattern.png", "tv/noise.png",
+        "tv/banding.png"
+    };
+    for (const char *path : IMAGES)
+        image::preload(path, false);
+    if (software_render)
+        return nullptr;
+
+    startup::phase phase("shaders");
+    auto start = std::chrono::steady_clock::now();
+    core::push_gl_group("shaders", HERE);
+    common_data *com = new common_data;
+    core::pop_gl_group();
+    double ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    int cached = com->sprite.cached() + com->sprite_index.cached() +
+        com->tv.cached() + com->tv_fast.cached() +
+        com->plain.cached() + com->text.cached();
+    std::fprintf(stderr, "Loaded 6 shader programs in %.1f ms, "
+                 "%d from the binary cache\n", ms, cached);
+    return com;
+}
+
+const shader::program<shader::sprite> &common_data::use_sprite(
+    GLuint texture, GLuint palette) const
+{
+    const shader::program<shader::sprite> &prog =
+        palette ? sprite_index : sprite;
+    glUseProgram(prog.prog());
+    if (palette) {
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, palette);
+        glUniform1i(prog->u_palette, 1);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glUniform1i(prog->u_texture, 0);
+    return prog;
+}
 
 // ======================================================================
 
-sprite_data::sprite_data()
-    : sheet("", SPRITES)
+static const char SPRITE_ATLAS[] = "atlas/sprite";
+
+sprite_data::sprite_data(bool software)
+    : sheet("", SPRITES, SPRITE_ATLAS, !software)
 { }
 
+void sprite_data::build_atlas()
+{
+    ::sprite::sheet::build_atlas("", SPRITES, SPRITE_ATLAS);
+}
+
 void sprite_data::clear()
 {
     array.clear();
     array2.clear();
 }
 
-void sprite_data::upload()
+bool sprite_data::upload()
 {
-    array.upload(GL_DYNAMIC_DRAW);
-    array2.upload(GL_DYNAMIC_DRAW);
+    bool changed = array.upload(GL_DYNAMIC_DRAW);
+    changed = array2.upload(GL_DYNAMIC_DRAW) || changed;
+    return changed;
+}
+
+void sprite_data::draw_runs(const ::sprite::array &arr) const
+{
+    for (const auto &run : arr.runs()) {
+        glBindTexture(GL_TEXTURE_2D, sheet.texture(run.page));
+        glDrawArrays(GL_TRIANGLES, run.first, run.count);
+    }
 }
 
 void sprite_data::draw(const common_data &com)
 {
-    glUseProgram(com.sprite.prog());
-    glEnableVertexAttribArray(com.sprite->a_vert);
+    const auto &prog = com.use_sprite(sheet.texture(), sheet.palette());
+    glEnableVertexAttribArray(prog->a_vert);
     glEnable(GL_BLEND);
     glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, sheet.texture());
-
-    glUniform2fv(com.sprite->u_texscale, 1, sheet.texscale());
-    glUniform1i(com.sprite->u_texture, 0);
+    glUniform2fv(prog->u_texscale, 1, sheet.texscale());
 
     if (!array.empty()) {
-        array.set_attrib(com.sprite->a_vert);
-        glUniform4fv(com.sprite->u_vertxform, 1, com.xform_world);
-        glDrawArrays(GL_TRIANGLES, 0, array.size());
+        array.set_attrib(prog->a_vert);
+        glUniform4fv(prog->u_vertxform, 1, com.xform_world);
+        draw_runs(array);
     }
 
     if (!array2.empty()) {
-        array2.set_attrib(com.sprite->a_vert);
-        glUniform4fv(com.sprite->u_vertxform, 1, com.xform_screen);
-        glDrawArrays(GL_TRIANGLES, 0, array2.size());
+        array2.set_attrib(prog->a_vert);
+        glUniform4fv(prog->u_vertxform, 1, com.xform_screen);
+        draw_runs(array2);
     }
 
-    glDisableVertexAttribArray(com.sprite->a_vert);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisableVertexAttribArray(prog->a_vert);
     glUseProgram(0);
 
     core::check_gl_error(HERE);
 }
 
+/// Draw an array in software, one call per run of sprites.
+static void draw_soft_runs(soft::image &dest, const ::sprite::sheet &sheet,
+                           const ::sprite::array &arr, ivec offset)
+{
+    soft::quads q;
+    q.dx = offset.x;
+    q.dy = offset.y;
+    q.uscale = 1;
+    q.vscale = 1;
+    q.mode = soft::source::PREMULTIPLIED;
+    q.color = 0;
+    for (const auto &run : arr.runs()) {
+        q.vert = arr.data() + run.first;
+        q.count = run.count;
+        q.tex = &sheet.pixels(run.page);
+        soft::draw(dest, q);
+    }
+}
+
+void sprite_data::draw(soft_data &sd)
+{
+    draw_soft_runs(sd.picture, sheet, array, sd.world);
+    draw_soft_runs(sd.picture, sheet, array2, ivec::zero());
+}
+
 // ======================================================================
 
-background_data::background_data()
+background_data::background_data(bool software)
+    : bgowned(false), layertex(0), layerfbuf(0), changed(true),
+      layer_changed(true), software(software)
 { }
 
 void background_data::clear()
@@ -88,59 +194,226 @@ void background_data::clear()
     array.clear();
 }
 
-void background_data::upload()
+bool background_data::size(int *width, int *height) const
 {
-    if (bgtex.tex == 0)
-        return;
+    if (software) {
+        *width = bgimage.width;
+        *height = bgimage.height;
+    } else {
+        *width = bgtex.tex ? bgtex.iwidth : 0;
+        *height = bgtex.tex ? bgtex.iheight : 0;
+    }
+    return *width > 0 && *height > 0;
+}
+
+bool background_data::upload()
+{
+    bool was_changed = changed;
+    changed = false;
+    int width, height;
+    if (!size(&width, &height))
+        return was_changed;
 
+    // The layer is a render target, so its rows are bottom to top.
     ::sprite::rect r = {
-        0, 0,
-        bgtex.iwidth, bgtex.iheight
+        0, 0, (short)width, (short)height, 0, 0, 0, false
     };
-    array.add(r, 0, 0);
-    array.upload(GL_DYNAMIC_DRAW);
+    array.add(r, 0, 0, ::sprite::orientation::FLIP_VERTICAL);
+    if (software)
+        return was_changed;
+
+    was_changed = array.upload(GL_DYNAMIC_DRAW) || was_changed;
+    if (layer_changed) {
+        bgarray.clear();
+        bgarray.add(r, 0, 0);
+        bgarray.upload(GL_STATIC_DRAW);
+        statics.upload(GL_STATIC_DRAW);
+    }
     core::check_gl_error(HERE);
+    return was_changed;
+}
+
+void background_data::set_statics(const ::sprite::sheet &sheet,
+                                  const draw_list &list)
+{
+    statics.clear();
+    statics.add(sheet, list.data(), list.size());
+    changed = true;
+    layer_changed = true;
+}
+
+void background_data::composite(const common_data &com,
+                                const sprite_data &spr)
+{
+    layer_changed = false;
+    int width, height;
+    if (!size(&width, &height))
+        return;
+
+    if (!layertex) {
+        glGenTextures(1, &layertex);
+        glGenFramebuffers(1, &layerfbuf);
+    }
+    glBindTexture(GL_TEXTURE_2D, layertex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, layerfbuf);
+    glFramebufferTexture2D(
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, layertex, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        core::die("Cannot render to background layer");
+
+    glViewport(0, 0, width, height);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    const float xform[4] = { 2.0f / width, 2.0f / height, -1.0f, -1.0f };
+
+    // The background has straight alpha, but the layer gets
+    // premultiplied alpha, like the sprites.
+    {
+        const auto &prog = com.use_sprite(bgtex.tex, bgtex.palette);
+        glEnableVertexAttribArray(prog->a_vert);
+        glEnable(GL_BLEND);
+        glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
+                            GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        glUniform4fv(prog->u_vertxform, 1, xform);
+        glUniform2fv(prog->u_texscale, 1, bgtex.scale);
+        bgarray.set_attrib(prog->a_vert);
+        glDrawArrays(GL_TRIANGLES, 0, bgarray.size());
+        glDisableVertexAttribArray(prog->a_vert);
+    }
+
+    if (!statics.empty()) {
+        const auto &sheet = spr.sheet;
+        const auto &prog = com.use_sprite(sheet.texture(), sheet.palette());
+        glEnableVertexAttribArray(prog->a_vert);
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        glUniform4fv(prog->u_vertxform, 1, xform);
+        glUniform2fv(prog->u_texscale, 1, sheet.texscale());
+        statics.set_attrib(prog->a_vert);
+        spr.draw_runs(statics);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glDisableVertexAttribArray(prog->a_vert);
+    }
+
+    glUseProgram(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    core::check_gl_error(HERE);
+}
+
+void background_data::composite(const sprite_data &spr)
+{
+    layer_changed = false;
+    int width, height;
+    if (!size(&width, &height))
+        return;
+
+    layerimage = soft::image(width, height);
+    ::sprite::array bg;
+    ::sprite::rect r = {
+        0, 0, (short)width, (short)height, 0, 0, 0, false
+    };
+    bg.add(r, 0, 0);
+    soft::quads q;
+    q.vert = bg.data();
+    q.count = bg.size();
+    q.dx = 0;
+    q.dy = 0;
+    q.tex = &bgimage;
+    q.uscale = 1;
+    q.vscale = 1;
+    q.mode = soft::source::PREMULTIPLIED;
+    q.color = 0;
+    soft::draw(layerimage, q);
+    draw_soft_runs(layerimage, spr.sheet, statics, ivec::zero());
 }
 
 void background_data::draw(const common_data &com)
 {
-    if (bgtex.tex == 0)
+    if (!layertex || array.empty())
         return;
 
-    glUseProgram(com.sprite.prog());
-    glEnableVertexAttribArray(com.sprite->a_vert);
+    const auto &prog = com.use_sprite(layertex, 0);
+    glEnableVertexAttribArray(prog->a_vert);
     glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, bgtex.tex);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 
-    glUniform4fv(com.sprite->u_vertxform, 1, com.xform_world);
-    glUniform2fv(com.sprite->u_texscale, 1, bgtex.scale);
-    glUniform1i(com.sprite->u_texture, 0);
-    array.set_attrib(com.sprite->a_vert);
+    const float scale[2] = {
+        1.0f / bgtex.iwidth, 1.0f / bgtex.iheight
+    };
+    glUniform4fv(prog->u_vertxform, 1, com.xform_world);
+    glUniform2fv(prog->u_texscale, 1, scale);
+    array.set_attrib(prog->a_vert);
 
     glDrawArrays(GL_TRIANGLES, 0, array.size());
 
-    glDisableVertexAttribArray(com.sprite->a_vert);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisableVertexAttribArray(prog->a_vert);
     glUseProgram(0);
 
     core::check_gl_error(HERE);
 }
 
+void background_data::draw(soft_data &sd)
+{
+    if (array.empty())
+        return;
+    soft::quads q;
+    q.vert = array.data();
+    q.count = array.size();
+    q.dx = sd.world.x;
+    q.dy = sd.world.y;
+    q.tex = &layerimage;
+    q.uscale = 1;
+    q.vscale = 1;
+    q.mode = soft::source::PREMULTIPLIED;
+    q.color = 0;
+    soft::draw(sd.picture, q);
+}
+
+/// Get the path to a level's background image.
+static std::string level_image(const std::string &name)
+{
+    return "level/" + name + ".png";
+}
+
+void background_data::reset()
+{
+    if (bgowned)
+        bgtex.destroy();
+    bgtex = image::texture();
+    bgowned = false;
+    bgimage = soft::image();
+    statics.clear();
+    changed = true;
+    layer_changed = true;
+}
+
 void background_data::set_level(const std::string &name)
 {
-    if (bgtex.tex) {
-        glDeleteTextures(1, &bgtex.tex);
-        bgtex.tex = 0;
+    reset();
+    if (name.empty())
+        return;
+    std::string fullpath = level_image(name);
+    if (software) {
+        bgimage = soft::image::load(fullpath);
+    } else {
+        bgtex = image::texture::load_indexed(fullpath);
+        bgowned = true;
     }
+}
 
-    if (!name.empty()) {
-        std::string fullpath("level/");
-        fullpath += name;
-        fullpath += ".png";
-        bgtex = image::texture::load(fullpath);
-    }
+void background_data::set_image(const image::texture &tex,
+                                const soft::image &image)
+{
+    reset();
+    if (software)
+        bgimage = image;
+    else
+        bgtex = tex;
 }
 
 // ======================================================================
@@ -150,12 +423,9 @@ void selection_data::clear()
     array.clear();
 }
 
-void selection_data::upload()
+bool selection_data::upload()
 {
-    if (array.empty())
-        return;
-
-    array.upload(GL_DYNAMIC_DRAW);
+    return array.upload(GL_DYNAMIC_DRAW);
 }
 
 void selection_data::draw(const common_data &com)
@@ -182,12 +452,24 @@ void selection_data::draw(const common_data &com)
     core::check_gl_error(HERE);
 }
 
+void selection_data::draw(soft_data &sd)
+{
+    if (array.empty())
+        return;
+    soft::fill(sd.picture, array.data(), array.size(),
+               sd.world.x, sd.world.y, 0x00660066u);
+}
+
 // ======================================================================
 
-font_data::font_data()
-    : dirty(false)
+font_data::font_data(bool software)
+    : dirty(false), changed(false)
 {
-    tex = image::texture::load("font/terminus.png");
+    startup::phase phase("font");
+    if (software)
+        fontimage = soft::image::load("font/terminus.png");
+    else
+        tex = image::texture::load("font/terminus.png");
 }
 
 void font_data::clear()
@@ -198,12 +480,15 @@ void font_data::clear()
     blocks.clear();
 }
 
-void font_data::upload()
+bool font_data::upload()
 {
+    bool was_changed = changed;
+    changed = false;
     if (dirty) {
-        array.upload(GL_DYNAMIC_DRAW);
+        was_changed = array.upload(GL_DYNAMIC_DRAW) || was_changed;
         dirty = false;
     }
+    return was_changed;
 }
 
 void font_data::draw(const common_data &com)
@@ -238,6 +523,39 @@ void font_data::draw(const common_data &com)
     core::check_gl_error(HERE);
 }
 
+/// Convert a color to premultiplied ARGB.
+static unsigned soft_color(const color &c)
+{
+    static const int SHIFT[4] = { 16, 8, 0, 24 };
+    unsigned r = 0;
+    for (int i = 0; i < 4; i++) {
+        float v = c.v[i] * 255.0f + 0.5f;
+        unsigned x = v <= 0.0f ? 0 : v >= 255.0f ? 255 : (unsigned)v;
+        r |= x << SHIFT[i];
+    }
+    return r;
+}
+
+void font_data::draw(soft_data &sd)
+{
+    soft::quads q;
+    q.dx = 0;
+    q.dy = 0;
+    q.tex = &fontimage;
+    q.uscale = fontimage.width / 16;
+    q.vscale = fontimage.height / 16;
+    q.mode = soft::source::COVERAGE;
+    int pos = 0;
+    for (const auto &b : blocks) {
+        q.vert = array.data() + pos;
+        q.count = b.vertcount;
+        q.color = soft_color(b.text_color);
+        if (q.color)
+            soft::draw(sd.picture, q);
+        pos += b.vertcount;
+    }
+}
+
 int font_data::add_text(const std::string &text, int x, int y)
 {
     int xpos = x, ypos = y;
@@ -282,13 +600,19 @@ void font_data::set_color(int block, const color &text_color)
 {
     if (block < 0 || (std::size_t)block >= blocks.size())
         return;
-    blocks[block].text_color = text_color;
+    color &c = blocks[block].text_color;
+    for (int i = 0; i < 4; i++) {
+        if (c.v[i] != text_color.v[i])
+            changed = true;
+    }
+    c = text_color;
 }
 
 // ======================================================================
 
 scale_data::scale_data()
 {
+    startup::phase phase("TV");
     width = round_up_pow2(core::PWIDTH);
     height = round_up_pow2(core::PHEIGHT);
     scale[0] = 1.0f / width;
@@ -316,10 +640,33 @@ scale_data::scale_data()
         GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
     GLenum drawBuffers[1] = { GL_COLOR_ATTACHMENT0 };
     glDrawBuffers(1, drawBuffers);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
     if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
         core::die("Cannot render to framebuffer");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    output = 0;
+    outbuf = 0;
+    outwidth = 0;
+    outheight = 0;
+    view.scale = 0;
+    tvscale = 0;
+    lowtex = 0;
+    lowfbuf = 0;
+    if (offscreen_render) {
+        glGenRenderbuffers(1, &outbuf);
+        glBindRenderbuffer(GL_RENDERBUFFER, outbuf);
+        glRenderbufferStorage(
+            GL_RENDERBUFFER, GL_RGBA8, core::IWIDTH, core::IHEIGHT);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glGenFramebuffers(1, &output);
+        glBindFramebuffer(GL_FRAMEBUFFER, output);
+        glFramebufferRenderbuffer(
+            GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, outbuf);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+            GL_FRAMEBUFFER_COMPLETE)
+            core::die("Cannot render to offscreen framebuffer");
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
 
     float (*data)[4] = array.insert(6);
     float u = (float) core::PWIDTH, v = (float) core::PHEIGHT;
@@ -335,9 +682,188 @@ scale_data::scale_data()
     texbanding = image::texture::load_1d("tv/banding.png");
     texnoise = image::texture::load("tv/noise.png");
 
+    int w, h;
+    core::output_size(&w, &h);
+    set_output(w, h);
+    auto_quality = tv_setting == tv_quality::AUTO;
+    set_quality(auto_quality ? tv_quality::FULL : tv_setting);
+
     core::check_gl_error(HERE);
 }
 
+static const char *const TV_QUALITY_NAMES[] = {
+    "auto", "full", "fast", "blit"
+};
+
+// GPU time budget for the TV pass, and the number of frames to average.
+static const double TV_BUDGET_MS = 2.0;
+static const int TV_SAMPLES = 120;
+// The TV scale is not lowered below this, since the effect's pattern
+// needs a few pixels per picture pixel.  It is raised again only if
+// the estimated time at the higher scale is within this part of the
+// budget, so it does not flip back and forth.
+static const int MIN_TV_SCALE = 2;
+static const double TV_HEADROOM = 0.75;
+
+/// Whether framebuffers can be blitted.
+static bool have_blit()
+{
+#if defined USE_GLEW
+    return GLEW_ARB_framebuffer_object != 0;
+#else
+    return true;
+#endif
+}
+
+bool scale_data::set_output(int width, int height)
+{
+    if (width == outwidth && height == outheight)
+        return false;
+    outwidth = width;
+    outheight = height;
+    int oldscale = view.scale;
+    view = core::get_viewport(width, height);
+    if (view.scale != oldscale)
+        set_tv_scale(view.scale);
+    return true;
+}
+
+void scale_data::set_quality(tv_quality q)
+{
+    if (q == tv_quality::BLIT && !have_blit())
+        q = tv_quality::FAST;
+    if (q == tv_quality::FAST && !texlut.tex)
+        init_fast();
+    quality = q;
+    timer.reset();
+}
+
+void scale_data::set_tv_scale(int s)
+{
+    tvscale = s;
+    timer.reset();
+    if (s == view.scale)
+        return;
+
+    if (!lowtex) {
+        glGenTextures(1, &lowtex);
+        glGenFramebuffers(1, &lowfbuf);
+    }
+    glBindTexture(GL_TEXTURE_2D, lowtex);
+    glTexImage2D(
+        GL_TEXTURE_2D,
+        0,
+        GL_RGBA,
+        core::PWIDTH * s,
+        core::PHEIGHT * s,
+        0,
+        GL_RGBA,
+        GL_UNSIGNED_BYTE,
+        nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, lowfbuf);
+    glFramebufferTexture2D(
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, lowtex, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        core::die("Cannot render to framebuffer");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    core::check_gl_error(HERE);
+}
+
+void scale_data::init_fast()
+{
+    int pw, ph, nw, nh, bw, bh;
+    std::vector<unsigned> pattern =
+        image::load_pixels("tv/pattern.png", &pw, &ph);
+    std::vector<unsigned> noise =
+        image::load_pixels("tv/noise.png", &nw, &nh);
+    std::vector<unsigned> banding =
+        image::load_pixels("tv/banding.png", &bw, &bh);
+
+    // Pattern in RGB, vignette in alpha, one texel per output pixel.
+    const int lw = core::IWIDTH, lh = core::IHEIGHT;
+    const float cx = 0.5f * core::PWIDTH, cy = 0.5f * core::PHEIGHT;
+    const float vscale = 1.0f / (cx * cx + cy * cy);
+    std::vector<unsigned> lut(lw * lh);
+    for (int y = 0; y < lh; y++) {
+        float vy = (y + 0.5f) * (1.0f / core::SCALE);
+        int py = (int)((vy * 0.25f - std::floor(vy * 0.25f)) * ph);
+        for (int x = 0; x < lw; x++) {
+            float vx = (x + 0.5f) * (1.0f / core::SCALE);
+            int px = (int)((vx * 0.25f - std::floor(vx * 0.25f)) * pw);
+            float d = ((vx - cx) * (vx - cx) + (vy - cy) * (vy - cy)) *
+                vscale;
+            d = d * d;
+            unsigned a = (unsigned)(d * 255.0f + 0.5f);
+            if (a > 255)
+                a = 255;
+            lut[y * lw + x] = (pattern[py * pw + px] & 0xffffffu) | (a << 24);
+        }
+    }
+    texlut = image::texture::create(lw, lh, lut.data());
+
+    // Noise, pre-scaled, in RGB, and banding in alpha, one texel per
+    // picture pixel.  The banding is averaged to gray.
+    std::vector<unsigned> grain(nw * bw);
+    for (int y = 0; y < bw; y++) {
+        unsigned b = banding[y];
+        unsigned band = ((b >> 16 & 255) + (b >> 8 & 255) + (b & 255)) / 3;
+        unsigned a = (band + 256) >> 1;
+        for (int x = 0; x < nw; x++) {
+            unsigned n = noise[(y % nh) * nw + x], c = a << 24;
+            for (int i = 0; i < 24; i += 8)
+                c |= (((n >> i & 255) + 8) >> 4) << i;
+            grain[y * nw + x] = c;
+        }
+    }
+    texgrain = image::texture::create(nw, bw, grain.data());
+    glBindTexture(GL_TEXTURE_2D, texgrain.tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void scale_data::update_quality()
+{
+    timer.poll();
+    if (timer.samples() < TV_SAMPLES)
+        return;
+    double ms = timer.average_ms();
+    timer.reset();
+    if (!auto_quality || quality == tv_quality::BLIT)
+        return;
+
+    if (ms <= TV_BUDGET_MS) {
+        // The TV pass time is roughly proportional to the pixel count.
+        if (tvscale >= view.scale)
+            return;
+        double r = (double)(tvscale + 1) / tvscale;
+        if (ms * r * r > TV_BUDGET_MS * TV_HEADROOM)
+            return;
+        set_tv_scale(tvscale + 1);
+        std::fprintf(stderr, "TV pass took %.2f ms, raising scale to %d\n",
+                     ms, tvscale);
+        return;
+    }
+
+    // Drop the resolution before dropping the effect.
+    if (tvscale > MIN_TV_SCALE && have_blit()) {
+        set_tv_scale(tvscale - 1);
+        std::fprintf(stderr, "TV pass took %.2f ms, lowering scale to %d\n",
+                     ms, tvscale);
+        return;
+    }
+    tv_quality q = quality == tv_quality::FULL ?
+        tv_quality::FAST : tv_quality::BLIT;
+    set_quality(q);
+    std::fprintf(stderr, "TV pass took %.2f ms, switching to %s\n",
+                 ms, TV_QUALITY_NAMES[static_cast<int>(quality)]);
+}
+
 void scale_data::begin()
 {
     glBindFramebuffer(GL_FRAMEBUFFER, fbuf);
@@ -360,83 +886,393 @@ void scale_data::end(const common_data &com)
         (float)((x >> 24) & 255)
     };
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glViewport(0, 0, core::IWIDTH, core::IHEIGHT);
-    glClearColor(1.0f, 0.0f, 1.0f, 0.0f);
-    glClear(GL_COLOR_BUFFER_BIT);
+    update_quality();
+    timer.begin();
+
+    // Black bars around the picture.
+    glBindFramebuffer(GL_FRAMEBUFFER, output);
+    if (view.width != outwidth || view.height != outheight) {
+        glViewport(0, 0, outwidth, outheight);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+
+    if (quality == tv_quality::BLIT) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbuf);
+        glBlitFramebuffer(
+            0, 0, core::PWIDTH, core::PHEIGHT,
+            view.x, view.y, view.x + view.width, view.y + view.height,
+            GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        timer.end();
+
+        core::check_gl_error(HERE);
+        return;
+    }
 
-    glUseProgram(com.tv.prog());
-    glEnableVertexAttribArray(com.tv->a_vert);
+    bool fast = quality == tv_quality::FAST;
+    const auto &prog = fast ? com.tv_fast : com.tv;
+    bool low = tvscale != view.scale;
+
+    if (low) {
+        glBindFramebuffer(GL_FRAMEBUFFER, lowfbuf);
+        glViewport(0, 0, core::PWIDTH * tvscale, core::PHEIGHT * tvscale);
+    } else {
+        glViewport(view.x, view.y, view.width, view.height);
+    }
+
+    glUseProgram(prog.prog());
+    glEnableVertexAttribArray(prog->a_vert);
     glDisable(GL_BLEND);
 
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, tex);
     glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, texpattern.tex);
+    glBindTexture(GL_TEXTURE_2D, fast ? texlut.tex : texpattern.tex);
     glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_1D, texbanding.tex);
+    glBindTexture(GL_TEXTURE_1D, fast ? 0 : texbanding.tex);
     glActiveTexture(GL_TEXTURE3);
-    glBindTexture(GL_TEXTURE_2D, texnoise.tex);
+    glBindTexture(GL_TEXTURE_2D, fast ? texgrain.tex : texnoise.tex);
 
-    glUniform1i(com.tv->u_picture, 0);
-    glUniform1i(com.tv->u_pattern, 1);
-    glUniform1i(com.tv->u_banding, 2);
-    glUniform1i(com.tv->u_noise, 3);
-    glUniform4fv(com.tv->u_noiseoffset, 1, offsets);
-    glUniform2fv(com.tv->u_texscale, 1, scale);
-    glUniform4fv(com.tv->u_color, 1, blend_color.v);
-    array.set_attrib(com.tv->a_vert);
+    glUniform1i(prog->u_picture, 0);
+    glUniform1i(prog->u_pattern, 1);
+    glUniform1i(prog->u_banding, 2);
+    glUniform1i(prog->u_noise, 3);
+    glUniform4fv(prog->u_noiseoffset, 1, offsets);
+    glUniform2fv(prog->u_texscale, 1, scale);
+    glUniform4fv(prog->u_color, 1, blend_color.v);
+    array.set_attrib(prog->a_vert);
 
     glDrawArrays(GL_TRIANGLES, 0, array.size());
 
-    glDisableVertexAttribArray(com.tv->a_vert);
+    glDisableVertexAttribArray(prog->a_vert);
     glUseProgram(0);
+    glActiveTexture(GL_TEXTURE0);
+
+    if (low) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, lowfbuf);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output);
+        glBlitFramebuffer(
+            0, 0, core::PWIDTH * tvscale, core::PHEIGHT * tvscale,
+            view.x, view.y, view.x + view.width, view.y + view.height,
+            GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    timer.end();
 
     core::check_gl_error(HERE);
 }
 
 // ======================================================================
 
-system::system()
-    : camera_(ivec::zero())
+soft_data::soft_data()
+    : picture(core::PWIDTH, core::PHEIGHT),
+      pattern(soft::image::load("tv/pattern.png")),
+      banding(soft::image::load("tv/banding.png")),
+      noise(soft::image::load("tv/noise.png")),
+      blend_color(color::transparent()),
+      tv(tv_setting == tv_quality::FULL || tv_setting == tv_quality::FAST),
+      world(ivec::zero())
 { }
 
+void soft_data::begin(ivec camera)
+{
+    soft::clear(picture, soft_color(color::palette(0)));
+    world = ivec::zero() - camera;
+}
+
+void soft_data::end()
+{
+    if (!tv)
+        return;
+    unsigned x = rng::global.next();
+    soft::tv_params params;
+    params.pattern = &pattern;
+    params.banding = &banding;
+    params.noise = &noise;
+    for (int i = 0; i < 4; i++) {
+        params.noiseoffset[i] = (float)((x >> (i * 8)) & 255);
+        params.color[i] = blend_color.v[i];
+    }
+    soft::tv(output, picture, core::SCALE, params);
+}
+
+// ======================================================================
+
+static const char *const PASS_NAMES[pass_profile::COUNT] = {
+    "clear", "background", "selection", "sprites", "text", "tv"
+};
+
+// Number of frames between reports.
+static const int PROFILE_FRAMES = 600;
+
+pass_profile::pass_profile(const gpu::timer &tv_timer)
+    : tv_timer_(tv_timer), frames_(0)
+{
+    for (int i = 0; i < COUNT; i++) {
+        cpu_ms_[i] = 0.0;
+        cpu_samples_[i] = 0;
+        gpu_ms_[i] = 0.0;
+        gpu_samples_[i] = 0;
+    }
+    if (!gpu::timer::available())
+        std::fputs("Timer queries are not available, "
+                   "only CPU times will be reported\n", stderr);
+}
+
+pass_profile::~pass_profile()
+{
+    if (frames_ > 0)
+        report();
+}
+
+const gpu::timer &pass_profile::timer(int pass) const
+{
+    return pass == TV ? tv_timer_ : timers_[pass];
+}
+
+void pass_profile::begin(int pass)
+{
+    if (pass != TV)
+        timers_[pass].begin();
+    start_ = clock::now();
+}
+
+void pass_profile::end(int pass)
+{
+    cpu_ms_[pass] += std::chrono::duration<double, std::milli>(
+        clock::now() - start_).count();
+    cpu_samples_[pass]++;
+    if (pass != TV)
+        timers_[pass].end();
+}
+
+void pass_profile::end_frame()
+{
+    for (int i = 0; i < TV; i++)
+        timers_[i].poll();
+    if (++frames_ >= PROFILE_FRAMES)
+        report();
+}
+
+void pass_profile::report()
+{
+    std::fprintf(stderr, "Render passes over %d frames, ms per pass:\n"
+                 "%-12s %8s %8s\n", frames_, "pass", "CPU", "GPU");
+    double cpu_total = 0.0, gpu_total = 0.0;
+    for (int i = 0; i < COUNT; i++) {
+        const gpu::timer &t = timer(i);
+        double cpu = cpu_samples_[i] ? cpu_ms_[i] / cpu_samples_[i] : 0.0;
+        long samples = t.lifetime_samples() - gpu_samples_[i];
+        cpu_total += cpu;
+        if (samples > 0) {
+            double gpu = (t.lifetime_ms() - gpu_ms_[i]) / samples;
+            gpu_total += gpu;
+            std::fprintf(stderr, "%-12s %8.3f %8.3f\n",
+                         PASS_NAMES[i], cpu, gpu);
+        } else {
+            std::fprintf(stderr, "%-12s %8.3f %8s\n",
+                         PASS_NAMES[i], cpu, "-");
+        }
+        cpu_ms_[i] = 0.0;
+        cpu_samples_[i] = 0;
+        gpu_ms_[i] = t.lifetime_ms();
+        gpu_samples_[i] = t.lifetime_samples();
+    }
+    std::fprintf(stderr, "%-12s %8.3f %8.3f\n",
+                 "total", cpu_total, gpu_total);
+    frames_ = 0;
+}
+
+// ======================================================================
+
+system::system()
+    : common_(load_common()),
+      camera_(ivec::zero()),
+      sprite_(software_render),
+      background_(software_render),
+      font_(software_render),
+      scale_(software_render ? nullptr : new scale_data),
+      soft_(software_render ? new soft_data : nullptr),
+      drawn_camera_(ivec::zero()), changed_(true),
+      frame_count_(0), scene_count_(0), present_count_(0)
+{
+    if (profile_passes && !software_render)
+        profile_.reset(new pass_profile(scale_->timer));
+    if (!capture_path.empty()) {
+        if (software_render) {
+            std::fputs("Warning: cannot capture software rendering, "
+                       "use --dump\n", stderr);
+        } else if (capture_output) {
+            recorder_.reset(new capture::recorder(
+                capture_path, core::IWIDTH, core::IHEIGHT));
+        } else {
+            recorder_.reset(new capture::recorder(
+                capture_path, core::PWIDTH, core::PHEIGHT));
+        }
+    }
+}
+
 system::~system()
-{ }
+{
+    if (frame_count_ > 0) {
+        std::fprintf(
+            stderr, "Frames: %d, scene redrawn: %d, presented: %d\n",
+            frame_count_, scene_count_, present_count_);
+    }
+}
 
 void system::begin()
 {
     sprite_.clear();
     background_.clear();
     selection_.clear();
-    scale_.blend_color = color::transparent();
+    if (soft_)
+        soft_->blend_color = color::transparent();
+    else
+        scale_->blend_color = color::transparent();
 }
 
 void system::end()
 {
-    sprite_.upload();
-    background_.upload();
-    selection_.upload();
-    font_.upload();
+    if (soft_) {
+        // Software rendering has no buffers, and redraws every frame.
+        background_.upload();
+        changed_ = true;
+        return;
+    }
+
+    bool changed = sprite_.upload();
+    changed = background_.upload() || changed;
+    changed = selection_.upload() || changed;
+    changed = font_.upload() || changed;
+    if (changed || camera_ != drawn_camera_)
+        changed_ = true;
 }
 
-void system::draw()
+bool system::draw()
 {
-    common_.xform_world[0] = 2.0 / core::PWIDTH;
-    common_.xform_world[1] = 2.0 / core::PHEIGHT;
-    common_.xform_world[2] = camera_.x * (-2.0 / core::PWIDTH);
-    common_.xform_world[3] = camera_.y * (-2.0 / core::PHEIGHT);
-    common_.xform_screen[0] = 2.0 / core::PWIDTH;
-    common_.xform_screen[1] = 2.0 / core::PHEIGHT;
-    common_.xform_screen[2] = -1.0f;
-    common_.xform_screen[3] = -1.0f;
+    frame_count_++;
+
+    if (soft_) {
+        if (background_.layer_changed)
+            background_.composite(sprite_);
+        soft_->begin(camera_);
+        background_.draw(*soft_);
+        selection_.draw(*soft_);
+        sprite_.draw(*soft_);
+        font_.draw(*soft_);
+        soft_->end();
+        changed_ = false;
+        scene_count_++;
+        present_count_++;
+        return true;
+    }
 
-    scale_.begin();
-    background_.draw(common_);
-    selection_.draw(common_);
-    sprite_.draw(common_);
-    font_.draw(common_);
-    scale_.end(common_);
+    // The blit has no noise, so with an unchanged scene the output is
+    // unchanged too.  Recordings need every frame.
+    int outwidth, outheight;
+    core::output_size(&outwidth, &outheight);
+    if (scale_->set_output(outwidth, outheight))
+        changed_ = true;
+    if (!changed_ && scale_->quality == tv_quality::BLIT && !recorder_)
+        return false;
+
+    if (!changed_) {
+        begin_pass(pass_profile::TV, HERE);
+        scale_->end(*common_);
+        end_pass(pass_profile::TV);
+        capture();
+        if (profile_)
+            profile_->end_frame();
+        present_count_++;
+        return true;
+    }
+
+    common_->xform_world[0] = 2.0 / core::PWIDTH;
+    common_->xform_world[1] = 2.0 / core::PHEIGHT;
+    common_->xform_world[2] = camera_.x * (-2.0 / core::PWIDTH);
+    common_->xform_world[3] = camera_.y * (-2.0 / core::PHEIGHT);
+    common_->xform_screen[0] = 2.0 / core::PWIDTH;
+    common_->xform_screen[1] = 2.0 / core::PHEIGHT;
+    common_->xform_screen[2] = -1.0f;
+    common_->xform_screen[3] = -1.0f;
+
+    if (background_.layer_changed) {
+        core::push_gl_group("layer", HERE);
+        background_.composite(*common_, sprite_);
+        core::pop_gl_group();
+    }
+
+    begin_pass(pass_profile::CLEAR, HERE);
+    scale_->begin();
+    end_pass(pass_profile::CLEAR);
+    begin_pass(pass_profile::BACKGROUND, HERE);
+    background_.draw(*common_);
+    end_pass(pass_profile::BACKGROUND);
+    begin_pass(pass_profile::SELECTION, HERE);
+    selection_.draw(*common_);
+    end_pass(pass_profile::SELECTION);
+    begin_pass(pass_profile::SPRITES, HERE);
+    sprite_.draw(*common_);
+    end_pass(pass_profile::SPRITES);
+    begin_pass(pass_profile::TEXT, HERE);
+    font_.draw(*common_);
+    end_pass(pass_profile::TEXT);
+    begin_pass(pass_profile::TV, HERE);
+    scale_->end(*common_);
+    end_pass(pass_profile::TV);
+    capture();
+    if (profile_)
+        profile_->end_frame();
+
+    drawn_camera_ = camera_;
+    changed_ = false;
+    scene_count_++;
+    present_count_++;
+    return true;
+}
+
+void system::invalidate()
+{
+    changed_ = true;
+}
+
+void system::begin_pass(int pass, const char *file, int line)
+{
+    core::push_gl_group(PASS_NAMES[pass], file, line);
+    if (profile_)
+        profile_->begin(pass);
+}
+
+void system::end_pass(int pass)
+{
+    if (profile_)
+        profile_->end(pass);
+    core::pop_gl_group();
+}
+
+void system::capture()
+{
+    if (recorder_)
+        recorder_->capture(capture_output ? scale_->output : scale_->fbuf);
+}
+
+const soft::image *system::frame() const
+{
+    if (soft_)
+        return &soft_->frame();
+    if (!offscreen_render)
+        return nullptr;
+    if (readback_.width != core::IWIDTH || readback_.height != core::IHEIGHT)
+        readback_ = soft::image(core::IWIDTH, core::IHEIGHT);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, scale_->output);
+    glReadPixels(0, 0, core::IWIDTH, core::IHEIGHT,
+                 GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV,
+                 readback_.pixels.data());
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    core::check_gl_error(HERE);
+    return &readback_;
 }
 
 void system::set_level(const std::string &path)
@@ -444,6 +1280,23 @@ void system::set_level(const std::string &path)
     background_.set_level(path);
 }
 
+void system::set_level(const image::texture &tex,
+                       const soft::image &image)
+{
+    background_.set_image(tex, image);
+}
+
+void system::preload_level(const std::string &path)
+{
+    if (!path.empty())
+        image::preload(level_image(path), !software_render);
+}
+
+void system::set_static_sprites(const draw_list &list)
+{
+    background_.set_statics(sprite_.sheet, list);
+}
+
 void system::add_sprite(anysprite sp, ivec pos,
                         ::sprite::orientation orient,
                         bool screen_relative)
@@ -454,6 +1307,13 @@ void system::add_sprite(anysprite sp, ivec pos,
         pos.x, pos.y, orient);
 }
 
+void system::add_sprites(const ::sprite::instance *sprites,
+                         std::size_t count, bool screen_relative)
+{
+    auto &arr = screen_relative ? sprite_.array2 : sprite_.array;
+    arr.add(sprite_.sheet, sprites, count);
+}
+
 void system::set_camera_pos(ivec target)
 {
     camera_ = target;
@@ -473,7 +1333,10 @@ void system::set_selection(const irect &rect)
 
 void system::set_blend_color(const color &blend_color)
 {
-    scale_.blend_color = blend_color;
+    if (soft_)
+        soft_->blend_color = blend_color;
+    else
+        scale_->blend_color = blend_color;
 }
 
 void system::clear_text()
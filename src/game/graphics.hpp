@@ -3,20 +3,82 @@
    of the 2-clause BSD license.  For more information, see LICENSE.txt. */
 #ifndef LD_GAME_GRAPHICS_HPP
 #define LD_GAME_GRAPHICS_HPP
+#include <chrono>
 #include <memory>
 #include "base/sprite.hpp"
 #include "base/shader.hpp"
 #include "base/image.hpp"
+#include "base/capture.hpp"
+#include "base/defs.hpp"
+#include "base/gpu_timer.hpp"
+#include "base/soft.hpp"
 #include "sprite.hpp"
 #include "base/vec.hpp"
 #include "color.hpp"
+#include "draw_list.hpp"
 namespace graphics {
 class state;
 
+/// Quality tiers for the TV effect pass.
+enum class tv_quality {
+    /// Choose a tier from the measured GPU time.
+    AUTO,
+    /// The full CRT effect.
+    FULL,
+    /// The CRT effect using precomposited lookup textures.
+    FAST,
+    /// A nearest-neighbor upscale, without the effect.
+    BLIT
+};
+
+/// The TV quality requested at startup.
+extern tv_quality tv_setting;
+
+/// Whether to render on the CPU instead of with OpenGL.
+extern bool software_render;
+
+/// Whether the OpenGL context has no window, so the output goes to a
+/// framebuffer object.
+extern bool offscreen_render;
+
+/// Where to record frames, or empty to not record.  See
+/// capture::recorder.
+extern std::string capture_path;
+
+/// Whether to record the final output instead of the picture.
+extern bool capture_output;
+
+/// Whether to measure and report the time spent in each render pass.
+extern bool profile_passes;
+
+/// Software rendering data.
+struct soft_data {
+    /// The picture, at native resolution.
+    soft::image picture;
+    /// The picture scaled up with the TV effect.
+    soft::image output;
+    soft::image pattern;
+    soft::image banding;
+    soft::image noise;
+    color blend_color;
+    /// Whether to apply the TV effect, for FULL or FAST quality.
+    bool tv;
+    /// Offset from world coordinates to picture coordinates.
+    ivec world;
+
+    soft_data();
+    void begin(ivec camera);
+    void end();
+    /// Get the finished frame.
+    const soft::image &frame() const { return tv ? output : picture; }
+};
+
 /// The shader commons.
 struct common_data {
     shader::program<shader::sprite> sprite;
+    shader::program<shader::sprite> sprite_index;
     shader::program<shader::tv> tv;
+    shader::program<shader::tv> tv_fast;
     shader::program<shader::plain> plain;
     shader::program<shader::text> text;
 
@@ -25,6 +87,10 @@ struct common_data {
     float xform_screen[4];
 
     common_data();
+    /// Bind a sprite program for a texture, and return it.  Indexed
+    /// textures have their palette bound to texture unit 1.
+    const shader::program<shader::sprite> &use_sprite(
+        GLuint texture, GLuint palette) const;
 };
 
 /// The foreground sprites.
@@ -33,22 +99,63 @@ struct sprite_data {
     ::sprite::array array;
     ::sprite::array array2;
 
-    sprite_data();
+    explicit sprite_data(bool software);
     void clear();
-    void upload();
+    bool upload();
     void draw(const common_data &com);
+    void draw(soft_data &sd);
+    /// Draw an array, one call per run of sprites on the same page.
+    void draw_runs(const ::sprite::array &arr) const;
+
+    /// Write the prebuilt sprite atlas, so startup can skip packing.
+    static void build_atlas();
 };
 
-/// The level background.
+/// The level background, composited with the static sprites into a
+/// layer.  The layer is only redrawn when the level or the static
+/// sprites change.
 struct background_data {
     image::texture bgtex;
+    /// Whether bgtex is deleted with the level, rather than belonging
+    /// to the level cache.
+    bool bgowned;
+    /// The background pixels, for software rendering.
+    soft::image bgimage;
+    /// Quad for drawing the layer.
     ::sprite::array array;
+    /// Quad for drawing the background into the layer.
+    ::sprite::array bgarray;
+    /// Sprites which are drawn into the layer.
+    ::sprite::array statics;
+    /// The layer texture and framebuffer.
+    GLuint layertex;
+    GLuint layerfbuf;
+    /// The layer, for software rendering.
+    soft::image layerimage;
+    /// Whether the level changed since the last upload.
+    bool changed;
+    /// Whether the layer must be composited again.
+    bool layer_changed;
+    bool software;
 
-    background_data();
+    explicit background_data(bool software);
     void clear();
-    void upload();
+    /// Get the size of the background, return false if there is none.
+    bool size(int *width, int *height) const;
+    bool upload();
+    /// Set the sprites which are drawn into the layer.
+    void set_statics(const ::sprite::sheet &sheet, const draw_list &list);
+    /// Draw the background and static sprites into the layer.
+    void composite(const common_data &com, const sprite_data &spr);
+    void composite(const sprite_data &spr);
     void draw(const common_data &com);
+    void draw(soft_data &sd);
+    /// Remove the background.
+    void reset();
     void set_level(const std::string &name);
+    /// Set the background to a texture owned by the caller, or to a copy
+    /// of an image in software.
+    void set_image(const image::texture &tex, const soft::image &image);
 };
 
 /// Editor selection data.
@@ -56,8 +163,9 @@ struct selection_data {
     array::array<short[2]> array;
 
     void clear();
-    void upload();
+    bool upload();
     void draw(const common_data &com);
+    void draw(soft_data &sd);
 };
 
 /// Font rendering data.
@@ -68,14 +176,19 @@ struct font_data {
     };
 
     image::texture tex;
+    /// The font pixels, for software rendering.
+    soft::image fontimage;
     array::array<short[4]> array;
     bool dirty;
+    /// Whether a block color changed since the last upload.
+    bool changed;
     std::vector<block> blocks;
 
-    font_data();
+    explicit font_data(bool software);
     void clear();
-    void upload();
+    bool upload();
     void draw(const common_data &com);
+    void draw(soft_data &sd);
     int add_text(const std::string &text, int x, int y);
     void set_color(int block, const color &text_color);
 };
@@ -84,6 +197,21 @@ struct font_data {
 struct scale_data {
     GLuint tex;
     GLuint fbuf;
+    /// Framebuffer for the final output, 0 unless offscreen.
+    GLuint output;
+    /// Color buffer for the offscreen output.
+    GLuint outbuf;
+    /// Size of the output in pixels.
+    int outwidth, outheight;
+    /// Where the picture goes in the output.
+    core::viewport view;
+    /// Scale for the TV pass, at most view.scale.  When it is lower,
+    /// the TV pass renders to a smaller framebuffer which is stretched
+    /// to fill the viewport.
+    int tvscale;
+    /// Texture and framebuffer for a TV pass at a lower scale.
+    GLuint lowtex;
+    GLuint lowfbuf;
     array::array<float[4]> array;
     int width, height;
     image::texture texpattern;
@@ -92,21 +220,107 @@ struct scale_data {
     float scale[2];
     color blend_color;
 
+    /// Current quality tier, never AUTO.
+    tv_quality quality;
+    /// Whether to lower the quality when the pass is too slow.
+    bool auto_quality;
+    /// Timer for the TV pass.
+    gpu::timer timer;
+    /// Pattern and vignette lookup texture, for FAST.
+    image::texture texlut;
+    /// Noise and banding texture, for FAST.
+    image::texture texgrain;
+
     scale_data();
     void begin();
     void end(const common_data &com);
+    /// Set the size of the output, returning true if it changed.
+    bool set_output(int width, int height);
+    /// Switch to a quality tier.
+    void set_quality(tv_quality q);
+    /// Set the scale for the TV pass.
+    void set_tv_scale(int s);
+    /// Create the lookup textures for the FAST tier.
+    void init_fast();
+    /// Lower the TV scale or the quality if the measured pass time is
+    /// over budget, and raise the TV scale if there is room.
+    void update_quality();
+};
+
+/// CPU and GPU time spent in each render pass.  CPU time is the time
+/// spent submitting commands.  GPU time is measured with timer queries,
+/// and is left out if they are not supported.
+class pass_profile {
+public:
+    enum { CLEAR, BACKGROUND, SELECTION, SPRITES, TEXT, TV, COUNT };
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    /// GPU timers for each pass.  The TV pass is timed by scale_data,
+    /// since timer queries cannot nest.
+    gpu::timer timers_[TV];
+    const gpu::timer &tv_timer_;
+    clock::time_point start_;
+    double cpu_ms_[COUNT];
+    int cpu_samples_[COUNT];
+    /// GPU lifetime totals at the last report.
+    double gpu_ms_[COUNT];
+    long gpu_samples_[COUNT];
+    int frames_;
+
+    const gpu::timer &timer(int pass) const;
+
+public:
+    explicit pass_profile(const gpu::timer &tv_timer);
+    pass_profile(const pass_profile &) = delete;
+    ~pass_profile();
+    pass_profile &operator=(const pass_profile &) = delete;
+
+    /// Start timing a pass.
+    void begin(int pass);
+    /// Stop timing a pass.
+    void end(int pass);
+    /// Finish a frame, reporting the times every so often.
+    void end_frame();
+    /// Report the average times since the last report.
+    void report();
 };
 
 /// The graphics system.
 class system {
 private:
-    common_data common_;
+    /// OpenGL data, or null when rendering in software.
+    std::unique_ptr<common_data> common_;
     ivec camera_;
     sprite_data sprite_;
     background_data background_;
     selection_data selection_;
     font_data font_;
-    scale_data scale_;
+    std::unique_ptr<scale_data> scale_;
+    /// Software rendering data, or null when rendering with OpenGL.
+    std::unique_ptr<soft_data> soft_;
+    /// Frame recorder, or null.
+    std::unique_ptr<capture::recorder> recorder_;
+    /// Render pass timing, or null.
+    std::unique_ptr<pass_profile> profile_;
+    /// Camera position of the last drawn scene.
+    ivec drawn_camera_;
+    /// Whether the scene changed since it was last drawn.
+    bool changed_;
+    /// Frame counts, for reporting how often the scene is redrawn.
+    int frame_count_;
+    int scene_count_;
+    int present_count_;
+    /// The last offscreen frame, read back by frame().
+    mutable soft::image readback_;
+
+    /// Record the frame, if recording.
+    void capture();
+    /// Start and stop a render pass.  Each pass is an OpenGL debug
+    /// group, and is timed if profiling.
+    void begin_pass(int pass, const char *file, int line);
+    void end_pass(int pass);
 
 public:
     system();
@@ -116,14 +330,37 @@ public:
     void begin();
     /// End updates to the graphics data.
     void end();
-    /// Draw the world, at a time relative to the last update.
-    void draw();
+    /// Draw the world, at a time relative to the last update.  The scene
+    /// is only redrawn if it changed.  Returns false if the output is
+    /// unchanged and the window does not need to be swapped.
+    bool draw();
+    /// Force the next frame to be drawn, e.g. after the window is exposed.
+    void invalidate();
+    /// Get the last frame drawn in software, or read back the last
+    /// offscreen frame.  Returns null when drawing to a window.
+    const soft::image *frame() const;
     /// Set the current level.
     void set_level(const std::string &path);
+    /// Set the current level, with its background already loaded.  The
+    /// texture must outlive the level.
+    void set_level(const image::texture &tex, const soft::image &image);
+    /// Start decoding a level's image on the loader threads, so a
+    /// following set_level does not have to wait for all of it.
+    void preload_level(const std::string &path);
+    /// Set the sprites which never move, and are composited with the
+    /// level background instead of being drawn every frame.
+    void set_static_sprites(const draw_list &list);
     /// Add a sprite to the screen.
     void add_sprite(anysprite sp, ivec pos,
                     ::sprite::orientation orient,
                     bool screen_relative=false);
+    /// Add a batch of sprites to the screen.  The sprite indexes are
+    /// anysprite values.
+    void add_sprites(const ::sprite::instance *sprites, std::size_t count,
+                     bool screen_relative=false);
+    /// Add the sprites in a draw list to the screen.
+    void add_sprites(const draw_list &list, bool screen_relative=false)
+    { add_sprites(list.data(), list.size(), screen_relative); }
     /// Set the camera target.
     void set_camera_pos(ivec target);
     /// Set the editor's selection.
@@ -0,0 +1,168 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include "levelcache.hpp"
+#include "graphics.hpp"
+#include "base/loader.hpp"
+namespace game {
+
+level_cache::level_cache()
+    : bytes_(0), source_(source::LOADED), decodes_(0), compiled_(0)
+{
+    for (auto &c : counts_)
+        c = 0;
+}
+
+level_cache::~level_cache()
+{
+    for (auto &r : resident_)
+        r.files.texture.destroy();
+}
+
+void level_cache::start(const std::string &name)
+{
+    if (pending_.size() >= CAPACITY)
+        pending_.pop_front();
+    pending p;
+    p.name = name;
+    if (p.compiled.open(name)) {
+        pending_.push_back(std::move(p));
+        compiled_++;
+        return;
+    }
+
+    std::string path = "level/" + name + ".png";
+    bool indexed = !::graphics::software_render;
+    p.image = loader::submit([name, path, indexed]() {
+        decoded_level d;
+        d.background = image::decoded::decode(path, indexed);
+        d.map = level_mask(name, d.background);
+        return d;
+    });
+    p.spawns = loader::submit([name]() {
+        return leveldata::read_level(name);
+    });
+    pending_.push_back(std::move(p));
+    decodes_++;
+}
+
+void level_cache::add(pending &p)
+{
+    resident r;
+    r.name = p.name;
+    decoded_level d;
+    int width, height, ncolors;
+    const unsigned *argb, *palette;
+    const unsigned char *indexes;
+    if (p.compiled.is_open()) {
+        const compiled_level &c = p.compiled;
+        r.files.map = c.mask();
+        r.files.spawns = c.spawns();
+        // The mask keeps the whole file alive.
+        r.bytes = c.size();
+        width = c.width();
+        height = c.height();
+        ncolors = c.ncolors();
+        argb = c.argb();
+        palette = c.palette();
+        indexes = c.indexes();
+    } else {
+        d = p.image.get();
+        r.files.map = d.map;
+        r.files.spawns = p.spawns.get();
+        r.bytes = d.map.rowbytes * d.map.height;
+        const image::decoded &bg = d.background;
+        width = bg.width;
+        height = bg.height;
+        ncolors = bg.palette.size();
+        argb = bg.argb.data();
+        palette = bg.palette.data();
+        indexes = bg.indexes.data();
+    }
+
+    if (::graphics::software_render) {
+        std::vector<unsigned> pixels;
+        if (ncolors) {
+            pixels.resize(width * height);
+            for (int i = 0; i < width * height; i++)
+                pixels[i] = indexes[i] < ncolors ? palette[indexes[i]] : 0;
+            argb = pixels.data();
+        }
+        r.files.image = soft::image(width, height, argb, width * 4);
+        r.bytes += width * height * 4;
+    } else {
+        image::texture &tex = r.files.texture;
+        if (ncolors)
+            tex = image::texture::upload_indexed(
+                width, height, indexes, palette, ncolors);
+        else
+            tex = image::texture::upload_argb(width, height, argb);
+        std::size_t pixels = tex.twidth * tex.theight;
+        r.bytes += tex.palette ? pixels + 256 * 4 : pixels * 4;
+    }
+
+    resident_.push_front(std::move(r));
+    bytes_ += resident_.front().bytes;
+    while (bytes_ > BUDGET && resident_.size() > 1) {
+        resident &old = resident_.back();
+        old.files.texture.destroy();
+        bytes_ -= old.bytes;
+        resident_.pop_back();
+    }
+}
+
+void level_cache::prefetch(const std::string &name)
+{
+    for (const auto &r : resident_) {
+        if (r.name == name)
+            return;
+    }
+    for (const auto &p : pending_) {
+        if (p.name == name)
+            return;
+    }
+    start(name);
+}
+
+const level_files &level_cache::take(const std::string &name)
+{
+    for (auto it = resident_.begin(); it != resident_.end(); it++) {
+        if (it->name == name) {
+            resident_.splice(resident_.begin(), resident_, it);
+            source_ = source::RESIDENT;
+            counts_[(int)source_]++;
+            return resident_.front().files;
+        }
+    }
+
+    auto it = pending_.begin(), end = pending_.end();
+    while (it != end && it->name != name)
+        it++;
+    if (it != end) {
+        source_ = source::PREFETCHED;
+    } else {
+        source_ = source::LOADED;
+        start(name);
+        it = pending_.end() - 1;
+    }
+    counts_[(int)source_]++;
+    add(*it);
+    pending_.erase(it);
+    return resident_.front().files;
+}
+
+std::string target_level(const std::string &target)
+{
+    std::size_t pos = 0;
+    while (pos <= target.size()) {
+        std::size_t end = target.find(':', pos);
+        if (end == std::string::npos)
+            end = target.size();
+        if (end > pos && target[pos] != '@' && target[pos] != '!')
+            return target.substr(pos, end - pos);
+        pos = end + 1;
+    }
+    return std::string();
+}
+
+}
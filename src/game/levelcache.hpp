@@ -0,0 +1,115 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_GAME_LEVELCACHE_HPP
+#define LD_GAME_LEVELCACHE_HPP
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+#include "base/image.hpp"
+#include "base/soft.hpp"
+#include "leveldata.hpp"
+#include "levelfile.hpp"
+#include "levelmap.hpp"
+namespace game {
+
+/// A level's files, loaded and ready to use.
+struct level_files {
+    /// The collision map.
+    hitmask map;
+    /// The background texture, unless drawing in software.
+    image::texture texture;
+    /// The background pixels, if drawing in software.
+    soft::image image;
+    /// The spawn points.
+    std::vector<spawnpoint> spawns;
+};
+
+/// Cache of loaded levels.  Levels are loaded from compiled level files
+/// if they exist.  Otherwise, each level image is decoded once, and
+/// gives both the collision map and the background.  Recently used levels
+/// stay resident, up to a budget, so coming back to a level does not
+/// load it again.  Levels can also be loaded ahead of time on the
+/// loader threads, so going through a door does not wait for the level
+/// to decode.
+class level_cache {
+public:
+    /// Where the last level taken came from.
+    enum class source { RESIDENT, PREFETCHED, LOADED };
+
+private:
+    /// Maximum number of levels being loaded ahead of time.
+    static const std::size_t CAPACITY = 6;
+    /// Number of bytes of resident levels to keep.
+    static const std::size_t BUDGET = 64 * 1024 * 1024;
+
+    /// The result of decoding a level image.
+    struct decoded_level {
+        image::decoded background;
+        hitmask map;
+    };
+
+    struct pending {
+        std::string name;
+        /// The compiled level, if there is one, and otherwise the level
+        /// is decoded on the loader threads.
+        compiled_level compiled;
+        std::future<decoded_level> image;
+        std::future<std::vector<spawnpoint>> spawns;
+    };
+
+    struct resident {
+        std::string name;
+        level_files files;
+        std::size_t bytes;
+    };
+
+    std::deque<pending> pending_;
+    /// Resident levels, most recently used first.
+    std::list<resident> resident_;
+    std::size_t bytes_;
+    source source_;
+    /// Number of levels taken from each source.
+    unsigned counts_[3];
+    unsigned decodes_;
+    unsigned compiled_;
+
+    /// Start loading a level.
+    void start(const std::string &name);
+    /// Make a loaded level resident, and drop levels over the budget.
+    void add(pending &p);
+
+public:
+    level_cache();
+    level_cache(const level_cache &) = delete;
+    ~level_cache();
+    level_cache &operator=(const level_cache &) = delete;
+
+    /// Start loading a level, unless it is already loaded or loading.
+    void prefetch(const std::string &name);
+    /// Get a level's files, loading them now if necessary.  The files
+    /// remain valid until the next call.
+    const level_files &take(const std::string &name);
+
+    /// Where the last level taken came from.
+    source last_source() const { return source_; }
+    /// Number of levels taken from a source, since the cache was
+    /// created.
+    unsigned count(source s) const { return counts_[(int)s]; }
+    /// Number of level images decoded.
+    unsigned decodes() const { return decodes_; }
+    /// Number of compiled levels opened.
+    unsigned compiled() const { return compiled_; }
+    /// Number of bytes used by resident levels.
+    std::size_t bytes() const { return bytes_; }
+};
+
+/// Get the first level a door leads to, skipping script sections and
+/// commands.  Returns an empty string if there is none.
+std::string target_level(const std::string &target);
+
+}
+#endif
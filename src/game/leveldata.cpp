@@ -3,9 +3,10 @@
    of the 2-clause BSD license.  For more information, see LICENSE.txt. */
 #include "leveldata.hpp"
 #include "graphics.hpp"
+#include "levelfile.hpp"
 #include "base/defs.hpp"
+#include "base/file.hpp"
 #include <cstdio>
-#include <errno.h>
 namespace game {
 using ::graphics::sprite;
 using ::graphics::ui;
@@ -84,20 +85,18 @@ std::vector<spawnpoint> leveldata::read_level(
 {
     std::vector<spawnpoint> data;
     std::string path = level_path(levelname);
-    FILE *fp = std::fopen(path.c_str(), "r");
-    if (!fp) {
-        if (errno == ENOENT) {
-            std::printf("Level file is missing: %s\n", path.c_str());
-            return data;
-        } else {
-            core::die("Error when loading level");
-        }
+    if (!::data::exists(path)) {
+        std::printf("Level file is missing: %s\n", path.c_str());
+        return data;
     }
+    ::data file;
+    if (!::data::read(&file, path))
+        core::die("Error when loading level");
 
-    char linebuf[256], *linep;
+    line_reader lines(file);
+    std::string line;
     std::string whitespace = " \n\t\r";
-    while ((linep = std::fgets(linebuf, sizeof(linebuf), fp)) != nullptr) {
-        std::string line(linebuf);
+    while (lines.next(line)) {
         std::size_t pos = line.find_first_not_of(whitespace), end;
         if (pos == std::string::npos || line[pos] == '#')
             continue;
@@ -145,10 +144,6 @@ std::vector<spawnpoint> leveldata::read_level(
         data.push_back(std::move(s));
     }
 
-    if (std::ferror(fp))
-        core::die("Error when loading level");
-
-    std::fclose(fp);
     return std::move(data);
 }
 
@@ -170,6 +165,8 @@ void leveldata::write_level(
         std::fputc('\n', fp);
     }
     std::fclose(fp);
+    // The compiled level is out of date, and would be loaded instead.
+    std::remove(compiled_level::path(levelname).c_str());
 }
 
 std::string leveldata::level_path(const std::string &levelname)
@@ -0,0 +1,295 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include "levelfile.hpp"
+#include "base/defs.hpp"
+#include "base/file.hpp"
+#include "base/image.hpp"
+#include <cstdio>
+#include <cstring>
+#include <map>
+namespace game {
+
+// Compiled levels are in native byte order, and every section starts
+// on a 4-byte boundary, so the file can be used in place once it is
+// read or mapped.  The files are built on the machine that runs them,
+// and a file with the wrong byte order fails the version check.
+//
+// Header:
+//   0: magic, "OLVL"
+//   4: version
+//   8: width
+//   12: height
+//   16: number of palette colors, or 0 for ARGB pixels
+//   20: number of spawn points
+//   24: offset of the spawn points
+//   28: offset of the strings
+//   32: offset of the collision mask
+//   36: offset of the pixels
+//   40: file size
+//
+// Spawn point:
+//   0: x
+//   4: y
+//   8: type
+//   12: offset of the data, from the start of the strings
+//   16: length of the data
+//
+// Each distinct data string is stored once.  The collision mask is in
+// the layout of a hitmask.  The pixels are the palette colors followed
+// by the indexes, or ARGB pixels.
+
+struct compiled_level::header {
+    char magic[4];
+    unsigned version;
+    unsigned width;
+    unsigned height;
+    unsigned ncolors;
+    unsigned nspawn;
+    unsigned spawnoff;
+    unsigned stroff;
+    unsigned maskoff;
+    unsigned pixoff;
+    unsigned size;
+};
+
+namespace {
+
+const char MAGIC[4] = { 'O', 'L', 'V', 'L' };
+const unsigned VERSION = 1;
+
+struct spawn_record {
+    int x;
+    int y;
+    unsigned type;
+    unsigned dataoff;
+    unsigned datalen;
+};
+
+std::size_t align4(std::size_t x)
+{
+    return (x + 3) & ~(std::size_t)3;
+}
+
+}
+
+compiled_level::compiled_level()
+    : head_(nullptr)
+{ }
+
+const unsigned char *compiled_level::ptr(std::size_t offset) const
+{
+    return static_cast<const unsigned char *>(file_->ptr()) + offset;
+}
+
+bool compiled_level::open(const std::string &levelname)
+{
+    file_.reset();
+    head_ = nullptr;
+    std::string fpath = path(levelname);
+    if (!::data::exists(fpath))
+        return false;
+    std::shared_ptr<::data> file = std::make_shared<::data>();
+    if (!::data::read(file.get(), fpath))
+        return false;
+
+    std::size_t size = file->size();
+    const header *h = static_cast<const header *>(file->ptr());
+    if (size < sizeof(header) ||
+        std::memcmp(h->magic, MAGIC, 4) || h->version != VERSION ||
+        h->size != size) {
+        std::fprintf(stderr, "Invalid compiled level: %s\n", fpath.c_str());
+        return false;
+    }
+    // Sections must be in order and aligned, and each check is written
+    // so that it cannot overflow.
+    std::size_t w = h->width, hh = h->height;
+    std::size_t pixbytes = h->ncolors ?
+        h->ncolors * 4 + w * hh : w * hh * 4;
+    std::size_t spawnoff = h->spawnoff, stroff = h->stroff,
+        maskoff = h->maskoff, pixoff = h->pixoff;
+    if (w < 1 || w > 0x8000 || hh < 1 || hh > 0x8000 ||
+        h->ncolors > 256 ||
+        spawnoff < sizeof(header) ||
+        ((spawnoff | stroff | maskoff | pixoff) & 3) ||
+        spawnoff > stroff || stroff > maskoff || maskoff > pixoff ||
+        pixoff > size ||
+        h->nspawn > (stroff - spawnoff) / sizeof(spawn_record) ||
+        hitmask::row_size(w) * hh > pixoff - maskoff ||
+        pixbytes > size - pixoff) {
+        std::fprintf(stderr, "Invalid compiled level: %s\n", fpath.c_str());
+        return false;
+    }
+
+    file_ = std::move(file);
+    head_ = h;
+    const spawn_record *sp =
+        reinterpret_cast<const spawn_record *>(ptr(h->spawnoff));
+    std::size_t strsize = maskoff - stroff;
+    for (unsigned i = 0; i < h->nspawn; i++) {
+        std::size_t dataoff = sp[i].dataoff, datalen = sp[i].datalen;
+        if (sp[i].type >= (unsigned)leveldata::NTYPE ||
+            dataoff > strsize || datalen > strsize - dataoff) {
+            std::fprintf(stderr, "Invalid compiled level: %s\n",
+                         fpath.c_str());
+            file_.reset();
+            head_ = nullptr;
+            return false;
+        }
+    }
+    return true;
+}
+
+std::size_t compiled_level::size() const
+{
+    return head_->size;
+}
+
+int compiled_level::width() const
+{
+    return head_->width;
+}
+
+int compiled_level::height() const
+{
+    return head_->height;
+}
+
+int compiled_level::ncolors() const
+{
+    return head_->ncolors;
+}
+
+const unsigned *compiled_level::palette() const
+{
+    return reinterpret_cast<const unsigned *>(ptr(head_->pixoff));
+}
+
+const unsigned char *compiled_level::indexes() const
+{
+    return ptr(head_->pixoff + head_->ncolors * 4);
+}
+
+const unsigned *compiled_level::argb() const
+{
+    return reinterpret_cast<const unsigned *>(ptr(head_->pixoff));
+}
+
+hitmask compiled_level::mask() const
+{
+    hitmask mask;
+    mask.bits = ptr(head_->maskoff);
+    mask.width = head_->width;
+    mask.height = head_->height;
+    mask.rowbytes = hitmask::row_size(mask.width);
+    mask.storage = file_;
+    return mask;
+}
+
+std::vector<spawnpoint> compiled_level::spawns() const
+{
+    std::vector<spawnpoint> spawns(head_->nspawn);
+    const spawn_record *sp =
+        reinterpret_cast<const spawn_record *>(ptr(head_->spawnoff));
+    const char *str = reinterpret_cast<const char *>(ptr(head_->stroff));
+    for (unsigned i = 0; i < head_->nspawn; i++) {
+        spawnpoint &s = spawns[i];
+        s.pos = ivec(sp[i].x, sp[i].y);
+        s.type = static_cast<spawntype>(sp[i].type);
+        s.data.assign(str + sp[i].dataoff, sp[i].datalen);
+        s.flag = false;
+    }
+    return spawns;
+}
+
+std::string compiled_level::path(const std::string &levelname)
+{
+    return "level/" + levelname + ".lvl";
+}
+
+void compiled_level::compile(const std::string &levelname)
+{
+    image::decoded bg = image::decoded::decode(
+        "level/" + levelname + ".png", true);
+    hitmask mask = level_mask(levelname, bg);
+    std::vector<spawnpoint> spawns = leveldata::read_level(levelname);
+
+    std::vector<spawn_record> records(spawns.size());
+    std::string strings;
+    std::map<std::string, unsigned> interned;
+    for (std::size_t i = 0; i < spawns.size(); i++) {
+        const spawnpoint &s = spawns[i];
+        spawn_record &r = records[i];
+        r.x = s.pos.x;
+        r.y = s.pos.y;
+        r.type = static_cast<unsigned>(s.type);
+        auto it = interned.find(s.data);
+        if (it == interned.end()) {
+            it = interned.insert(std::make_pair(
+                s.data, (unsigned)strings.size())).first;
+            strings += s.data;
+        }
+        r.dataoff = it->second;
+        r.datalen = s.data.size();
+    }
+
+    header h;
+    std::memcpy(h.magic, MAGIC, 4);
+    h.version = VERSION;
+    h.width = bg.width;
+    h.height = bg.height;
+    h.ncolors = bg.palette.size();
+    h.nspawn = records.size();
+    h.spawnoff = sizeof(header);
+    h.stroff = h.spawnoff + records.size() * sizeof(spawn_record);
+    h.maskoff = align4(h.stroff + strings.size());
+    h.pixoff = h.maskoff + mask.rowbytes * mask.height;
+    h.size = h.pixoff + (h.ncolors ?
+        h.ncolors * 4 + bg.indexes.size() : bg.argb.size() * 4);
+
+    std::vector<unsigned char> out(h.size);
+    unsigned char *p = out.data();
+    std::memcpy(p, &h, sizeof(h));
+    if (!records.empty())
+        std::memcpy(p + h.spawnoff, records.data(),
+                    records.size() * sizeof(spawn_record));
+    std::memcpy(p + h.stroff, strings.data(), strings.size());
+    std::memcpy(p + h.maskoff, mask.bits, mask.rowbytes * mask.height);
+    if (h.ncolors) {
+        std::memcpy(p + h.pixoff, bg.palette.data(), h.ncolors * 4);
+        std::memcpy(p + h.pixoff + h.ncolors * 4, bg.indexes.data(),
+                    bg.indexes.size());
+    } else {
+        std::memcpy(p + h.pixoff, bg.argb.data(), bg.argb.size() * 4);
+    }
+
+    std::string fpath = path(levelname);
+    FILE *fp = std::fopen(fpath.c_str(), "wb");
+    if (!fp) {
+        std::fprintf(stderr, "Could not open file: %s\n", fpath.c_str());
+        core::die("Failed to compile level");
+    }
+    std::size_t amt = std::fwrite(out.data(), 1, out.size(), fp);
+    if (std::fclose(fp) || amt != out.size())
+        core::die("Failed to compile level");
+    std::fprintf(stderr, "Wrote %s, %dx%d, %zu spawn points, %zu bytes\n",
+                 fpath.c_str(), bg.width, bg.height, spawns.size(),
+                 out.size());
+}
+
+hitmask level_mask(const std::string &levelname,
+                   const image::decoded &background)
+{
+    std::string hitpath = "level/" + levelname + ".hit.png";
+    if (!::data::exists(hitpath))
+        return hitmask::pack(image::bitmap::alpha(background));
+    image::decoded hit = image::decoded::decode(hitpath, false);
+    if (hit.width != background.width || hit.height != background.height) {
+        std::fprintf(stderr, "Wrong size for collision map: %s\n",
+                     hitpath.c_str());
+        core::die("Could not load level");
+    }
+    return hitmask::pack(image::bitmap::alpha(hit));
+}
+
+}
@@ -0,0 +1,69 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_GAME_LEVELFILE_HPP
+#define LD_GAME_LEVELFILE_HPP
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include "leveldata.hpp"
+#include "levelmap.hpp"
+class data;
+namespace image {
+struct decoded;
+}
+namespace game {
+
+/// A compiled level, with the spawn points, collision mask, and
+/// background pixels in one file which is used in place, without
+/// parsing or decoding.  Compiled levels are built from the level text
+/// and images, which remain the source for editing.
+class compiled_level {
+private:
+    struct header;
+
+    std::shared_ptr<const ::data> file_;
+    const header *head_;
+
+    const unsigned char *ptr(std::size_t offset) const;
+
+public:
+    compiled_level();
+
+    /// Open a compiled level.  Returns false if there is none, or if it
+    /// is invalid.
+    bool open(const std::string &levelname);
+    /// Whether a level is open.
+    bool is_open() const { return head_ != nullptr; }
+    /// Get the size of the file in bytes.
+    std::size_t size() const;
+
+    int width() const;
+    int height() const;
+    /// Get the number of palette colors, or 0 if the pixels are ARGB.
+    int ncolors() const;
+    /// Get the palette colors, if the pixels are indexed.
+    const unsigned *palette() const;
+    /// Get the palette indexes, starting with the top row.
+    const unsigned char *indexes() const;
+    /// Get the ARGB pixels, starting with the top row.
+    const unsigned *argb() const;
+    /// Get the collision mask, which refers to the file.
+    hitmask mask() const;
+    /// Get the spawn points.
+    std::vector<spawnpoint> spawns() const;
+
+    /// Get the path to the compiled level file.
+    static std::string path(const std::string &levelname);
+    /// Compile a level from its text and images.
+    static void compile(const std::string &levelname);
+};
+
+/// Get the collision mask for a level.  This comes from the level's
+/// ".hit.png" image if it has one, or else from the background alpha.
+hitmask level_mask(const std::string &levelname,
+                   const image::decoded &background);
+
+}
+#endif
@@ -4,22 +4,76 @@
 #include "levelmap.hpp"
 #include <cstdlib>
 #include <cmath>
+#include <cstring>
+#include <vector>
 namespace game {
 
+hitmask::hitmask()
+    : bits(nullptr), width(0), height(0), rowbytes(0)
+{ }
+
+int hitmask::row_size(int width)
+{
+    return ((width + 31) >> 5) * 4;
+}
+
+hitmask hitmask::pack(const image::bitmap &bitmap)
+{
+    hitmask mask;
+    mask.width = bitmap.width;
+    mask.height = bitmap.height;
+    mask.rowbytes = row_size(bitmap.width);
+    auto buf = std::make_shared<std::vector<unsigned char>>(
+        mask.rowbytes * mask.height);
+    pack(bitmap, buf->data());
+    mask.bits = buf->data();
+    mask.storage = std::move(buf);
+    return mask;
+}
+
+void hitmask::pack(const image::bitmap &bitmap, unsigned char *bits)
+{
+    int w = bitmap.width, h = bitmap.height, rb = row_size(w);
+    std::memset(bits, 0, rb * h);
+    for (int y = 0; y < h; y++) {
+        const unsigned char *irow = bitmap.data + bitmap.rowbytes * y;
+        unsigned char *orow = bits + rb * y;
+        for (int x = 0; x < w; x++) {
+            if (irow[x])
+                orow[x >> 3] |= 1u << (x & 7);
+        }
+    }
+}
+
+/// Test whether any bits from x0 to x1, inclusive, are set in a row.
+static bool row_hit(const unsigned char *row, int x0, int x1)
+{
+    if (x0 > x1)
+        return false;
+    int b0 = x0 >> 3, b1 = x1 >> 3;
+    unsigned m0 = (0xffu << (x0 & 7)) & 0xffu;
+    unsigned m1 = 0xffu >> (7 - (x1 & 7));
+    if (b0 == b1)
+        return (row[b0] & m0 & m1) != 0;
+    if (row[b0] & m0)
+        return true;
+    for (int b = b0 + 1; b < b1; b++) {
+        if (row[b])
+            return true;
+    }
+    return (row[b1] & m1) != 0;
+}
+
 bool levelmap::hit_test(irect r) const
 {
-    const unsigned char *data = map.data;
+    const unsigned char *data = map.bits;
     int w = map.width, h = map.height, rb = map.rowbytes;
     if (r.x0 < 0 || r.x1 >= w)
         return true;
     int y0 = r.y0 >= 0 ? r.y0 : 0;
     int y1 = r.y1 <= h ? r.y1 : h;
     for (int y = y0; y < y1; y++) {
-        unsigned hit = 0;
-        const unsigned char *row = data + rb * y;
-        for (int x = r.x0; x <= r.x1; x++)
-            hit |= row[x];
-        if (hit != 0)
+        if (row_hit(data + rb * y, r.x0, r.x1))
             return true;
     }
     return false;
@@ -27,18 +81,14 @@ bool levelmap::hit_test(irect r) const
 
 int levelmap::hit_y0(irect r) const
 {
-    const unsigned char *data = map.data;
+    const unsigned char *data = map.bits;
     int w = map.width, h = map.height, rb = map.rowbytes;
     if (r.x0 < 0 || r.x1 >= w)
         return r.y1 - r.y0;
     int y0 = r.y0 >= 0 ? r.y0 : 0;
     int y1 = r.y1 <= h ? r.y1 : h;
     for (int y = y1; y > y0; y--) {
-        unsigned hit = 0;
-        const unsigned char *row = data + rb * (y - 1);
-        for (int x = r.x0; x <= r.x1; x++)
-            hit |= row[x];
-        if (hit != 0)
+        if (row_hit(data + rb * (y - 1), r.x0, r.x1))
             return y - r.y0;
     }
     return 0;
@@ -46,29 +96,22 @@ int levelmap::hit_y0(irect r) const
 
 int levelmap::hit_y1(irect r) const
 {
-    const unsigned char *data = map.data;
+    const unsigned char *data = map.bits;
     int w = map.width, h = map.height, rb = map.rowbytes;
     if (r.x0 < 0 || r.x1 >= w)
         return r.y1 - r.y0;
     int y0 = r.y0 >= 0 ? r.y0 : 0;
     int y1 = r.y1 <= h ? r.y1 : h;
     for (int y = y0; y < y1; y++) {
-        unsigned hit = 0;
-        const unsigned char *row = data + rb * y;
-        for (int x = r.x0; x <= r.x1; x++)
-            hit |= row[x];
-        if (hit != 0)
+        if (row_hit(data + rb * y, r.x0, r.x1))
             return r.y1 - y;
     }
     return 0;
 }
 
-void levelmap::set_level(const std::string &name)
+void levelmap::set_map(const hitmask &mask)
 {
-    std::string fullpath("level/");
-    fullpath += name;
-    fullpath += ".png";
-    map = image::bitmap::load(fullpath);
+    map = mask;
 }
 
 }
@@ -3,15 +3,37 @@
    of the 2-clause BSD license.  For more information, see LICENSE.txt. */
 #ifndef LD_GAME_LEVELMAP_HPP
 #define LD_GAME_LEVELMAP_HPP
-#include <string>
+#include <memory>
 #include "base/image.hpp"
 #include "base/vec.hpp"
 namespace game {
 
+/// Level collision mask, with one bit per pixel, starting with the
+/// bottom row.  The low bit of each byte is the leftmost pixel.  The
+/// bits can be stored in a compiled level file and used in place.
+struct hitmask {
+    const unsigned char *bits;
+    int width;
+    int height;
+    int rowbytes;
+    /// Whatever owns the bits.
+    std::shared_ptr<const void> storage;
+
+    hitmask();
+
+    /// Get the number of bytes in each row for a given width.
+    static int row_size(int width);
+    /// Pack the nonzero pixels of a bitmap.
+    static hitmask pack(const image::bitmap &bitmap);
+    /// Pack the nonzero pixels of a bitmap into a buffer of
+    /// row_size(width) * height bytes.
+    static void pack(const image::bitmap &bitmap, unsigned char *bits);
+};
+
 /// Level collision map.
 class levelmap {
 private:
-    image::bitmap map;
+    hitmask map;
 
 public:
     /// Do a hit test against a rectangle.
@@ -20,8 +42,8 @@ public:
     int hit_y0(irect r) const;
     /// Returns the number of pixels to move down to clear collisions.
     int hit_y1(irect r) const;
-    /// Load the collision map for a level.
-    void set_level(const std::string &name);
+    /// Set the collision map.  The map is shared with the level cache.
+    void set_map(const hitmask &mask);
 
     int width() const { return map.width; }
     int height() const { return map.height; }
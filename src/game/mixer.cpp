@@ -0,0 +1,149 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include "mixer.hpp"
+#include <algorithm>
+#include <cmath>
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+namespace audio {
+
+mixer::mixer(int channels, int voices)
+    : channels_(channels), simd_(true), voices_(voices), counter_(0),
+      bus_(BLOCK_FRAMES * channels), stolen_(0), dropped_(0)
+{
+    for (auto &v : voices_)
+        v.active = false;
+}
+
+bool mixer::play(const sound &s)
+{
+    return queue_.push(s);
+}
+
+void mixer::start(const sound &s)
+{
+    voice *target = nullptr;
+    for (auto &v : voices_) {
+        if (!v.active) {
+            target = &v;
+            break;
+        }
+        if (!target || v.snd.priority < target->snd.priority ||
+            (v.snd.priority == target->snd.priority &&
+             (int)(v.age - target->age) < 0))
+            target = &v;
+    }
+    if (!target)
+        return;
+    if (target->active) {
+        if (target->snd.priority > s.priority) {
+            dropped_++;
+            return;
+        }
+        stolen_++;
+    }
+    target->snd = s;
+    target->pos = 0;
+    target->age = counter_++;
+    target->active = true;
+}
+
+void mixer::mix(short *samples, int frames)
+{
+    sound s;
+    while (queue_.pop(&s))
+        start(s);
+
+    while (frames > 0) {
+        int n = std::min(frames, (int)BLOCK_FRAMES);
+        std::size_t count = n * channels_;
+        bool any = false;
+        for (auto &v : voices_) {
+            if (!v.active)
+                continue;
+            if (!any) {
+                std::fill(bus_.begin(), bus_.begin() + count, 0.0f);
+                any = true;
+            }
+            std::size_t m = std::min((std::size_t)n, v.snd.length - v.pos);
+            const short *p = v.snd.samples + v.pos * channels_;
+            if (simd_)
+                mix_samples(bus_.data(), p, m * channels_, v.snd.gain);
+            else
+                mix_samples_scalar(bus_.data(), p, m * channels_,
+                                   v.snd.gain);
+            v.pos += m;
+            if (v.pos >= v.snd.length)
+                v.active = false;
+        }
+        if (any) {
+            if (simd_)
+                add_bus(samples, bus_.data(), count);
+            else
+                add_bus_scalar(samples, bus_.data(), count);
+        }
+        samples += count;
+        frames -= n;
+    }
+}
+
+void mix_samples(float *bus, const short *samples, std::size_t count,
+                 float gain)
+{
+    std::size_t i = 0;
+#if defined __SSE2__
+    __m128 g = _mm_set1_ps(gain);
+    for (; i + 8 <= count; i += 8) {
+        __m128i s = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(samples + i));
+        __m128 lo = _mm_cvtepi32_ps(
+            _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+        __m128 hi = _mm_cvtepi32_ps(
+            _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+        _mm_storeu_ps(bus + i, _mm_add_ps(
+            _mm_loadu_ps(bus + i), _mm_mul_ps(lo, g)));
+        _mm_storeu_ps(bus + i + 4, _mm_add_ps(
+            _mm_loadu_ps(bus + i + 4), _mm_mul_ps(hi, g)));
+    }
+#endif
+    mix_samples_scalar(bus + i, samples + i, count - i, gain);
+}
+
+void mix_samples_scalar(float *bus, const short *samples,
+                        std::size_t count, float gain)
+{
+    for (std::size_t i = 0; i < count; i++)
+        bus[i] += samples[i] * gain;
+}
+
+void add_bus(short *samples, const float *bus, std::size_t count)
+{
+    std::size_t i = 0;
+#if defined __SSE2__
+    __m128 maxval = _mm_set1_ps(32767.0f), minval = _mm_set1_ps(-32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        __m128 lo = _mm_max_ps(minval, _mm_min_ps(
+            maxval, _mm_loadu_ps(bus + i)));
+        __m128 hi = _mm_max_ps(minval, _mm_min_ps(
+            maxval, _mm_loadu_ps(bus + i + 4)));
+        __m128i b = _mm_packs_epi32(_mm_cvtps_epi32(lo),
+                                    _mm_cvtps_epi32(hi));
+        __m128i *p = reinterpret_cast<__m128i *>(samples + i);
+        _mm_storeu_si128(p, _mm_adds_epi16(_mm_loadu_si128(p), b));
+    }
+#endif
+    add_bus_scalar(samples + i, bus + i, count - i);
+}
+
+void add_bus_scalar(short *samples, const float *bus, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; i++) {
+        float f = std::max(-32768.0f, std::min(32767.0f, bus[i]));
+        int s = samples[i] + (int)std::nearbyint(f);
+        samples[i] = std::max(-32768, std::min(32767, s));
+    }
+}
+
+}
@@ -0,0 +1,125 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_GAME_MIXER_HPP
+#define LD_GAME_MIXER_HPP
+#include <atomic>
+#include <cstddef>
+#include <vector>
+namespace audio {
+
+/// Queue for passing items from one thread to another without locking.
+/// Only one thread may push, and only one thread may pop.
+template<typename T, std::size_t N>
+class spsc_queue {
+private:
+    T items_[N];
+    std::atomic<std::size_t> head_;
+    std::atomic<std::size_t> tail_;
+
+public:
+    spsc_queue() : head_(0), tail_(0) { }
+    spsc_queue(const spsc_queue &) = delete;
+    spsc_queue &operator=(const spsc_queue &) = delete;
+
+    /// Add an item to the queue.  Returns false if the queue is full.
+    bool push(const T &item)
+    {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        std::size_t next = (tail + 1) % N;
+        if (next == head_.load(std::memory_order_acquire))
+            return false;
+        items_[tail] = item;
+        tail_.store(next, std::memory_order_release);
+        return true;
+    }
+
+    /// Remove an item from the queue.  Returns false if it is empty.
+    bool pop(T *item)
+    {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+            return false;
+        *item = items_[head];
+        head_.store((head + 1) % N, std::memory_order_release);
+        return true;
+    }
+};
+
+/// A sound to start playing.
+struct sound {
+    /// Interleaved samples, with the mixer's number of channels.
+    const short *samples;
+    /// Number of frames.
+    std::size_t length;
+    float gain;
+    /// Sounds take voices from sounds with the same or lower priority
+    /// when all voices are busy, starting with the oldest.
+    int priority;
+};
+
+/// Mixes sounds on the audio thread.  The game thread queues sounds,
+/// and the audio thread starts them and mixes the voices.
+class mixer {
+private:
+    /// Number of frames mixed at a time.
+    static const int BLOCK_FRAMES = 1024;
+
+    struct voice {
+        sound snd;
+        std::size_t pos;
+        /// When the voice started, for stealing the oldest voice.
+        unsigned age;
+        bool active;
+    };
+
+    int channels_;
+    bool simd_;
+    std::vector<voice> voices_;
+    unsigned counter_;
+    spsc_queue<sound, 64> queue_;
+    std::vector<float> bus_;
+    std::atomic<unsigned> stolen_;
+    std::atomic<unsigned> dropped_;
+
+    /// Start a sound, taking a voice from another sound if necessary.
+    void start(const sound &s);
+
+public:
+    mixer(int channels, int voices);
+    mixer(const mixer &) = delete;
+    mixer &operator=(const mixer &) = delete;
+
+    /// Queue a sound to start.  Called from the game thread.  Returns
+    /// false if the queue is full.
+    bool play(const sound &s);
+    /// Mix the voices, adding them to interleaved samples.  Called from
+    /// the audio thread.
+    void mix(short *samples, int frames);
+    /// Use SIMD instructions for mixing, where available.  This is only
+    /// turned off to compare the speed.
+    void set_simd(bool simd) { simd_ = simd; }
+
+    /// Number of sounds which took a voice from another sound.
+    unsigned stolen() const { return stolen_; }
+    /// Number of sounds dropped because no voice could be taken.
+    unsigned dropped() const { return dropped_; }
+};
+
+/// Add samples, scaled by a gain, to a mixing bus.  Uses SSE2 where
+/// available.
+void mix_samples(float *bus, const short *samples, std::size_t count,
+                 float gain);
+
+/// Add samples, scaled by a gain, to a mixing bus, without SIMD.
+void mix_samples_scalar(float *bus, const short *samples,
+                        std::size_t count, float gain);
+
+/// Round a mixing bus and add it to samples, with saturation.
+void add_bus(short *samples, const float *bus, std::size_t count);
+
+/// Round a mixing bus and add it to samples, without SIMD.
+void add_bus_scalar(short *samples, const float *bus, std::size_t count);
+
+}
+#endif
@@ -0,0 +1,469 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#include "music.hpp"
+#include "base/archive.hpp"
+#include <SDL.h>
+#include <vorbis/vorbisfile.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+namespace audio {
+
+/// Number of output frames buffered for each voice.
+static const int RING_FRAMES = 16384;
+/// Number of frames decoded at a time.
+static const int CHUNK_FRAMES = 4096;
+/// Length of a crossfade, in milliseconds.
+static const int FADE_TIME = 250;
+
+/// Ogg callbacks for reading from the mapped archive.
+struct memory_source {
+    const unsigned char *ptr;
+    std::size_t size;
+    std::size_t pos;
+};
+
+static std::size_t memory_read(void *ptr, std::size_t size,
+                               std::size_t nmemb, void *datasource)
+{
+    memory_source &m = *static_cast<memory_source *>(datasource);
+    std::size_t n = size ? std::min(nmemb, (m.size - m.pos) / size) : 0;
+    std::memcpy(ptr, m.ptr + m.pos, n * size);
+    m.pos += n * size;
+    return n;
+}
+
+static int memory_seek(void *datasource, ogg_int64_t offset, int whence)
+{
+    memory_source &m = *static_cast<memory_source *>(datasource);
+    ogg_int64_t base;
+    switch (whence) {
+    case SEEK_SET: base = 0; break;
+    case SEEK_CUR: base = m.pos; break;
+    case SEEK_END: base = m.size; break;
+    default: return -1;
+    }
+    if (base + offset < 0 || base + offset > (ogg_int64_t)m.size)
+        return -1;
+    m.pos = base + offset;
+    return 0;
+}
+
+static long memory_tell(void *datasource)
+{
+    return static_cast<memory_source *>(datasource)->pos;
+}
+
+static const ov_callbacks MEMORY_CALLBACKS = {
+    memory_read, memory_seek, nullptr, memory_tell
+};
+
+/// A track being decoded.  This belongs to the worker thread.
+struct decoder {
+    OggVorbis_File file;
+    memory_source source;
+    SDL_AudioStream *stream;
+    bool open;
+    /// The voice generation this decoder is for.
+    unsigned generation;
+    /// The frame where the track loops, at the track's sample rate.
+    ogg_int64_t loop_end;
+    int channels;
+    /// Whether the whole track has been decoded.
+    bool ended;
+
+    decoder() : stream(nullptr), open(false), generation(0),
+                loop_end(0), channels(0), ended(false) { }
+    void close();
+    bool start(const std::string &path, double loop_length,
+               int rate, int channels);
+    /// Decode more of the track into the conversion stream.
+    void decode(bool one_shot);
+    /// Get up to the given number of output frames.  Returns fewer at
+    /// the end of a one-shot.
+    int read(short *samples, int frames, int out_channels, bool one_shot);
+};
+
+void decoder::close()
+{
+    if (stream) {
+        SDL_FreeAudioStream(stream);
+        stream = nullptr;
+    }
+    if (open) {
+        ov_clear(&file);
+        open = false;
+    }
+}
+
+bool decoder::start(const std::string &path, double loop_length,
+                    int rate, int out_channels)
+{
+    close();
+    ended = false;
+    archive::entry e;
+    int r;
+    if (archive::find(path, &e) && !e.compressed) {
+        source.ptr = e.data;
+        source.size = e.size;
+        source.pos = 0;
+        r = ov_open_callbacks(&source, &file, nullptr, 0, MEMORY_CALLBACKS);
+    } else {
+        r = ov_fopen(path.c_str(), &file);
+    }
+    if (r) {
+        std::printf("Failed to load %s\n", path.c_str());
+        return false;
+    }
+    open = true;
+
+    const vorbis_info *info = ov_info(&file, -1);
+    channels = info->channels;
+    ogg_int64_t total = ov_pcm_total(&file, -1);
+    loop_end = loop_length > 0.0 ?
+        (ogg_int64_t)std::floor(loop_length * info->rate + 0.5) : total;
+    if (total >= 0 && (loop_end <= 0 || loop_end > total))
+        loop_end = total;
+    stream = SDL_NewAudioStream(AUDIO_S16SYS, channels, info->rate,
+                                AUDIO_S16SYS, out_channels, rate);
+    if (!stream) {
+        std::printf("Failed to load %s: %s\n", path.c_str(),
+                    SDL_GetError());
+        close();
+        return false;
+    }
+    return true;
+}
+
+void decoder::decode(bool one_shot)
+{
+    short buf[CHUNK_FRAMES * 2];
+    int frame_size = channels * 2;
+    int maxframes = sizeof(buf) / frame_size;
+    ogg_int64_t pos = ov_pcm_tell(&file);
+    if (loop_end > 0 && loop_end - pos < maxframes)
+        maxframes = loop_end - pos;
+    long n = 0;
+    if (maxframes > 0) {
+        int bitstream;
+        n = ov_read(&file, reinterpret_cast<char *>(buf),
+                    maxframes * frame_size,
+                    SDL_BYTEORDER == SDL_BIG_ENDIAN, 2, 1, &bitstream);
+        if (n == OV_HOLE)
+            return;
+    }
+    if (n > 0) {
+        SDL_AudioStreamPut(stream, buf, n - n % frame_size);
+        return;
+    }
+    // At the loop point, or the end of the file.
+    if (!one_shot && pos > 0 && !ov_pcm_seek(&file, 0))
+        return;
+    SDL_AudioStreamFlush(stream);
+    ended = true;
+}
+
+int decoder::read(short *samples, int frames, int out_channels,
+                  bool one_shot)
+{
+    int frame_size = out_channels * 2;
+    int got = 0;
+    while (got < frames) {
+        int n = SDL_AudioStreamGet(stream, samples + got * out_channels,
+                                   (frames - got) * frame_size);
+        if (n < 0)
+            break;
+        got += n / frame_size;
+        if (got >= frames || (ended && n == 0))
+            break;
+        if (!ended)
+            decode(one_shot);
+    }
+    return got;
+}
+
+struct music_player::voice {
+    // Requests for the worker, guarded by the mutex.
+
+    /// Incremented whenever the voice starts a new track.  Set by the
+    /// game thread.
+    unsigned generation;
+    std::string path;
+    double loop_length;
+    bool one_shot;
+
+    // Owned by the worker.
+
+    decoder dec;
+
+    // Owned by the audio thread.
+
+    /// The generation the audio thread is playing.
+    unsigned mix_generation;
+    bool active;
+    bool mix_one_shot;
+    /// Gain, and the gain it is fading to per frame.
+    double gain;
+    double target;
+    double step;
+
+    // Shared between the worker and the audio thread.  Positions count
+    // frames, and wrap around.
+
+    /// Decoded frames waiting to be mixed.
+    std::vector<short> ring;
+    /// Position of the next frame to mix, written by the audio thread.
+    std::atomic<unsigned> read_pos;
+    /// Position of the next frame to decode, written by the worker.
+    std::atomic<unsigned> write_pos;
+    /// The generation the worker is decoding, in the high 32 bits, and
+    /// the position where it starts, in the low 32 bits.  Written by
+    /// the worker.
+    std::atomic<unsigned long long> start;
+    /// The last generation the worker decoded to the end.
+    std::atomic<unsigned> ended;
+    /// The last generation the audio thread finished playing.
+    std::atomic<unsigned> finished;
+
+    voice() : generation(0), loop_length(0.0), one_shot(false),
+              mix_generation(0), active(false), mix_one_shot(false),
+              gain(0.0), target(0.0), step(0.0), read_pos(0),
+              write_pos(0), start(0), ended(0), finished(0) { }
+};
+
+music_player::music_player(double volume, int rate, int channels)
+    : voices_(new voice[2]), current_(0), mix_current_(0), rate_(rate),
+      channels_(channels), volume_(volume), quit_(false)
+{
+    for (int i = 0; i < 2; i++)
+        voices_[i].ring.resize(RING_FRAMES * channels);
+    thread_ = std::thread(&music_player::run, this);
+}
+
+music_player::~music_player()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+    for (int i = 0; i < 2; i++)
+        voices_[i].dec.close();
+}
+
+bool music_player::send(const command &c)
+{
+    if (commands_.push(c))
+        return true;
+    std::puts("Too many music commands, dropped");
+    return false;
+}
+
+void music_player::play(const std::string &path, double loop_length,
+                        bool one_shot)
+{
+    command c;
+    c.type = command::PLAY;
+    c.one_shot = one_shot;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        voice &v = voices_[!current_];
+        c.voice = !current_;
+        c.generation = v.generation + 1;
+        // The command goes out before the worker can start decoding,
+        // so the audio thread never mistakes the new track for an old
+        // one.  If it is dropped, nothing changes.
+        if (!send(c))
+            return;
+        current_ = c.voice;
+        v.generation = c.generation;
+        v.path = path;
+        v.loop_length = loop_length;
+        v.one_shot = one_shot;
+    }
+    cond_.notify_one();
+}
+
+void music_player::stop()
+{
+    command c;
+    c.type = command::STOP;
+    c.voice = current_;
+    c.generation = 0;
+    c.one_shot = false;
+    send(c);
+}
+
+bool music_player::playing()
+{
+    const voice &v = voices_[current_];
+    return v.generation != v.finished.load(std::memory_order_acquire);
+}
+
+void music_player::run()
+{
+    std::vector<short> buf(CHUNK_FRAMES * channels_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!quit_) {
+        bool worked = false, decoding = false;
+        for (int i = 0; i < 2; i++) {
+            voice &v = voices_[i];
+            decoder &dec = v.dec;
+            unsigned generation = v.generation;
+            if (dec.generation != generation) {
+                std::string path = v.path;
+                double loop_length = v.one_shot ? 0.0 : v.loop_length;
+                lock.unlock();
+                dec.generation = generation;
+                unsigned pos = v.write_pos.load(std::memory_order_relaxed);
+                bool ok = dec.start(path, loop_length, rate_, channels_);
+                v.start.store(((unsigned long long)generation << 32) | pos,
+                              std::memory_order_release);
+                if (!ok)
+                    v.ended.store(generation, std::memory_order_release);
+                lock.lock();
+                worked = true;
+                continue;
+            }
+            if (!dec.open)
+                continue;
+            decoding = true;
+            if (v.finished.load(std::memory_order_acquire) == generation ||
+                v.ended.load(std::memory_order_relaxed) == generation) {
+                lock.unlock();
+                dec.close();
+                lock.lock();
+                worked = true;
+                continue;
+            }
+            unsigned wpos = v.write_pos.load(std::memory_order_relaxed);
+            unsigned rpos = v.read_pos.load(std::memory_order_acquire);
+            if (RING_FRAMES - (wpos - rpos) < (unsigned)CHUNK_FRAMES)
+                continue;
+            bool one_shot = v.one_shot;
+            lock.unlock();
+            int n = dec.read(buf.data(), CHUNK_FRAMES, channels_, one_shot);
+            for (int f = 0; f < n; f++) {
+                std::size_t off = ((wpos + f) % RING_FRAMES) * channels_;
+                for (int c = 0; c < channels_; c++)
+                    v.ring[off + c] = buf[f * channels_ + c];
+            }
+            v.write_pos.store(wpos + n, std::memory_order_release);
+            if (n < CHUNK_FRAMES)
+                v.ended.store(generation, std::memory_order_release);
+            lock.lock();
+            worked = true;
+        }
+        // The audio thread never signals, so while a track is decoding,
+        // check for space again after a short wait.  Otherwise, wait
+        // for the next track.
+        if (worked || quit_)
+            continue;
+        if (decoding)
+            cond_.wait_for(lock, std::chrono::milliseconds(20));
+        else
+            cond_.wait(lock);
+    }
+}
+
+void music_player::mix(short *samples, int frames)
+{
+    command c;
+    while (commands_.pop(&c)) {
+        double fade = 1.0 / (rate_ * FADE_TIME / 1000);
+        if (c.type == command::PLAY) {
+            voice &old = voices_[!c.voice];
+            bool fade_in = old.active;
+            if (old.active && !old.mix_one_shot) {
+                old.target = 0.0;
+                old.step = fade;
+            }
+            voice &v = voices_[c.voice];
+            if (v.active)
+                v.finished.store(v.mix_generation,
+                                 std::memory_order_release);
+            v.mix_generation = c.generation;
+            v.active = true;
+            v.mix_one_shot = c.one_shot;
+            v.gain = fade_in ? 0.0 : 1.0;
+            v.target = 1.0;
+            v.step = fade;
+            mix_current_ = c.voice;
+        } else {
+            voice &v = voices_[mix_current_];
+            if (v.active && !v.mix_one_shot) {
+                v.target = 0.0;
+                v.step = fade;
+            }
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        voice &v = voices_[i];
+        unsigned long long start = v.start.load(std::memory_order_acquire);
+        unsigned generation = (unsigned)(start >> 32);
+        unsigned rpos = v.read_pos.load(std::memory_order_relaxed);
+        unsigned wpos = v.write_pos.load(std::memory_order_acquire);
+        if (generation != v.mix_generation || !v.active) {
+            // Skip what the worker decoded for tracks which are over,
+            // but keep a new track whose command has not come yet.
+            if ((int)(generation - v.mix_generation) <= 0)
+                v.read_pos.store(wpos, std::memory_order_release);
+            continue;
+        }
+        unsigned spos = (unsigned)start;
+        if ((int)(spos - rpos) > 0)
+            rpos = spos;
+        bool ended = v.ended.load(std::memory_order_acquire) == generation;
+        wpos = v.write_pos.load(std::memory_order_acquire);
+
+        short *out = samples;
+        int n = std::min(frames, (int)(wpos - rpos));
+        for (int f = 0; f < n && v.active; f++) {
+            if (v.gain < v.target)
+                v.gain = std::min(v.target, v.gain + v.step);
+            else if (v.gain > v.target)
+                v.gain = std::max(v.target, v.gain - v.step);
+            double g = v.gain * volume_;
+            const short *in = &v.ring[(rpos % RING_FRAMES) * channels_];
+            for (int c = 0; c < channels_; c++) {
+                int s = *out + (int)(in[c] * g);
+                *out++ = std::max(-32768, std::min(32767, s));
+            }
+            rpos++;
+            if (v.gain == 0.0 && v.target == 0.0)
+                v.active = false;
+        }
+        if (ended && rpos == wpos)
+            v.active = false;
+        v.read_pos.store(rpos, std::memory_order_release);
+        if (!v.active)
+            v.finished.store(v.mix_generation, std::memory_order_release);
+    }
+}
+
+bool decode_file(const std::string &path, int rate, int channels,
+                 std::vector<short> *samples)
+{
+    decoder dec;
+    if (!dec.start(path, 0.0, rate, channels))
+        return false;
+    std::vector<short> buf(CHUNK_FRAMES * channels);
+    samples->clear();
+    int n;
+    do {
+        n = dec.read(buf.data(), CHUNK_FRAMES, channels, true);
+        samples->insert(samples->end(), buf.begin(),
+                        buf.begin() + n * channels);
+    } while (n == CHUNK_FRAMES);
+    dec.close();
+    return true;
+}
+
+}
@@ -0,0 +1,80 @@
+/* Copyright 2014 Dietrich Epp.
+   This file is part of Oubliette.  Oubliette is licensed under the terms
+   of the 2-clause BSD license.  For more information, see LICENSE.txt. */
+#ifndef LD_GAME_MUSIC_HPP
+#define LD_GAME_MUSIC_HPP
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mixer.hpp"
+namespace audio {
+
+/// Plays music streamed from Ogg Vorbis files.  A worker thread decodes
+/// each track into a small ring buffer, and the audio thread mixes the
+/// buffers, so a track is never decoded all at once.  There are two
+/// voices, so switching tracks crossfades between them.  The audio
+/// thread never locks: it gets commands through a queue, and each ring
+/// has one writer and one reader.
+class music_player {
+private:
+    struct voice;
+    struct command {
+        enum { PLAY, STOP } type;
+        int voice;
+        unsigned generation;
+        bool one_shot;
+    };
+
+    /// Guards the worker's requests, shared with the game thread.
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::unique_ptr<voice[]> voices_;
+    /// Commands for the audio thread.
+    spsc_queue<command, 16> commands_;
+    /// The voice playing the current track, on the game thread.
+    int current_;
+    /// The voice playing the current track, on the audio thread.
+    int mix_current_;
+    int rate_;
+    int channels_;
+    double volume_;
+    bool quit_;
+    std::thread thread_;
+
+    /// Worker thread main loop.
+    void run();
+    /// Send a command to the audio thread.  Returns false if the queue
+    /// is full.
+    bool send(const command &c);
+
+public:
+    /// Start the player, for output with the given sample rate and
+    /// number of channels.
+    music_player(double volume, int rate, int channels);
+    music_player(const music_player &) = delete;
+    ~music_player();
+    music_player &operator=(const music_player &) = delete;
+
+    /// Start playing a track, and fade out the current track unless it
+    /// is a one-shot.  The track loops after loop_length seconds, or
+    /// at the end if loop_length is not positive.
+    void play(const std::string &path, double loop_length, bool one_shot);
+    /// Fade out the current track, unless it is a one-shot.
+    void stop();
+    /// Determine whether the current track is still playing.
+    bool playing();
+    /// Mix the voices, adding them to interleaved samples.  Called from
+    /// the audio thread.
+    void mix(short *samples, int frames);
+};
+
+/// Decode a whole Ogg Vorbis file, converted to the given sample rate
+/// and number of channels.  Returns false on failure.
+bool decode_file(const std::string &path, int rate, int channels,
+                 std::vector<short> *samples);
+
+}
+#endif
@@ -7,6 +7,8 @@
 #include "control.hpp"
 #include "graphics.hpp"
 #include "base/defs.hpp"
+#include "base/file.hpp"
+#include "base/startup.hpp"
 #include "defs.hpp"
 #include <cstdio>
 namespace script {
@@ -18,16 +20,17 @@ using ::graphics::color;
 
 script::script()
 {
-    FILE *fp = fopen("script.txt", "r");
-    if (!fp)
+    startup::phase phase("script");
+    data file;
+    if (!data::read(&file, "script.txt"))
         core::die("Could not open script");
 
     section *sec = nullptr;
 
     std::string whitespace = " \n\t\r";
-    char linebuf[64], *linep;
-    while ((linep = std::fgets(linebuf, sizeof(linebuf), fp)) != nullptr) {
-        std::string str(linebuf);
+    line_reader lines(file);
+    std::string str;
+    while (lines.next(str)) {
         auto end = str.find_last_not_of(whitespace);
         str.resize(end + 1);
         if (str.empty() || str[0] == '#')
@@ -73,8 +76,6 @@ script::script()
         l.lines = 1;
         l.text = str.substr(3);
     }
-
-    std::fclose(fp);
 }
 
 script::~script()
@@ -9,12 +9,12 @@
 #include "script.hpp"
 #include "base/defs.hpp"
 #include <algorithm>
+#include <chrono>
 namespace game {
 
 state::state(bool edit_mode)
-    : edit_mode_(edit_mode), initted_(false)
+    : edit_mode_(edit_mode), initted_(false), audio_(new audio::system)
 {
-    audio_.reset(new audio::system);
     if (!edit_mode)
         script_.reset(new script::script());
     persistent_.health = -1;
@@ -53,6 +53,7 @@ void state::advance(unsigned time)
     } else if (entity_) {
         for (unsigned i = 0; i < nframes; i++) {
             entity_->update();
+            audio_->flush_sfx();
             control_.update();
             if (!entity_->nextlevel.empty()) {
                 std::string level(std::move(entity_->nextlevel));
@@ -141,18 +142,43 @@ void state::next_level()
                 core::die("Invalid command");
             }
         } else {
+            auto start = std::chrono::steady_clock::now();
+            const level_files &files = levels_.take(next);
             std::string lastlevel(std::move(levelname_));
             levelname_ = next;
             entity_.reset(new entity_system(
-                persistent_, control_, *audio_, next, lastlevel));
+                persistent_, control_, *audio_, next, lastlevel, files));
             entity_->update();
-            graphics_.set_level(next);
+            graphics_.set_level(files.texture, files.image);
+            double ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+            static const char *const SOURCE[] = {
+                "resident", "prefetched", "loaded"
+            };
+            typedef level_cache::source source;
+            std::fprintf(stderr, "Loaded level %s in %.1f ms (%s), "
+                         "%u resident, %u prefetched, %u loaded, "
+                         "%u decodes, %u compiled, %zu KiB resident\n",
+                         next.c_str(), ms,
+                         SOURCE[(int)levels_.last_source()],
+                         levels_.count(source::RESIDENT),
+                         levels_.count(source::PREFETCHED),
+                         levels_.count(source::LOADED),
+                         levels_.decodes(), levels_.compiled(),
+                         levels_.bytes() / 1024);
+            // Start on the levels the doors lead to, so they are ready
+            // by the time the player walks through one.
+            for (const auto &target : entity_->door_targets()) {
+                std::string level = target_level(target);
+                if (!level.empty())
+                    levels_.prefetch(level);
+            }
             return;
         }
     }
 }
 
-void state::draw(unsigned time)
+bool state::draw(unsigned time)
 {
     advance(time);
     int reltime = time - frametime_;
@@ -164,7 +190,17 @@ void state::draw(unsigned time)
     else if (editor_)
         editor_->draw(graphics_, reltime);
     graphics_.end();
-    graphics_.draw();
+    return graphics_.draw();
+}
+
+void state::invalidate()
+{
+    graphics_.invalidate();
+}
+
+const soft::image *state::frame() const
+{
+    return graphics_.frame();
 }
 
 void state::mouse_click(int x, int y, int button)
@@ -191,6 +227,7 @@ void state::event_key(key k, bool state)
 void state::set_level(const std::string &name)
 {
     if (edit_mode_) {
+        graphics_.preload_level(name);
         editor_.reset(new editor_system(control_, name));
         editor_->load_data();
         graphics_.set_level(name);
@@ -9,6 +9,7 @@
 #include "camera.hpp"
 #include "control.hpp"
 #include "key.hpp"
+#include "levelcache.hpp"
 #include "levelmap.hpp"
 #include "graphics.hpp"
 #include "persistent.hpp"
@@ -39,6 +40,9 @@ private:
     std::string levelname_;
     /// The control (i.e. player input) system.
     control_system control_;
+    /// The audio system.  This comes before the graphics system so the
+    /// sound effects decode while the graphics load.
+    std::unique_ptr<audio::system> audio_;
     /// The graphics system.
     graphics::system graphics_;
     /// The entity system.
@@ -53,8 +57,8 @@ private:
     std::unique_ptr<script::system> scriptsys_;
     /// Queue for level changes.
     std::vector<std::string> levelqueue_;
-    /// The audio system.
-    std::unique_ptr<audio::system> audio_;
+    /// Levels loaded ahead of time.
+    level_cache levels_;
 
     /// Advance to the given frame.
     void advance(unsigned time);
@@ -71,8 +75,13 @@ public:
 
     /// Set the current level.
     void set_level(const std::string &levelname);
-    /// Draw the game state to the screen.
-    void draw(unsigned time);
+    /// Draw the game state to the screen.  Returns false if the screen
+    /// is unchanged and the window does not need to be swapped.
+    bool draw(unsigned time);
+    /// Force the next frame to be redrawn.
+    void invalidate();
+    /// Get the last frame drawn in software or offscreen, or null.
+    const soft::image *frame() const;
     /// Handle a mouse click event, or button == -1 for release.
     void mouse_click(int x, int y, int button);
     /// Handle a mouse movement event.